@@ -0,0 +1,240 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Times deriving the per-object paths of a large listing, over synthetic S3
+// keys under a model prefix:
+//
+//   path_bench [--keys N] [--rounds N]
+//
+// 'baseline' is the derivation the agent used to do, kept here as it was:
+// a RemoteFile with its own path and location strings per listed object, a
+// substr() copy of every path component for the name check, every parent
+// directory copied into a std::set<std::string>, and JoinPath() over copied
+// std::string segments. 'listing' is what the agent does now, with its own
+// code: Listing::Add() checks the name and interns the components in a
+// PathTree, the location and staged path are built from the tree, and the
+// directories are walked from it. The total length of the derived strings
+// must match between the two. The median time of the rounds is printed for
+// each.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "common_utils.h"
+#include "listing.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly::bench {
+namespace {
+
+const std::string kBucket = "bucket";
+const std::string kPrefix = "models/resnet50/";
+const std::string kFilesDir =
+    "/tmp/triton_repo_agent_1234/.dragonfly-staging-0123456789abcdef/files";
+
+std::string
+BaselineJoinPath(std::initializer_list<std::string> segments)
+{
+  std::string joined;
+  for (const auto& seg : segments) {
+    if (joined.empty()) {
+      joined = seg;
+    } else if (IsAbsolutePath(seg)) {
+      if (joined[joined.size() - 1] == '/') {
+        joined.append(seg.substr(1));
+      } else {
+        joined.append(seg);
+      }
+    } else {
+      if (joined[joined.size() - 1] != '/') {
+        joined.append("/");
+      }
+      joined.append(seg);
+    }
+  }
+  return joined;
+}
+
+bool
+BaselineValidPath(const std::string& path)
+{
+  if (path.empty() || IsAbsolutePath(path)) {
+    return false;
+  }
+  size_t start = 0;
+  while (start < path.size()) {
+    size_t end = path.find('/', start);
+    if (end == std::string::npos) {
+      end = path.size();
+    }
+    const std::string component = path.substr(start, end - start);
+    if (component.empty() || (component == "..") || (component == ".")) {
+      return false;
+    }
+    start = end + 1;
+  }
+  return true;
+}
+
+// Returns a checksum of the derived strings, so that neither variant is
+// optimized away and both can be compared
+size_t
+Baseline(const std::vector<std::string>& keys)
+{
+  std::vector<RemoteFile> files;
+  for (const auto& key : keys) {
+    RemoteFile file;
+    file.path = key.substr(kPrefix.size());
+    file.location = kBucket + '/' + key;
+    files.push_back(std::move(file));
+  }
+
+  size_t sum = 0;
+  std::set<std::string> dirs;
+  for (const auto& file : files) {
+    if (!BaselineValidPath(file.path)) {
+      return 0;
+    }
+    size_t slash = file.path.find('/');
+    while (slash != std::string::npos) {
+      dirs.insert(file.path.substr(0, slash));
+      slash = file.path.find('/', slash + 1);
+    }
+    sum += file.location.size() +
+           BaselineJoinPath({kFilesDir, file.path}).size();
+  }
+  for (const auto& dir : dirs) {
+    sum += BaselineJoinPath({kFilesDir, dir}).size();
+  }
+  return sum;
+}
+
+size_t
+Current(const std::vector<std::string>& keys)
+{
+  size_t sum = 0;
+  Listing listing;
+  listing.SetLocationBase(kBucket + '/' + kPrefix);
+  for (const auto& key : keys) {
+    TRITONSERVER_Error* err =
+        listing.Add(std::string_view(key).substr(kPrefix.size()), 0);
+    if (err != nullptr) {
+      TRITONSERVER_ErrorDelete(err);
+      return 0;
+    }
+  }
+  for (Listing::FileId file = 0; file < listing.FileCount(); ++file) {
+    sum += listing.Location(file).size() +
+           JoinPath({kFilesDir, listing.Path(file)}).size();
+  }
+  const PathTree& tree = listing.Tree();
+  for (PathTree::NodeId node = PathTree::kRoot + 1; node < tree.NodeCount();
+       ++node) {
+    if (listing.IsDirectory(node)) {
+      sum += JoinPath({kFilesDir, tree.Path(node)}).size();
+    }
+  }
+  return sum;
+}
+
+double
+TimeMs(size_t (*variant)(const std::vector<std::string>&),
+       const std::vector<std::string>& keys, size_t* sum)
+{
+  const auto start = std::chrono::steady_clock::now();
+  *sum = variant(keys);
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+int
+Main(int argc, char** argv)
+{
+  uint64_t key_count = 1000000;
+  uint64_t rounds = 5;
+  bool valid = ((argc % 2) == 1);
+  for (int i = 1; valid && (i + 1 < argc); i += 2) {
+    const std::string flag = argv[i];
+    const uint64_t value = strtoull(argv[i + 1], nullptr, 10);
+    if (flag == "--keys") {
+      key_count = value;
+    } else if (flag == "--rounds") {
+      rounds = value;
+    } else {
+      valid = false;
+    }
+  }
+  if (!valid || (key_count == 0) || (rounds == 0)) {
+    fprintf(stderr, "Usage: %s [--keys N] [--rounds N]\n", argv[0]);
+    return 2;
+  }
+
+  // 50 versions of a model sharded into many files, the shape of a large
+  // listing: few directories, many files in each
+  std::vector<std::string> keys;
+  keys.reserve(key_count);
+  for (uint64_t i = 0; i < key_count; ++i) {
+    keys.push_back(
+        kPrefix + std::to_string(i % 50 + 1) + "/shards/part-" +
+        std::to_string(i) + ".bin");
+  }
+
+  std::vector<double> baseline_ms, current_ms;
+  size_t baseline_sum = 0, current_sum = 0;
+  for (uint64_t i = 0; i < rounds; ++i) {
+    baseline_ms.push_back(TimeMs(Baseline, keys, &baseline_sum));
+    current_ms.push_back(TimeMs(Current, keys, &current_sum));
+  }
+  if (baseline_sum != current_sum) {
+    fprintf(
+        stderr, "The variants disagree: %zu and %zu bytes\n", baseline_sum,
+        current_sum);
+    return 1;
+  }
+
+  std::sort(baseline_ms.begin(), baseline_ms.end());
+  std::sort(current_ms.begin(), current_ms.end());
+  printf(
+      "%llu keys, median of %llu rounds\n",
+      static_cast<unsigned long long>(key_count),
+      static_cast<unsigned long long>(rounds));
+  printf("%-10s %10s %10s\n", "", "ms", "ns/key");
+  for (const auto& row :
+       {std::make_pair("baseline", baseline_ms[rounds / 2]),
+        std::make_pair("listing", current_ms[rounds / 2])}) {
+    printf(
+        "%-10s %10.1f %10.1f\n", row.first, row.second,
+        row.second * 1e6 / key_count);
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace triton::repoagent::dragonfly::bench
+
+int
+main(int argc, char** argv)
+{
+  return triton::repoagent::dragonfly::bench::Main(argc, argv);
+}
@@ -0,0 +1,530 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace triton::repoagent::dragonfly::bench {
+
+// Stand-in for the local dfdaemon: answers every GET, whether its target is
+// a path or an absolute URL as a proxy receives it, with 'body_size' bytes
+// after 'latency_us' of service time. It listens on a loopback TCP port and
+// on a unix domain socket and serves every connection on a thread of its
+// own with HTTP/1.1 keep-alive, so the transport is the only difference
+// between the two. A TCP connection that opens with the HTTP/2 preface is
+// served as h2c with prior knowledge instead: every stream gets the same
+// response, sent in turns as the flow control windows allow, and streams
+// wait out 'latency_us' side by side rather than one after another.
+class StandInServer {
+ public:
+  StandInServer(uint64_t body_size, uint64_t latency_us)
+      : body_(body_size, 'x'), latency_us_(latency_us)
+  {
+  }
+  ~StandInServer() { Stop(); }
+
+  StandInServer(const StandInServer&) = delete;
+  StandInServer& operator=(const StandInServer&) = delete;
+
+  // Listen on an ephemeral port of 127.0.0.1 and at 'socket_path'
+  bool Start(const std::string& socket_path, std::string* error);
+
+  // Close the listeners and every connection and wait for their threads
+  void Stop();
+
+  int Port() const { return port_; }
+  uint64_t Requests() const { return requests_; }
+  uint64_t Connections() const { return connections_; }
+
+ private:
+  void Accept(int listener);
+  void Serve(int fd);
+  // Answer the requests in 'buffered' and those read after it until the
+  // client closes the connection or asks to
+  void ServeHttp1(int fd, std::string buffered);
+  void Respond(int fd, bool head);
+  // Answer the streams of an HTTP/2 connection whose preface has been read
+  // and is followed by 'buffered', until the client goes away
+  void ServeHttp2(int fd, std::string buffered);
+
+  static bool WriteAll(int fd, struct iovec* iov, int count);
+  static bool WriteAll(int fd, const std::string& data);
+
+  const std::string body_;
+  const uint64_t latency_us_;
+  std::string socket_path_;
+  int port_ = 0;
+  std::atomic<uint64_t> requests_{0};
+  std::atomic<uint64_t> connections_{0};
+
+  std::mutex mu_;
+  bool stopping_ = false;
+  std::vector<int> listeners_;
+  std::vector<int> clients_;
+  std::vector<std::thread> threads_;
+};
+
+bool
+StandInServer::Start(const std::string& socket_path, std::string* error)
+{
+  int tcp = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in in_addr;
+  memset(&in_addr, 0, sizeof(in_addr));
+  in_addr.sin_family = AF_INET;
+  in_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t in_len = sizeof(in_addr);
+  if ((tcp == -1) ||
+      (bind(tcp, reinterpret_cast<struct sockaddr*>(&in_addr), in_len) ==
+       -1) ||
+      (listen(tcp, 128) == -1) ||
+      (getsockname(
+           tcp, reinterpret_cast<struct sockaddr*>(&in_addr), &in_len) ==
+       -1)) {
+    *error = std::string("TCP listener: ") + strerror(errno);
+    if (tcp != -1) {
+      close(tcp);
+    }
+    return false;
+  }
+  port_ = ntohs(in_addr.sin_port);
+
+  struct sockaddr_un un_addr;
+  memset(&un_addr, 0, sizeof(un_addr));
+  un_addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(un_addr.sun_path)) {
+    *error = "Socket path too long: " + socket_path;
+    close(tcp);
+    return false;
+  }
+  memcpy(un_addr.sun_path, socket_path.c_str(), socket_path.size());
+  unlink(socket_path.c_str());
+  int uds = socket(AF_UNIX, SOCK_STREAM, 0);
+  if ((uds == -1) ||
+      (bind(
+           uds, reinterpret_cast<struct sockaddr*>(&un_addr),
+           sizeof(un_addr)) == -1) ||
+      (listen(uds, 128) == -1)) {
+    *error = "Unix socket listener " + socket_path + ": " + strerror(errno);
+    if (uds != -1) {
+      close(uds);
+    }
+    close(tcp);
+    return false;
+  }
+  socket_path_ = socket_path;
+
+  std::lock_guard<std::mutex> lock(mu_);
+  for (int listener : {tcp, uds}) {
+    listeners_.push_back(listener);
+    threads_.emplace_back(&StandInServer::Accept, this, listener);
+  }
+  return true;
+}
+
+void
+StandInServer::Stop()
+{
+  std::vector<std::thread> threads;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stopping_ = true;
+    // shutdown() wakes the threads blocked in accept() and read(), the
+    // descriptors are closed by their owners
+    for (int fd : listeners_) {
+      shutdown(fd, SHUT_RDWR);
+    }
+    for (int fd : clients_) {
+      shutdown(fd, SHUT_RDWR);
+    }
+  }
+  // Accept() adds threads until it sees 'stopping_', so join until none is
+  // left
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (threads_.empty()) {
+        break;
+      }
+      threads.swap(threads_);
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    threads.clear();
+  }
+  listeners_.clear();
+  if (!socket_path_.empty()) {
+    unlink(socket_path_.c_str());
+    socket_path_.clear();
+  }
+}
+
+void
+StandInServer::Accept(int listener)
+{
+  while (true) {
+    int fd = accept(listener, nullptr, nullptr);
+    std::lock_guard<std::mutex> lock(mu_);
+    if (stopping_) {
+      if (fd != -1) {
+        close(fd);
+      }
+      break;
+    }
+    if (fd == -1) {
+      continue;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    ++connections_;
+    clients_.push_back(fd);
+    threads_.emplace_back(&StandInServer::Serve, this, fd);
+  }
+  close(listener);
+}
+
+void
+StandInServer::Serve(int fd)
+{
+  static const char kPreface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+  const size_t preface_size = sizeof(kPreface) - 1;
+  // Read as long as what came so far may still be the HTTP/2 preface
+  std::string buffered;
+  char chunk[1024];
+  bool open = true;
+  while (open && (buffered.size() < preface_size) &&
+         (buffered.compare(0, std::string::npos, kPreface, buffered.size()) ==
+          0)) {
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    open = (n > 0);
+    if (open) {
+      buffered.append(chunk, n);
+    }
+  }
+  if (open && (buffered.compare(0, preface_size, kPreface) == 0)) {
+    ServeHttp2(fd, buffered.substr(preface_size));
+  } else if (open) {
+    ServeHttp1(fd, buffered);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    clients_.erase(std::find(clients_.begin(), clients_.end(), fd));
+  }
+  close(fd);
+}
+
+void
+StandInServer::ServeHttp1(int fd, std::string buffered)
+{
+  char chunk[16384];
+  while (true) {
+    size_t end;
+    while ((end = buffered.find("\r\n\r\n")) == std::string::npos) {
+      ssize_t n = read(fd, chunk, sizeof(chunk));
+      if (n <= 0) {
+        return;
+      }
+      buffered.append(chunk, n);
+    }
+    std::string head = buffered.substr(0, end);
+    buffered.erase(0, end + 4);
+    std::transform(head.begin(), head.end(), head.begin(), [](char c) {
+      return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    });
+
+    Respond(fd, head.compare(0, 5, "head ") == 0);
+    if (head.find("\r\nconnection: close") != std::string::npos) {
+      return;
+    }
+  }
+}
+
+void
+StandInServer::Respond(int fd, bool head)
+{
+  ++requests_;
+  if (latency_us_ > 0) {
+    usleep(latency_us_);
+  }
+  char header[128];
+  int length = snprintf(
+      header, sizeof(header),
+      "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n"
+      "Content-Type: application/octet-stream\r\n\r\n",
+      body_.size());
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = length;
+  iov[1].iov_base = const_cast<char*>(body_.data());
+  iov[1].iov_len = head ? 0 : body_.size();
+  WriteAll(fd, iov, 2);
+}
+
+// HTTP/2 frame types and flags, RFC 9113 section 6
+constexpr uint8_t kFrameData = 0x0;
+constexpr uint8_t kFrameHeaders = 0x1;
+constexpr uint8_t kFrameRstStream = 0x3;
+constexpr uint8_t kFrameSettings = 0x4;
+constexpr uint8_t kFramePing = 0x6;
+constexpr uint8_t kFrameGoAway = 0x7;
+constexpr uint8_t kFrameWindowUpdate = 0x8;
+constexpr uint8_t kFrameContinuation = 0x9;
+constexpr uint8_t kFlagEndStream = 0x1;
+constexpr uint8_t kFlagAck = 0x1;
+constexpr uint8_t kFlagEndHeaders = 0x4;
+constexpr uint16_t kSettingInitialWindowSize = 0x4;
+constexpr uint16_t kSettingMaxFrameSize = 0x5;
+constexpr size_t kFrameHeaderSize = 9;
+
+uint32_t
+ReadUint32(const char* data)
+{
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+  return (static_cast<uint32_t>(bytes[0]) << 24) |
+         (static_cast<uint32_t>(bytes[1]) << 16) |
+         (static_cast<uint32_t>(bytes[2]) << 8) | bytes[3];
+}
+
+void
+AppendHttp2Frame(
+    std::string* out, uint8_t type, uint8_t flags, uint32_t stream,
+    const char* payload, size_t size)
+{
+  const char header[kFrameHeaderSize] = {
+      static_cast<char>(size >> 16),   static_cast<char>(size >> 8),
+      static_cast<char>(size),         static_cast<char>(type),
+      static_cast<char>(flags),        static_cast<char>(stream >> 24),
+      static_cast<char>(stream >> 16), static_cast<char>(stream >> 8),
+      static_cast<char>(stream)};
+  out->append(header, kFrameHeaderSize);
+  if (size > 0) {
+    out->append(payload, size);
+  }
+}
+
+void
+StandInServer::ServeHttp2(int fd, std::string buffered)
+{
+  struct Stream {
+    std::chrono::steady_clock::time_point ready_at;
+    int64_t window = 0;
+    size_t sent = 0;
+    bool headers_sent = false;
+  };
+
+  // The same header block answers every stream: ":status: 200" from the
+  // static table and "content-length" as a literal with an indexed name
+  const std::string length = std::to_string(body_.size());
+  std::string response_headers = "\x88\x0f\x0d";
+  response_headers += static_cast<char>(length.size());
+  response_headers += length;
+
+  int64_t connection_window = 65535;
+  int64_t initial_window = 65535;
+  size_t max_frame = 16384;
+  std::map<uint32_t, Stream> streams;
+  // Stream whose header block goes on in CONTINUATION frames
+  uint32_t continued = 0;
+
+  std::string out;
+  AppendHttp2Frame(&out, kFrameSettings, 0, 0, nullptr, 0);
+  char chunk[16384];
+  while (true) {
+    // Handle every complete frame read so far
+    size_t offset = 0;
+    while (buffered.size() - offset >= kFrameHeaderSize) {
+      const char* frame = buffered.data() + offset;
+      const size_t size = (ReadUint32(frame) >> 8);
+      if (buffered.size() - offset < kFrameHeaderSize + size) {
+        break;
+      }
+      const uint8_t type = frame[3];
+      const uint8_t flags = frame[4];
+      const uint32_t id = ReadUint32(frame + 5) & 0x7fffffff;
+      const char* payload = frame + kFrameHeaderSize;
+      offset += kFrameHeaderSize + size;
+
+      if ((type == kFrameHeaders) || (type == kFrameContinuation)) {
+        // The request headers do not matter, every stream gets the body
+        continued = (flags & kFlagEndHeaders) ? 0 : id;
+        if (type == kFrameHeaders) {
+          ++requests_;
+          Stream& stream = streams[id];
+          stream.ready_at = std::chrono::steady_clock::now() +
+                            std::chrono::microseconds(latency_us_);
+          stream.window = initial_window;
+        }
+      } else if ((type == kFrameSettings) && !(flags & kFlagAck)) {
+        for (size_t i = 0; i + 6 <= size; i += 6) {
+          const uint16_t setting = (static_cast<uint8_t>(payload[i]) << 8) |
+                                   static_cast<uint8_t>(payload[i + 1]);
+          const uint32_t value = ReadUint32(payload + i + 2);
+          if (setting == kSettingInitialWindowSize) {
+            for (auto& entry : streams) {
+              entry.second.window += int64_t(value) - initial_window;
+            }
+            initial_window = value;
+          } else if (setting == kSettingMaxFrameSize) {
+            max_frame = value;
+          }
+        }
+        AppendHttp2Frame(&out, kFrameSettings, kFlagAck, 0, nullptr, 0);
+      } else if ((type == kFramePing) && !(flags & kFlagAck) && (size == 8)) {
+        AppendHttp2Frame(&out, kFramePing, kFlagAck, 0, payload, size);
+      } else if ((type == kFrameWindowUpdate) && (size == 4)) {
+        const uint32_t increment = ReadUint32(payload) & 0x7fffffff;
+        if (id == 0) {
+          connection_window += increment;
+        } else {
+          auto it = streams.find(id);
+          if (it != streams.end()) {
+            it->second.window += increment;
+          }
+        }
+      } else if (type == kFrameRstStream) {
+        streams.erase(id);
+      } else if (type == kFrameGoAway) {
+        WriteAll(fd, out);
+        return;
+      }
+    }
+    buffered.erase(0, offset);
+
+    // Send what the windows allow, a frame per stream in turn
+    const auto now = std::chrono::steady_clock::now();
+    auto next_ready = std::chrono::steady_clock::time_point::max();
+    bool sent = true;
+    while (sent) {
+      sent = false;
+      for (auto it = streams.begin(); it != streams.end();) {
+        Stream& stream = it->second;
+        if ((stream.ready_at > now) || (it->first == continued)) {
+          next_ready = std::min(next_ready, stream.ready_at);
+          ++it;
+          continue;
+        }
+        if (!stream.headers_sent) {
+          const uint8_t flags =
+              kFlagEndHeaders | (body_.empty() ? kFlagEndStream : 0);
+          AppendHttp2Frame(
+              &out, kFrameHeaders, flags, it->first, response_headers.data(),
+              response_headers.size());
+          stream.headers_sent = true;
+          sent = true;
+        }
+        const int64_t window = std::min(connection_window, stream.window);
+        const size_t left = body_.size() - stream.sent;
+        if ((left > 0) && (window > 0)) {
+          const size_t size = std::min<size_t>(
+              std::min<size_t>(left, max_frame), static_cast<size_t>(window));
+          AppendHttp2Frame(
+              &out, kFrameData, (size == left) ? kFlagEndStream : 0, it->first,
+              body_.data() + stream.sent, size);
+          stream.sent += size;
+          stream.window -= size;
+          connection_window -= size;
+          sent = true;
+        }
+        if (stream.sent == body_.size()) {
+          it = streams.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+    if (!out.empty()) {
+      if (!WriteAll(fd, out)) {
+        return;
+      }
+      out.clear();
+    }
+
+    // Wait for more frames, or for the next stream to be ready
+    int timeout_ms = -1;
+    if (next_ready != std::chrono::steady_clock::time_point::max()) {
+      timeout_ms = static_cast<int>(
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              next_ready - std::chrono::steady_clock::now() +
+              std::chrono::microseconds(999))
+              .count());
+      timeout_ms = std::max(timeout_ms, 0);
+    }
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) > 0) {
+      ssize_t n = read(fd, chunk, sizeof(chunk));
+      if (n <= 0) {
+        return;
+      }
+      buffered.append(chunk, n);
+    }
+  }
+}
+
+bool
+StandInServer::WriteAll(int fd, const std::string& data)
+{
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(data.data());
+  iov.iov_len = data.size();
+  return WriteAll(fd, &iov, 1);
+}
+
+bool
+StandInServer::WriteAll(int fd, struct iovec* iov, int count)
+{
+  while (count > 0) {
+    ssize_t n = writev(fd, iov, count);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    while ((count > 0) && (static_cast<size_t>(n) >= iov->iov_len)) {
+      n -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+}  // namespace triton::repoagent::dragonfly::bench
@@ -0,0 +1,280 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Times the download of many small files from the stand-in daemon, see
+// StandInServer, over each transport the agent can be configured with:
+//
+//   tcp proxy   'proxy' set to its loopback TCP port
+//   unix proxy  'proxy_unix_socket' set to its unix domain socket
+//   http/1.1    straight to its TCP port with 'http_version' "1.1", one
+//               connection per transfer running at once
+//   h2c         straight to its TCP port with 'http_version'
+//               "2-prior-knowledge", up to 'streams' transfers multiplexed
+//               over a connection
+//
+//   transport_bench [--files N] [--size BYTES] [--concurrency N]
+//                   [--streams N] [--latency-us US] [--rounds N] [--dir DIR]
+//
+// Each round runs a TransferEngine over every file, after one warm-up round
+// that is not counted. The files go below 'dir', /dev/shm unless given, so
+// that the filesystem stays out of the timings. The median wall time and
+// CPU time of the downloading thread are printed per transport, with the
+// connections the stand-in accepted.
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "common_utils.h"
+#include "config.h"
+#include "stand_in_server.h"
+#include "transfer.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly::bench {
+namespace {
+
+struct Options {
+  uint64_t files = 2000;
+  uint64_t size = 4096;
+  uint64_t concurrency = 8;
+  uint64_t streams = 100;
+  uint64_t latency_us = 0;
+  uint64_t rounds = 5;
+  std::string dir = "/dev/shm";
+};
+
+struct Round {
+  double wall_ms = 0;
+  double cpu_ms = 0;
+};
+
+double
+ThreadCpuMs()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3;
+}
+
+double
+Median(std::vector<double> values)
+{
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+// Download every file below 'origin' once with 'config' into a fresh
+// directory
+TRITONSERVER_Error*
+RunRound(
+    DragonflyConfig& config, const std::string& origin,
+    const Options& options, Round* round)
+{
+  std::string pattern = options.dir + "/dragonfly-bench-XXXXXX";
+  std::vector<char> buffer(pattern.begin(), pattern.end());
+  buffer.push_back('\0');
+  if (mkdtemp(buffer.data()) == nullptr) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to create a directory in " + options.dir +
+         ", errno:" + strerror(errno))
+            .c_str());
+  }
+  const std::string dir = buffer.data();
+
+  TRITONSERVER_Error* err = nullptr;
+  {
+    TransferEngine engine(config);
+    for (uint64_t i = 0; i < options.files; ++i) {
+      TransferRequest request;
+      request.url = origin + "/model/" + std::to_string(i);
+      request.path = dir + "/" + std::to_string(i);
+      request.size = options.size;
+      engine.Add(std::move(request));
+    }
+
+    const double cpu_start = ThreadCpuMs();
+    const auto start = std::chrono::steady_clock::now();
+    err = engine.Run();
+    round->wall_ms = std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    round->cpu_ms = ThreadCpuMs() - cpu_start;
+  }
+
+  TRITONSERVER_Error* remove_err = RemoveAll(dir);
+  if (err == nullptr) {
+    return remove_err;
+  }
+  TRITONSERVER_ErrorDelete(remove_err);
+  return err;
+}
+
+TRITONSERVER_Error*
+RunTransport(
+    const char* name, DragonflyConfig& config, const std::string& origin,
+    const Options& options, StandInServer& server)
+{
+  // The agent keeps connections across loads in the process-wide pool,
+  // so does the benchmark across rounds
+  InitializeConnectionPool();
+  const uint64_t connections = server.Connections();
+  std::vector<double> wall_ms, cpu_ms;
+  for (uint64_t i = 0; i <= options.rounds; ++i) {
+    Round round;
+    RETURN_IF_ERROR(RunRound(config, origin, options, &round));
+    if (i > 0) {
+      wall_ms.push_back(round.wall_ms);
+      cpu_ms.push_back(round.cpu_ms);
+    }
+  }
+  FinalizeConnectionPool();
+
+  const double wall = Median(wall_ms);
+  const double cpu = Median(cpu_ms);
+  printf(
+      "%-10s %10.1f %10.0f %10.1f %12.2f %12llu\n", name, wall,
+      options.files / (wall / 1e3), cpu, cpu * 1e3 / options.files,
+      static_cast<unsigned long long>(server.Connections() - connections));
+  return nullptr;
+}
+
+bool
+ParseOptions(int argc, char** argv, Options* options)
+{
+  for (int i = 1; i + 1 < argc; i += 2) {
+    const std::string flag = argv[i];
+    if (flag == "--dir") {
+      options->dir = argv[i + 1];
+      continue;
+    }
+    const uint64_t value = strtoull(argv[i + 1], nullptr, 10);
+    if (flag == "--files") {
+      options->files = value;
+    } else if (flag == "--size") {
+      options->size = value;
+    } else if (flag == "--concurrency") {
+      options->concurrency = value;
+    } else if (flag == "--streams") {
+      options->streams = value;
+    } else if (flag == "--latency-us") {
+      options->latency_us = value;
+    } else if (flag == "--rounds") {
+      options->rounds = value;
+    } else {
+      return false;
+    }
+  }
+  return ((argc % 2) == 1) && (options->files > 0) &&
+         (options->concurrency > 0) && (options->rounds > 0);
+}
+
+int
+Main(int argc, char** argv)
+{
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) {
+    fprintf(
+        stderr,
+        "Usage: %s [--files N] [--size BYTES] [--concurrency N] "
+        "[--streams N] [--latency-us US] [--rounds N] [--dir DIR]\n",
+        argv[0]);
+    return 2;
+  }
+
+  StandInServer server(options.size, options.latency_us);
+  std::string error;
+  const std::string socket_path =
+      "/tmp/dragonfly-bench-" + std::to_string(getpid()) + ".sock";
+  if (!server.Start(socket_path, &error)) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+
+  // Through a proxy the origin host is only a name in the request, the
+  // direct transports connect to the stand-in itself
+  const std::string proxied_origin = "http://origin.bench";
+  const std::string direct_origin =
+      "http://127.0.0.1:" + std::to_string(server.Port());
+  triton::common::TritonJson::Value json;
+  json.Parse("{}");
+  DragonflyConfig tcp_config(json);
+  tcp_config.concurrency = options.concurrency;
+  tcp_config.proxy = direct_origin;
+  DragonflyConfig uds_config(json);
+  uds_config.concurrency = options.concurrency;
+  uds_config.proxy_unix_socket = socket_path;
+  DragonflyConfig http1_config(json);
+  http1_config.concurrency = options.concurrency;
+  http1_config.http_version = "1.1";
+  DragonflyConfig h2c_config(json);
+  h2c_config.concurrency = options.concurrency;
+  h2c_config.http_version = "2-prior-knowledge";
+  h2c_config.max_concurrent_streams = options.streams;
+
+  printf(
+      "%llu files of %llu bytes, concurrency %llu, streams %llu, "
+      "latency %llu us, median of %llu rounds\n",
+      static_cast<unsigned long long>(options.files),
+      static_cast<unsigned long long>(options.size),
+      static_cast<unsigned long long>(options.concurrency),
+      static_cast<unsigned long long>(options.streams),
+      static_cast<unsigned long long>(options.latency_us),
+      static_cast<unsigned long long>(options.rounds));
+  printf(
+      "%-10s %10s %10s %10s %12s %12s\n", "", "wall ms", "files/s", "cpu ms",
+      "cpu us/file", "connections");
+
+  TRITONSERVER_Error* err = RunTransport(
+      "tcp proxy", tcp_config, proxied_origin, options, server);
+  if (err == nullptr) {
+    err = RunTransport(
+        "unix proxy", uds_config, proxied_origin, options, server);
+  }
+  if (err == nullptr) {
+    err = RunTransport(
+        "http/1.1", http1_config, direct_origin, options, server);
+  }
+  if (err == nullptr) {
+    err = RunTransport("h2c", h2c_config, direct_origin, options, server);
+  }
+  server.Stop();
+  if (err != nullptr) {
+    fprintf(stderr, "%s\n", TRITONSERVER_ErrorMessage(err));
+    TRITONSERVER_ErrorDelete(err);
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace triton::repoagent::dragonfly::bench
+
+int
+main(int argc, char** argv)
+{
+  return triton::repoagent::dragonfly::bench::Main(argc, argv);
+}
@@ -0,0 +1,124 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The few TRITONSERVER_* functions the agent headers call, so that the
+// benchmarks link without a Triton server. Errors are real, log messages go
+// to stderr and metrics are dropped.
+
+#include <cstdio>
+#include <string>
+
+#include "triton/core/tritonserver.h"
+
+struct TRITONSERVER_Error {
+  TRITONSERVER_Error_Code code;
+  std::string message;
+};
+
+struct TRITONSERVER_MetricFamily {
+};
+
+struct TRITONSERVER_Metric {
+};
+
+extern "C" {
+
+TRITONSERVER_Error*
+TRITONSERVER_ErrorNew(TRITONSERVER_Error_Code code, const char* msg)
+{
+  return new TRITONSERVER_Error{code, msg};
+}
+
+void
+TRITONSERVER_ErrorDelete(TRITONSERVER_Error* error)
+{
+  delete error;
+}
+
+TRITONSERVER_Error_Code
+TRITONSERVER_ErrorCode(TRITONSERVER_Error* error)
+{
+  return error->code;
+}
+
+const char*
+TRITONSERVER_ErrorMessage(TRITONSERVER_Error* error)
+{
+  return error->message.c_str();
+}
+
+bool
+TRITONSERVER_LogIsEnabled(TRITONSERVER_LogLevel level)
+{
+  return level != TRITONSERVER_LOG_VERBOSE;
+}
+
+TRITONSERVER_Error*
+TRITONSERVER_LogMessage(
+    TRITONSERVER_LogLevel level, const char* filename, const int line,
+    const char* msg)
+{
+  if (TRITONSERVER_LogIsEnabled(level)) {
+    fprintf(stderr, "%s:%d] %s\n", filename, line, msg);
+  }
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+TRITONSERVER_MetricFamilyNew(
+    TRITONSERVER_MetricFamily** family, const TRITONSERVER_MetricKind kind,
+    const char* name, const char* description)
+{
+  *family = new TRITONSERVER_MetricFamily();
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+TRITONSERVER_MetricFamilyDelete(TRITONSERVER_MetricFamily* family)
+{
+  delete family;
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+TRITONSERVER_MetricNew(
+    TRITONSERVER_Metric** metric, TRITONSERVER_MetricFamily* family,
+    const TRITONSERVER_Parameter** labels, const uint64_t label_count)
+{
+  *metric = new TRITONSERVER_Metric();
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+TRITONSERVER_MetricDelete(TRITONSERVER_Metric* metric)
+{
+  delete metric;
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+TRITONSERVER_MetricSet(TRITONSERVER_Metric* metric, double value)
+{
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+TRITONSERVER_MetricIncrement(TRITONSERVER_Metric* metric, double value)
+{
+  return nullptr;
+}
+
+}  // extern "C"
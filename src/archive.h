@@ -0,0 +1,534 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "archive_format.h"
+#include "rate_limiter.h"
+#include "status.h"
+#include "triton/core/tritonserver.h"
+#include "zlib.h"
+#include "zstd.h"
+
+namespace triton::repoagent::dragonfly {
+
+// Incremental extractor for a (possibly compressed) tar stream. Data is fed
+// in whatever chunks the transfer delivers and entries are written below
+// 'dest_dir' as they arrive, so the archive itself never touches the disk.
+// Regular files and directories are extracted; links and special files are
+// skipped.
+class ArchiveExtractor {
+ public:
+  ArchiveExtractor(const std::string& dest_dir, ArchiveCompression compression);
+  ~ArchiveExtractor();
+
+  ArchiveExtractor(const ArchiveExtractor&) = delete;
+  ArchiveExtractor& operator=(const ArchiveExtractor&) = delete;
+
+  // Consume the next 'size' bytes of the archive.
+  TRITONSERVER_Error* Write(const char* data, size_t size);
+
+  // Verify that the archive was complete.
+  TRITONSERVER_Error* Finish();
+
+ private:
+  static constexpr size_t kBlockSize = 512;
+
+  enum class State { HEADER, DATA, PADDING, END };
+  enum class Sink { FILE, META, DISCARD };
+
+  TRITONSERVER_Error* Inflate(const char* data, size_t size);
+  TRITONSERVER_Error* Decompress(const char* data, size_t size);
+  TRITONSERVER_Error* Untar(const char* data, size_t size);
+  TRITONSERVER_Error* ProcessHeader();
+  TRITONSERVER_Error* FinishEntry();
+  TRITONSERVER_Error* OpenFile(const std::string& name);
+  TRITONSERVER_Error* MakeDirectories(const std::string& name, bool leaf);
+  TRITONSERVER_Error* SanitizeName(std::string* name);
+  void ParsePaxHeader();
+
+  std::string dest_dir_;
+  ArchiveCompression compression_;
+
+  z_stream zstrm_;
+  bool zstrm_done_ = false;
+  ZSTD_DStream* zstd_ = nullptr;
+  size_t zstd_ret_ = 0;
+  std::vector<char> out_buffer_;
+
+  State state_ = State::HEADER;
+  char header_[kBlockSize];
+  size_t header_fill_ = 0;
+  size_t zero_blocks_ = 0;
+
+  Sink sink_ = Sink::DISCARD;
+  char entry_type_ = '0';
+  uint64_t remaining_ = 0;
+  uint64_t padding_ = 0;
+  std::string entry_name_;
+  std::string meta_;
+  std::string pending_name_;
+  FILE* fp_ = nullptr;
+};
+
+ArchiveExtractor::ArchiveExtractor(
+    const std::string& dest_dir, ArchiveCompression compression)
+    : dest_dir_(dest_dir), compression_(compression)
+{
+  memset(&zstrm_, 0, sizeof(zstrm_));
+  if (compression_ == ArchiveCompression::GZIP) {
+    // 32 enables automatic gzip / zlib header detection
+    inflateInit2(&zstrm_, 15 + 32);
+    out_buffer_.resize(64 * 1024);
+  } else if (compression_ == ArchiveCompression::ZSTD) {
+    zstd_ = ZSTD_createDStream();
+    ZSTD_initDStream(zstd_);
+    out_buffer_.resize(ZSTD_DStreamOutSize());
+  }
+}
+
+ArchiveExtractor::~ArchiveExtractor()
+{
+  if (fp_) {
+    fclose(fp_);
+  }
+  if (compression_ == ArchiveCompression::GZIP) {
+    inflateEnd(&zstrm_);
+  }
+  if (zstd_) {
+    ZSTD_freeDStream(zstd_);
+  }
+}
+
+TRITONSERVER_Error*
+ArchiveExtractor::Write(const char* data, size_t size)
+{
+  switch (compression_) {
+    case ArchiveCompression::GZIP:
+      return Inflate(data, size);
+    case ArchiveCompression::ZSTD:
+      return Decompress(data, size);
+    default:
+      return Untar(data, size);
+  }
+}
+
+TRITONSERVER_Error*
+ArchiveExtractor::Finish()
+{
+  if ((compression_ == ArchiveCompression::GZIP) && !zstrm_done_) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL, "Truncated gzip stream in model archive");
+  }
+  if ((compression_ == ArchiveCompression::ZSTD) && (zstd_ret_ != 0)) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL, "Truncated zstd stream in model archive");
+  }
+
+  // Some writers omit the trailing zero blocks, accept an archive that ends
+  // cleanly on an entry boundary.
+  if ((state_ != State::END) &&
+      !((state_ == State::HEADER) && (header_fill_ == 0))) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Truncated model archive while extracting " + entry_name_).c_str());
+  }
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+ArchiveExtractor::Inflate(const char* data, size_t size)
+{
+  zstrm_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  zstrm_.avail_in = size;
+  do {
+    if (zstrm_done_) {
+      // Concatenated gzip members
+      inflateReset(&zstrm_);
+      zstrm_done_ = false;
+    }
+    zstrm_.next_out = reinterpret_cast<Bytef*>(out_buffer_.data());
+    zstrm_.avail_out = out_buffer_.size();
+    int ret = inflate(&zstrm_, Z_NO_FLUSH);
+    if ((ret != Z_OK) && (ret != Z_STREAM_END) && (ret != Z_BUF_ERROR)) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INTERNAL,
+          (std::string("Failed to decompress gzip model archive: ") +
+           (zstrm_.msg ? zstrm_.msg : zError(ret)))
+              .c_str());
+    }
+    RETURN_IF_ERROR(
+        Untar(out_buffer_.data(), out_buffer_.size() - zstrm_.avail_out));
+    if (ret == Z_STREAM_END) {
+      // All output of the member has been flushed at this point
+      zstrm_done_ = true;
+      if (zstrm_.avail_in == 0) {
+        break;
+      }
+    } else if ((ret == Z_BUF_ERROR) && (zstrm_.avail_out != 0)) {
+      break;
+    }
+  } while ((zstrm_.avail_in > 0) || (zstrm_.avail_out == 0));
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+ArchiveExtractor::Decompress(const char* data, size_t size)
+{
+  ZSTD_inBuffer input = {data, size, 0};
+  bool output_full = true;
+  while ((input.pos < input.size) || output_full) {
+    ZSTD_outBuffer output = {out_buffer_.data(), out_buffer_.size(), 0};
+    zstd_ret_ = ZSTD_decompressStream(zstd_, &output, &input);
+    if (ZSTD_isError(zstd_ret_)) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INTERNAL,
+          (std::string("Failed to decompress zstd model archive: ") +
+           ZSTD_getErrorName(zstd_ret_))
+              .c_str());
+    }
+    RETURN_IF_ERROR(Untar(out_buffer_.data(), output.pos));
+    output_full = (output.pos == output.size);
+  }
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+ArchiveExtractor::Untar(const char* data, size_t size)
+{
+  while (size > 0) {
+    switch (state_) {
+      case State::HEADER: {
+        const size_t n = std::min(size, kBlockSize - header_fill_);
+        memcpy(header_ + header_fill_, data, n);
+        header_fill_ += n;
+        data += n;
+        size -= n;
+        if (header_fill_ == kBlockSize) {
+          header_fill_ = 0;
+          RETURN_IF_ERROR(ProcessHeader());
+        }
+        break;
+      }
+      case State::DATA: {
+        const size_t n = std::min<uint64_t>(size, remaining_);
+        if (sink_ == Sink::FILE) {
+          GetBandwidthLimiter().disk.Acquire(n);
+          if (fwrite(data, 1, n, fp_) != n) {
+            return TRITONSERVER_ErrorNew(
+                TRITONSERVER_ERROR_INTERNAL,
+                ("Failed to write extracted file " + entry_name_ +
+                 ", errno:" + strerror(errno))
+                    .c_str());
+          }
+        } else if (sink_ == Sink::META) {
+          meta_.append(data, n);
+        }
+        remaining_ -= n;
+        data += n;
+        size -= n;
+        if (remaining_ == 0) {
+          RETURN_IF_ERROR(FinishEntry());
+        }
+        break;
+      }
+      case State::PADDING: {
+        const size_t n = std::min<uint64_t>(size, padding_);
+        padding_ -= n;
+        data += n;
+        size -= n;
+        if (padding_ == 0) {
+          state_ = State::HEADER;
+        }
+        break;
+      }
+      case State::END:
+        // Trailing zero blocks and record padding
+        return nullptr;
+    }
+  }
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+ArchiveExtractor::ProcessHeader()
+{
+  bool zero_block = true;
+  for (size_t i = 0; (i < kBlockSize) && zero_block; ++i) {
+    zero_block = (header_[i] == 0);
+  }
+  if (zero_block) {
+    if (++zero_blocks_ == 2) {
+      state_ = State::END;
+    }
+    return nullptr;
+  }
+  zero_blocks_ = 0;
+
+  auto parse_octal = [this](size_t offset, size_t len) {
+    uint64_t value = 0;
+    for (size_t i = offset; i < offset + len; ++i) {
+      if ((header_[i] >= '0') && (header_[i] <= '7')) {
+        value = (value << 3) | (header_[i] - '0');
+      } else if (value != 0 || ((header_[i] != ' ') && (header_[i] != 0))) {
+        break;
+      }
+    }
+    return value;
+  };
+  auto parse_string = [this](size_t offset, size_t len) {
+    return std::string(header_ + offset, strnlen(header_ + offset, len));
+  };
+
+  uint64_t checksum = 0;
+  for (size_t i = 0; i < kBlockSize; ++i) {
+    checksum += ((i >= 148) && (i < 156))
+                    ? ' '
+                    : static_cast<unsigned char>(header_[i]);
+  }
+  if (checksum != parse_octal(148, 8)) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        "Invalid tar header checksum in model archive");
+  }
+
+  uint64_t size = 0;
+  if (static_cast<unsigned char>(header_[124]) & 0x80) {
+    // GNU base-256 encoding for sizes of 8 GiB and above
+    for (size_t i = 125; i < 136; ++i) {
+      size = (size << 8) | static_cast<unsigned char>(header_[i]);
+    }
+  } else {
+    size = parse_octal(124, 12);
+  }
+
+  std::string name;
+  if (!pending_name_.empty()) {
+    name.swap(pending_name_);
+  } else {
+    name = parse_string(0, 100);
+    const std::string prefix = parse_string(345, 155);
+    if ((memcmp(header_ + 257, "ustar", 5) == 0) && !prefix.empty()) {
+      name = prefix + "/" + name;
+    }
+  }
+
+  entry_type_ = header_[156];
+  entry_name_ = name;
+  remaining_ = size;
+  padding_ = (kBlockSize - (size % kBlockSize)) % kBlockSize;
+  sink_ = Sink::DISCARD;
+  meta_.clear();
+
+  switch (entry_type_) {
+    case '0':
+    case '\0':
+    case '7': {
+      RETURN_IF_ERROR(SanitizeName(&name));
+      if (!name.empty()) {
+        RETURN_IF_ERROR(OpenFile(name));
+        sink_ = Sink::FILE;
+      }
+      break;
+    }
+    case '5': {
+      RETURN_IF_ERROR(SanitizeName(&name));
+      if (!name.empty()) {
+        RETURN_IF_ERROR(MakeDirectories(name, true /* leaf */));
+      }
+      break;
+    }
+    case 'L':
+    case 'x':
+      // GNU long name / PAX extended header for the next entry
+      sink_ = Sink::META;
+      break;
+    default:
+      break;
+  }
+
+  state_ = State::DATA;
+  if (remaining_ == 0) {
+    RETURN_IF_ERROR(FinishEntry());
+  }
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+ArchiveExtractor::FinishEntry()
+{
+  if (fp_) {
+    int status = fclose(fp_);
+    fp_ = nullptr;
+    if (status != 0) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INTERNAL,
+          ("Failed to close extracted file " + entry_name_ +
+           ", errno:" + strerror(errno))
+              .c_str());
+    }
+  }
+
+  if (entry_type_ == 'L') {
+    pending_name_ = meta_.substr(0, strnlen(meta_.c_str(), meta_.size()));
+  } else if (entry_type_ == 'x') {
+    ParsePaxHeader();
+  }
+
+  state_ = (padding_ == 0) ? State::HEADER : State::PADDING;
+  return nullptr;
+}
+
+void
+ArchiveExtractor::ParsePaxHeader()
+{
+  // Records are "<length> <key>=<value>\n", only 'path' affects extraction
+  size_t pos = 0;
+  while (pos < meta_.size()) {
+    size_t space = meta_.find(' ', pos);
+    if (space == std::string::npos) {
+      break;
+    }
+    size_t len = strtoull(meta_.c_str() + pos, nullptr, 10);
+    if ((len == 0) || (pos + len > meta_.size())) {
+      break;
+    }
+    const std::string record = meta_.substr(space + 1, pos + len - space - 2);
+    if (record.compare(0, 5, "path=") == 0) {
+      pending_name_ = record.substr(5);
+    }
+    pos += len;
+  }
+}
+
+TRITONSERVER_Error*
+ArchiveExtractor::SanitizeName(std::string* name)
+{
+  while (name->compare(0, 2, "./") == 0) {
+    name->erase(0, 2);
+  }
+  while (!name->empty() && (name->back() == '/')) {
+    name->pop_back();
+  }
+  if ((*name == ".") || name->empty()) {
+    name->clear();
+    return nullptr;
+  }
+
+  bool escapes = (*name)[0] == '/';
+  size_t start = 0;
+  while (!escapes && (start <= name->size())) {
+    size_t end = name->find('/', start);
+    if (end == std::string::npos) {
+      end = name->size();
+    }
+    escapes = (name->compare(start, end - start, "..") == 0);
+    start = end + 1;
+  }
+  if (escapes) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        ("Refusing to extract archive entry outside of model directory: " +
+         *name)
+            .c_str());
+  }
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+ArchiveExtractor::MakeDirectories(const std::string& name, bool leaf)
+{
+  size_t pos = 0;
+  while (true) {
+    pos = name.find('/', pos);
+    if ((pos == std::string::npos) && !leaf) {
+      return nullptr;
+    }
+    const std::string local_path =
+        dest_dir_ + "/" +
+        ((pos == std::string::npos) ? name : name.substr(0, pos));
+    int status = mkdir(local_path.c_str(), S_IRUSR | S_IWUSR | S_IXUSR);
+    if ((status == -1) && (errno != EEXIST)) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INTERNAL,
+          ("Failed to create local folder: " + local_path +
+           ", errno:" + strerror(errno))
+              .c_str());
+    }
+    if (pos == std::string::npos) {
+      return nullptr;
+    }
+    ++pos;
+  }
+}
+
+TRITONSERVER_Error*
+ArchiveExtractor::OpenFile(const std::string& name)
+{
+  RETURN_IF_ERROR(MakeDirectories(name, false /* leaf */));
+  const std::string local_path = dest_dir_ + "/" + name;
+  fp_ = fopen(local_path.c_str(), "wb");
+  if (!fp_) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to open file at path: " + local_path).c_str());
+  }
+  return nullptr;
+}
+
+// Unpack the archive at 'path', e.g. a downloaded blob, into 'dest_dir'
+TRITONSERVER_Error*
+ExtractArchiveFile(
+    const std::string& path, const std::string& dest_dir,
+    ArchiveCompression compression)
+{
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (fp == nullptr) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to open archive " + path + ", errno:" + strerror(errno))
+            .c_str());
+  }
+  ArchiveExtractor extractor(dest_dir, compression);
+  std::vector<char> buffer(1 << 20);
+  size_t n;
+  while ((n = fread(buffer.data(), 1, buffer.size(), fp)) > 0) {
+    TRITONSERVER_Error* err = extractor.Write(buffer.data(), n);
+    if (err != nullptr) {
+      fclose(fp);
+      return err;
+    }
+  }
+  const bool read_error = (ferror(fp) != 0);
+  fclose(fp);
+  if (read_error) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to read archive " + path).c_str());
+  }
+  return extractor.Finish();
+}
+
+}  // namespace triton::repoagent::dragonfly
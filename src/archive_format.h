@@ -0,0 +1,51 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstring>
+#include <string>
+
+namespace triton::repoagent::dragonfly {
+
+// Archive formats, apart from their extraction in archive.h, so that code
+// built without the decompression libraries, such as the backend modules,
+// can name them
+enum class ArchiveCompression { NONE, GZIP, ZSTD };
+
+// Return true if 'location' names a tar archive whose contents should be
+// extracted into the model directory, setting the compression in use.
+bool
+IsArchivePath(const std::string& location, ArchiveCompression* compression)
+{
+  auto ends_with = [&location](const char* suffix) {
+    const size_t len = strlen(suffix);
+    return (location.size() > len) &&
+           (location.compare(location.size() - len, len, suffix) == 0);
+  };
+
+  if (ends_with(".tar")) {
+    *compression = ArchiveCompression::NONE;
+  } else if (ends_with(".tar.gz") || ends_with(".tgz")) {
+    *compression = ArchiveCompression::GZIP;
+  } else if (ends_with(".tar.zst") || ends_with(".tzst")) {
+    *compression = ArchiveCompression::ZSTD;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+}  // namespace triton::repoagent::dragonfly
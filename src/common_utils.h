@@ -15,13 +15,21 @@
  */
 #pragma once
 
-
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <string>
+#include <string_view>
 
 #include "config.h"
-#include "curl/curl.h"
 #include "triton/core/tritonserver.h"
 
 namespace triton::repoagent::dragonfly {
@@ -37,28 +45,34 @@ AppendSlash(const std::string& name)
 }
 
 bool
-IsAbsolutePath(const std::string& path)
+IsAbsolutePath(std::string_view path)
 {
   return !path.empty() && (path[0] == '/');
 }
 
+// Segments are views so that joining per-object paths allocates only the
+// result
 std::string
-JoinPath(std::initializer_list<std::string> segments)
+JoinPath(std::initializer_list<std::string_view> segments)
 {
+  size_t size = 0;
+  for (const auto& seg : segments) {
+    size += seg.size() + 1;
+  }
   std::string joined;
+  joined.reserve(size);
 
-  for (const auto& seg : segments) {
+  for (auto seg : segments) {
     if (joined.empty()) {
       joined = seg;
     } else if (IsAbsolutePath(seg)) {
-      if (joined[joined.size() - 1] == '/') {
-        joined.append(seg.substr(1));
-      } else {
-        joined.append(seg);
+      if (joined.back() == '/') {
+        seg.remove_prefix(1);
       }
+      joined.append(seg);
     } else {  // !IsAbsolutePath(seg)
-      if (joined[joined.size() - 1] != '/') {
-        joined.append("/");
+      if (joined.back() != '/') {
+        joined.push_back('/');
       }
       joined.append(seg);
     }
@@ -68,10 +82,10 @@ JoinPath(std::initializer_list<std::string> segments)
 }
 
 std::string
-BaseName(const std::string& path)
+BaseName(std::string_view path)
 {
   if (path.empty()) {
-    return path;
+    return {};
   }
 
   size_t last = path.size() - 1;
@@ -84,123 +98,90 @@ BaseName(const std::string& path)
   }
 
   const size_t idx = path.find_last_of('/', last);
-  if (idx == std::string::npos) {
-    return path.substr(0, last + 1);
+  if (idx == std::string_view::npos) {
+    return std::string(path.substr(0, last + 1));
   }
 
-  return path.substr(idx + 1, last - idx);
+  return std::string(path.substr(idx + 1, last - idx));
 }
 
 TRITONSERVER_Error*
-DownloadFile(
-    const std::string& url, const std::string& path, DragonflyConfig& config)
+ReadLocalFile(const std::string& path, std::string* contents)
 {
-  CURL* curl;
-
-  curl = curl_easy_init();
-  if (!curl) {
+  if (!contents) {
     return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_INTERNAL, "Failed to initialize CURL.");
+        TRITONSERVER_ERROR_INTERNAL, "Output string pointer is null.");
   }
 
-  FILE* fp = fopen(path.c_str(), "wb");
-  if (!fp) {
-    curl_easy_cleanup(curl);
+  std::ifstream in(path, std::ios::in | std::ios::binary);
+  if (!in) {
     return TRITONSERVER_ErrorNew(
         TRITONSERVER_ERROR_INTERNAL,
-        ("Failed to open file at path: " + path).c_str());
-  }
-
-
-  struct curl_slist* headers = NULL;
-
-  auto cleanup = [&]() {
-    if (fp)
-      fclose(fp);
-    if (headers)
-      curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
-  };
-
-  auto write_data = [](void* ptr, size_t size, size_t nmemb,
-                       void* stream) -> size_t {
-    size_t written = fwrite(ptr, size, nmemb, static_cast<FILE*>(stream));
-    return written;
-  };
-
-  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-
-  for (const auto& header : config.headers) {
-    std::string header_str = header.first + ": " + header.second;
-    headers = curl_slist_append(headers, header_str.c_str());
-    if (!headers) {
-      cleanup();
-      return TRITONSERVER_ErrorNew(
-          TRITONSERVER_ERROR_INTERNAL, "Failed to append headers.");
-    }
-  }
-
-  if (!config.filter.empty()) {
-    std::ostringstream oss;
-    for (size_t i = 0; i < config.filter.size(); ++i) {
-      if (i != 0)
-        oss << "&";
-      oss << config.filter[i];
-    }
-    headers = curl_slist_append(
-        headers, ("X-Dragonfly-Filter: " + oss.str()).c_str());
-    if (!headers) {
-      cleanup();
-      return TRITONSERVER_ErrorNew(
-          TRITONSERVER_ERROR_INTERNAL, "Failed to append filters.");
-    }
+        ("Failed to open text file for read " + path).c_str());
   }
 
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+  std::ostringstream oss;
+  oss << in.rdbuf();
+  *contents = oss.str();
 
-  if (!config.proxy.empty()) {
-    curl_easy_setopt(curl, CURLOPT_PROXY, config.proxy.c_str());
+  if (in.bad()) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Error reading from text file " + path).c_str());
   }
 
-  CURLcode res = curl_easy_perform(curl);
+  return nullptr;
+}
 
-  if (res != CURLE_OK) {
-    cleanup();
+// Create 'path' if it does not exist yet
+TRITONSERVER_Error*
+MakeDirectory(const std::string& path)
+{
+  if ((mkdir(path.c_str(), S_IRUSR | S_IWUSR | S_IXUSR) == -1) &&
+      (errno != EEXIST)) {
     return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_INTERNAL, curl_easy_strerror(res));
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to create local folder: " + path + ", errno:" +
+         strerror(errno))
+            .c_str());
   }
-
-  cleanup();
   return nullptr;
 }
 
+// Remove 'path' and everything below it, a missing path is not an error
 TRITONSERVER_Error*
-ReadLocalFile(const std::string& path, std::string* contents)
+RemoveAll(const std::string& path)
 {
-  if (!contents) {
+  auto remove_entry = [](const char* fpath, const struct stat* sb, int typeflag,
+                         struct FTW* ftwbuf) { return remove(fpath); };
+  if ((nftw(path.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS) == -1) &&
+      (errno != ENOENT)) {
     return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_INTERNAL, "Output string pointer is null.");
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to remove " + path + ", errno:" + strerror(errno)).c_str());
   }
+  return nullptr;
+}
 
-  std::ifstream in(path, std::ios::in | std::ios::binary);
-  if (!in) {
+// Flush everything written to the filesystem holding 'path' in one call,
+// instead of an fsync per file
+TRITONSERVER_Error*
+SyncFileSystem(const std::string& path)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd == -1) {
     return TRITONSERVER_ErrorNew(
         TRITONSERVER_ERROR_INTERNAL,
-        ("Failed to open text file for read " + path).c_str());
+        ("Failed to open " + path + ", errno:" + strerror(errno)).c_str());
   }
-
-  std::ostringstream oss;
-  oss << in.rdbuf();
-  *contents = oss.str();
-
-  if (in.bad()) {
+  const int status = syncfs(fd);
+  const int sync_errno = errno;
+  close(fd);
+  if (status == -1) {
     return TRITONSERVER_ErrorNew(
         TRITONSERVER_ERROR_INTERNAL,
-        ("Error reading from text file " + path).c_str());
+        ("Failed to sync " + path + ", errno:" + strerror(sync_errno)).c_str());
   }
-
   return nullptr;
 }
 
@@ -0,0 +1,443 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "scheduler.h"
+#include "status.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly {
+
+// Process-wide limit on the number of transfers running at once, adjusted
+// AIMD style from what the transfers see. Time is cut into windows; at the
+// end of each one the limit
+//  - is halved when a transfer got 429 or 503, timed out, or the median time
+//    to first byte of the window is well above the best recent one,
+//  - grows by one while aggregate throughput keeps improving and every slot
+//    is in use,
+//  - steps back by one when the last increase bought nothing, and holds
+//    there for a while before probing again.
+// Hedged requests do not take a slot. Free slots go to the loads waiting
+// for one in the order of a FairShare, weighted by the bytes of the
+// transfers they start.
+class ConcurrencyController {
+ public:
+  // Adapt between 1 and 'max_limit', starting at 'initial_limit'. The
+  // learned limit is kept across calls unless 'max_limit' changes. A
+  // 'max_limit' of 0 turns the controller off.
+  void Configure(uint64_t initial_limit, uint64_t max_limit);
+  bool Enabled();
+
+  // Take a slot for a transfer of 'cost' bytes of 'flow' if fewer
+  // transfers than the limit are running and no flow that waits is ahead of
+  // it, or if 'force' is set. Loads force their first transfer so that a
+  // low limit delays concurrent loads instead of starving one of them. A
+  // flow that did not get a slot waits for one, and 'wake' is called when
+  // it is its turn, until it takes one or calls Cancel().
+  bool TryAcquire(
+      bool force, FlowId flow = 0, double weight = 1, double cost = 1,
+      std::function<void()> wake = nullptr);
+  void Cancel(FlowId flow);
+  void Release(size_t count = 1);
+
+  // Body bytes received by any transfer
+  void AddBytes(uint64_t bytes)
+  {
+    bytes_.fetch_add(bytes, std::memory_order_relaxed);
+  }
+  void RecordTtfb(double seconds);
+  // Sign that the origin or proxy is overloaded, e.g. "HTTP 503"
+  void RecordCongestion(const std::string& reason);
+
+  // Close the window and adjust the limit once it is over. Called from the
+  // transfer loops, which wake up at least every 100ms.
+  void Update();
+
+  // Limit, in-flight and decision metrics, best effort since the server may
+  // run with metrics disabled
+  void CreateMetrics();
+  void DeleteMetrics();
+
+ private:
+  static constexpr double kWindowSeconds = 2.0;
+  // Throughput must improve by this much for an increase to count
+  static constexpr double kMinGain = 0.05;
+  // Median time to first byte above this multiple of the baseline, and at
+  // least kMinTtfbRise seconds above it, counts as congestion
+  static constexpr double kTtfbFactor = 2.0;
+  static constexpr double kMinTtfbRise = 0.05;
+  // Windows to wait after a decrease before probing again
+  static constexpr size_t kCongestionHold = 2;
+  static constexpr size_t kPlateauHold = 10;
+
+  void SetLimit(size_t limit, bool increase, const std::string& reason);
+  static TRITONSERVER_Metric* NewMetric(
+      TRITONSERVER_MetricFamily** family, TRITONSERVER_MetricKind kind,
+      const char* name, const char* description);
+  static void SetMetric(TRITONSERVER_Metric* metric, double value);
+  static void IncrementMetric(TRITONSERVER_Metric* metric);
+
+  std::mutex mu_;
+  uint64_t max_limit_ = 0;
+  size_t limit_ = 0;
+  size_t in_flight_ = 0;
+  FairShare fair_;
+
+  // Current window
+  std::chrono::steady_clock::time_point window_start_;
+  std::atomic<uint64_t> bytes_{0};
+  size_t peak_in_flight_ = 0;
+  std::vector<double> ttfb_;
+  std::string congestion_;
+
+  // Lowest recent median time to first byte, in seconds
+  double baseline_ttfb_ = 0;
+  // Best throughput since the last decrease, in bytes per second
+  double best_throughput_ = 0;
+  bool increased_ = false;
+  size_t hold_ = 0;
+
+  TRITONSERVER_MetricFamily* limit_family_ = nullptr;
+  TRITONSERVER_MetricFamily* in_flight_family_ = nullptr;
+  TRITONSERVER_MetricFamily* throughput_family_ = nullptr;
+  TRITONSERVER_MetricFamily* increases_family_ = nullptr;
+  TRITONSERVER_MetricFamily* decreases_family_ = nullptr;
+  TRITONSERVER_Metric* limit_metric_ = nullptr;
+  TRITONSERVER_Metric* in_flight_metric_ = nullptr;
+  TRITONSERVER_Metric* throughput_metric_ = nullptr;
+  TRITONSERVER_Metric* increases_metric_ = nullptr;
+  TRITONSERVER_Metric* decreases_metric_ = nullptr;
+};
+
+void
+ConcurrencyController::Configure(uint64_t initial_limit, uint64_t max_limit)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  if (max_limit == max_limit_) {
+    return;
+  }
+  const bool enabling = (max_limit_ == 0);
+  max_limit_ = max_limit;
+  if (max_limit == 0) {
+    limit_ = 0;
+    SetMetric(limit_metric_, 0);
+    return;
+  }
+  limit_ = std::max<uint64_t>(
+      1, std::min(enabling ? initial_limit : limit_, max_limit));
+  if (enabling) {
+    window_start_ = std::chrono::steady_clock::now();
+    bytes_ = 0;
+    peak_in_flight_ = in_flight_;
+    ttfb_.clear();
+    congestion_.clear();
+    best_throughput_ = 0;
+    increased_ = false;
+    hold_ = 0;
+  }
+  SetMetric(limit_metric_, limit_);
+  LOG_MESSAGE(
+      TRITONSERVER_LOG_INFO,
+      ("dragonfly: adaptive transfer concurrency at " +
+       std::to_string(limit_) + ", maximum " + std::to_string(max_limit))
+          .c_str());
+}
+
+bool
+ConcurrencyController::Enabled()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  return max_limit_ != 0;
+}
+
+bool
+ConcurrencyController::TryAcquire(
+    bool force, FlowId flow, double weight, double cost,
+    std::function<void()> wake)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  if (!force && ((in_flight_ >= limit_) || !fair_.IsNext(flow))) {
+    fair_.Wait(flow, weight, std::move(wake));
+    return false;
+  }
+  fair_.Serve(flow, weight, cost);
+  ++in_flight_;
+  peak_in_flight_ = std::max(peak_in_flight_, in_flight_);
+  SetMetric(in_flight_metric_, in_flight_);
+  return true;
+}
+
+void
+ConcurrencyController::Cancel(FlowId flow)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  fair_.Cancel(flow);
+}
+
+void
+ConcurrencyController::Release(size_t count)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  in_flight_ -= std::min(count, in_flight_);
+  SetMetric(in_flight_metric_, in_flight_);
+  if (count > 0) {
+    fair_.WakeNext();
+  }
+}
+
+void
+ConcurrencyController::RecordTtfb(double seconds)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  ttfb_.push_back(seconds);
+}
+
+void
+ConcurrencyController::RecordCongestion(const std::string& reason)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  if (congestion_.empty()) {
+    congestion_ = reason;
+  }
+}
+
+void
+ConcurrencyController::Update()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  if (max_limit_ == 0) {
+    return;
+  }
+  const auto now = std::chrono::steady_clock::now();
+  const double elapsed =
+      std::chrono::duration<double>(now - window_start_).count();
+  if (elapsed < kWindowSeconds) {
+    return;
+  }
+
+  window_start_ = now;
+  const double throughput = bytes_.exchange(0) / elapsed;
+  const size_t peak = peak_in_flight_;
+  peak_in_flight_ = in_flight_;
+  std::vector<double> ttfb;
+  ttfb.swap(ttfb_);
+  std::string congestion;
+  congestion.swap(congestion_);
+  if (peak == 0) {
+    // Idle, nothing to learn from
+    return;
+  }
+  SetMetric(throughput_metric_, throughput);
+
+  if (!ttfb.empty()) {
+    const size_t middle = ttfb.size() / 2;
+    std::nth_element(ttfb.begin(), ttfb.begin() + middle, ttfb.end());
+    const double median = ttfb[middle];
+    if (congestion.empty() && (baseline_ttfb_ > 0) &&
+        (median > baseline_ttfb_ * kTtfbFactor) &&
+        (median - baseline_ttfb_ > kMinTtfbRise)) {
+      congestion =
+          "time to first byte " +
+          std::to_string(static_cast<uint64_t>(median * 1000)) +
+          "ms, baseline " +
+          std::to_string(static_cast<uint64_t>(baseline_ttfb_ * 1000)) + "ms";
+    }
+    // Follow the best recent window, drifting up slowly so that an origin
+    // that got slower for good becomes the new normal
+    baseline_ttfb_ = (baseline_ttfb_ == 0)
+                         ? median
+                         : std::min(median, baseline_ttfb_ * 1.05);
+  }
+
+  if (!congestion.empty()) {
+    SetLimit(std::max<size_t>(1, limit_ / 2), false /* increase */, congestion);
+    best_throughput_ = 0;
+    increased_ = false;
+    hold_ = kCongestionHold;
+    return;
+  }
+  if (hold_ > 0) {
+    --hold_;
+    return;
+  }
+  if (peak < limit_) {
+    // The limit is not what holds transfers back
+    increased_ = false;
+    return;
+  }
+
+  const std::string rate =
+      std::to_string(static_cast<uint64_t>(throughput / (1024 * 1024))) +
+      " MiB/s";
+  if (throughput > best_throughput_ * (1.0 + kMinGain)) {
+    best_throughput_ = throughput;
+    increased_ = false;
+    if (limit_ < max_limit_) {
+      SetLimit(limit_ + 1, true /* increase */, "throughput " + rate);
+      increased_ = true;
+    }
+  } else if (increased_) {
+    // The last step bought nothing, step back and probe again later
+    SetLimit(limit_ - 1, false /* increase */, "no gain at " + rate);
+    best_throughput_ = 0;
+    increased_ = false;
+    hold_ = kPlateauHold;
+  }
+}
+
+void
+ConcurrencyController::SetLimit(
+    size_t limit, bool increase, const std::string& reason)
+{
+  if (limit == limit_) {
+    return;
+  }
+  const std::string message = "dragonfly: transfer concurrency " +
+                              std::to_string(limit_) + " -> " +
+                              std::to_string(limit) + " (" + reason + ")";
+  limit_ = limit;
+  SetMetric(limit_metric_, limit_);
+  if (increase) {
+    fair_.WakeNext();
+    IncrementMetric(increases_metric_);
+    // Probing steps are frequent while ramping up
+    LOG_MESSAGE(TRITONSERVER_LOG_VERBOSE, message.c_str());
+  } else {
+    IncrementMetric(decreases_metric_);
+    LOG_MESSAGE(TRITONSERVER_LOG_INFO, message.c_str());
+  }
+}
+
+void
+ConcurrencyController::CreateMetrics()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  if (limit_family_ != nullptr) {
+    return;
+  }
+  limit_metric_ = NewMetric(
+      &limit_family_, TRITONSERVER_METRIC_KIND_GAUGE,
+      "dragonfly_transfer_concurrency_limit",
+      "Transfers the Dragonfly agent runs at once, 0 when not adaptive");
+  in_flight_metric_ = NewMetric(
+      &in_flight_family_, TRITONSERVER_METRIC_KIND_GAUGE,
+      "dragonfly_transfers_in_flight",
+      "Transfers holding an adaptive concurrency slot");
+  throughput_metric_ = NewMetric(
+      &throughput_family_, TRITONSERVER_METRIC_KIND_GAUGE,
+      "dragonfly_transfer_throughput_bytes_per_second",
+      "Aggregate transfer throughput of the last busy window");
+  increases_metric_ = NewMetric(
+      &increases_family_, TRITONSERVER_METRIC_KIND_COUNTER,
+      "dragonfly_transfer_concurrency_increases_total",
+      "Times the adaptive transfer concurrency limit was raised");
+  decreases_metric_ = NewMetric(
+      &decreases_family_, TRITONSERVER_METRIC_KIND_COUNTER,
+      "dragonfly_transfer_concurrency_decreases_total",
+      "Times the adaptive transfer concurrency limit was lowered");
+  SetMetric(limit_metric_, limit_);
+}
+
+void
+ConcurrencyController::DeleteMetrics()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  for (auto* metric :
+       {&limit_metric_, &in_flight_metric_, &throughput_metric_,
+        &increases_metric_, &decreases_metric_}) {
+    if (*metric != nullptr) {
+      TRITONSERVER_Error* err = TRITONSERVER_MetricDelete(*metric);
+      if (err != nullptr) {
+        TRITONSERVER_ErrorDelete(err);
+      }
+      *metric = nullptr;
+    }
+  }
+  for (auto* family :
+       {&limit_family_, &in_flight_family_, &throughput_family_,
+        &increases_family_, &decreases_family_}) {
+    if (*family != nullptr) {
+      TRITONSERVER_Error* err = TRITONSERVER_MetricFamilyDelete(*family);
+      if (err != nullptr) {
+        TRITONSERVER_ErrorDelete(err);
+      }
+      *family = nullptr;
+    }
+  }
+}
+
+TRITONSERVER_Metric*
+ConcurrencyController::NewMetric(
+    TRITONSERVER_MetricFamily** family, TRITONSERVER_MetricKind kind,
+    const char* name, const char* description)
+{
+  TRITONSERVER_Error* err =
+      TRITONSERVER_MetricFamilyNew(family, kind, name, description);
+  if (err != nullptr) {
+    TRITONSERVER_ErrorDelete(err);
+    *family = nullptr;
+    return nullptr;
+  }
+  TRITONSERVER_Metric* metric = nullptr;
+  err = TRITONSERVER_MetricNew(&metric, *family, nullptr, 0);
+  if (err != nullptr) {
+    TRITONSERVER_ErrorDelete(err);
+    return nullptr;
+  }
+  return metric;
+}
+
+void
+ConcurrencyController::SetMetric(TRITONSERVER_Metric* metric, double value)
+{
+  if (metric == nullptr) {
+    return;
+  }
+  TRITONSERVER_Error* err = TRITONSERVER_MetricSet(metric, value);
+  if (err != nullptr) {
+    TRITONSERVER_ErrorDelete(err);
+  }
+}
+
+void
+ConcurrencyController::IncrementMetric(TRITONSERVER_Metric* metric)
+{
+  if (metric == nullptr) {
+    return;
+  }
+  TRITONSERVER_Error* err = TRITONSERVER_MetricIncrement(metric, 1);
+  if (err != nullptr) {
+    TRITONSERVER_ErrorDelete(err);
+  }
+}
+
+ConcurrencyController&
+GetConcurrencyController()
+{
+  static ConcurrencyController controller;
+  return controller;
+}
+
+}  // namespace triton::repoagent::dragonfly
@@ -15,10 +15,17 @@
  */
 #pragma once
 
+#include <fnmatch.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
 #include <map>
 #include <string>
 #include <vector>
 
+#include "triton/core/tritonserver.h"
+
 #define TRITONJSON_STATUSTYPE TRITONSERVER_Error*
 #define TRITONJSON_STATUSRETURN(M) \
   return TRITONSERVER_ErrorNew(TRITONSERVER_ERROR_INTERNAL, (M).c_str())
@@ -29,26 +36,185 @@ namespace triton::repoagent::dragonfly {
 
 struct DragonflyConfig {
   std::string proxy;
+  std::string proxy_unix_socket;
+  // Proxy endpoints requests are balanced across, replacing 'proxy' and
+  // 'proxy_unix_socket' when set. "unix:<path>" is a dfdaemon socket, any
+  // other entry a proxy URL. See ProxyPool. The pool is configured from the
+  // config file once at server start, so these are not model parameters.
+  std::vector<std::string> proxies;
+  // How often every endpoint is probed, 0 disables the probes
+  uint64_t proxy_health_interval_ms = 5000;
+  // Go straight to the origin while every endpoint is down
+  bool proxy_direct_fallback = false;
   std::map<std::string, std::string> headers;
   std::vector<std::string> filter;
+  // Headers the origin itself needs, e.g. registry authorization. Set by the
+  // backend rather than the config file, and kept on hedged requests that
+  // bypass the proxy.
+  std::map<std::string, std::string> origin_headers;
+  // Process-wide limits in bytes per second, 0 means unlimited. Only taken
+  // from the config file, read again by every model load and whenever the
+  // file changes.
+  uint64_t network_rate_limit = 0;
+  uint64_t disk_write_rate_limit = 0;
+  // Per-transfer stall detection, 0 disables
+  uint64_t connect_timeout_ms = 0;
+  uint64_t low_speed_limit = 0;
+  uint64_t low_speed_time = 0;
+  // Hedge slow transfers after at least this long, 0 disables hedging
+  uint64_t hedge_delay_ms = 0;
+  // Proxy for hedged requests, empty to go straight to the origin
+  std::string hedge_proxy;
+  // Maximum number of files downloaded at once for a model, or the starting
+  // point of the process-wide limit when 'max_concurrency' is set
+  uint64_t concurrency = 8;
+  // Adapt the number of transfers running at once across all loads between
+  // 1 and this, 0 keeps the fixed per-load 'concurrency'
+  uint64_t max_concurrency = 0;
+  // Transfers a single load runs at once within the adaptive limit, 0 for
+  // no cap of its own. Set by the 'concurrency' model parameter, which
+  // leaves the limit shared by the other loads alone.
+  uint64_t concurrency_cap = 0;
+  // Share of the process-wide concurrency slots and bandwidth limits a load
+  // gets while loads compete for them, relative to the other loads
+  uint64_t weight = 1;
+  // "1.1", "2" or "2-prior-knowledge", empty for the curl default
+  std::string http_version;
+  // Streams per HTTP/2 connection and connections per host, 0 for the curl
+  // defaults
+  uint64_t max_concurrent_streams = 0;
+  uint64_t max_host_connections = 0;
+  // URLs requested once at server start so that the proxy and storage
+  // connections are already open for the first model load
+  std::vector<std::string> prewarm;
+  // Directory that a Chrome trace of every model load is written to, empty
+  // disables tracing
+  std::string trace_dir;
+  // Dragonfly manager job endpoint that the first load of a model version
+  // asks to preheat every file, and its personal access token. Empty
+  // disables preheating.
+  std::string preheat_url;
+  std::string preheat_token;
+  // Objects of at most 'direct_max_size' bytes (0 disables), or whose path
+  // in the model matches one of 'direct_patterns', skip the proxy and are
+  // fetched straight from the origin
+  uint64_t direct_max_size = 0;
+  std::vector<std::string> direct_patterns;
+  // Directory of the downloaded objects shared by every process on the
+  // host, empty disables it, and its size in bytes, 0 for unlimited. See
+  // SharedCache.
+  std::string cache_dir;
+  uint64_t cache_max_size = 0;
+  // How long a listing of a whole repository serves the models in it, 0
+  // lists every model on its own. See ListingCache.
+  uint64_t listing_ttl_ms = 60000;
+  // Download the composing models of an ensemble in the background once the
+  // ensemble is loaded. See Prefetcher.
+  bool prefetch_ensembles = false;
 
   explicit DragonflyConfig(triton::common::TritonJson::Value& config);
+
+  // Merge the per-model parameters given to the agent under
+  // 'model_repository_agents' in the model's config.pbtxt.
+  TRITONSERVER_Error* ApplyParameters(
+      const std::map<std::string, std::string>& parameters);
+
+  // Whether the object at 'path', relative to the model, is fetched from the
+  // origin rather than through Dragonfly
+  bool FetchDirect(const std::string& path, uint64_t size) const;
+
+  // Copy of the config for requests straight to the origin: no proxy, and
+  // none of the Dragonfly headers and filters, which mean nothing there
+  DragonflyConfig OriginConfig() const;
+
+  // Copy of the config for requests through 'endpoint', one of 'proxies'
+  DragonflyConfig ThroughProxy(const std::string& endpoint) const;
 };
 
+// Proxy URL or unix socket path of an entry of 'proxies'
+void
+SplitProxyEndpoint(
+    const std::string& endpoint, std::string* proxy, std::string* unix_socket)
+{
+  if (endpoint.compare(0, 5, "unix:") == 0) {
+    proxy->clear();
+    *unix_socket = endpoint.substr(5);
+  } else {
+    *proxy = endpoint;
+    unix_socket->clear();
+  }
+}
+
+// Non-empty items of 'value' separated by 'separator'
+std::vector<std::string>
+SplitList(const std::string& value, char separator)
+{
+  std::vector<std::string> items;
+  size_t start = 0;
+  while (start <= value.size()) {
+    size_t end = value.find(separator, start);
+    if (end == std::string::npos) {
+      end = value.size();
+    }
+    if (end > start) {
+      items.push_back(value.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+  return items;
+}
+
 DragonflyConfig::DragonflyConfig(triton::common::TritonJson::Value& config)
 {
-  triton::common::TritonJson::Value proxy_json, header_json, filter_json;
+  triton::common::TritonJson::Value proxy_json, proxy_unix_socket_json,
+      header_json, filter_json, network_rate_limit_json,
+      disk_write_rate_limit_json, connect_timeout_ms_json, low_speed_limit_json,
+      low_speed_time_json, hedge_delay_ms_json, hedge_proxy_json,
+      concurrency_json, max_concurrency_json, http_version_json,
+      max_concurrent_streams_json, max_host_connections_json, prewarm_json,
+      trace_dir_json, preheat_url_json, preheat_token_json,
+      direct_max_size_json, direct_patterns_json, proxies_json,
+      proxy_health_interval_ms_json, proxy_direct_fallback_json,
+      cache_dir_json, cache_max_size_json, weight_json, listing_ttl_ms_json,
+      prefetch_ensembles_json;
   if (config.Find("proxy", &proxy_json)) {
     proxy_json.AsString(&proxy);
   }
 
+  if (config.Find("proxies", &proxies_json)) {
+    for (size_t i = 0; i < proxies_json.ArraySize(); i++) {
+      triton::common::TritonJson::Value value_json;
+      std::string value;
+      if ((proxies_json.At(i, &value_json) == nullptr) &&
+          (value_json.AsString(&value) == nullptr)) {
+        proxies.push_back(value);
+      }
+    }
+  }
+
+  if (config.Find(
+          "proxy_health_interval_ms", &proxy_health_interval_ms_json)) {
+    proxy_health_interval_ms_json.AsUInt(&proxy_health_interval_ms);
+  }
+
+  if (config.Find("proxy_direct_fallback", &proxy_direct_fallback_json)) {
+    proxy_direct_fallback_json.AsBool(&proxy_direct_fallback);
+  }
+
+  if (config.Find("proxy_unix_socket", &proxy_unix_socket_json)) {
+    proxy_unix_socket_json.AsString(&proxy_unix_socket);
+  }
+
   if (config.Find("header", &header_json)) {
     std::vector<std::string> header_keys;
     header_json.Members(&header_keys);
     for (const auto& key : header_keys) {
       std::string value;
-      if (header_json.MemberAsString(key.c_str(), &value)) {
+      TRITONSERVER_Error* err = header_json.MemberAsString(key.c_str(), &value);
+      if (err == nullptr) {
         headers[key] = value;
+      } else {
+        TRITONSERVER_ErrorDelete(err);
       }
     }
   }
@@ -57,10 +223,241 @@ DragonflyConfig::DragonflyConfig(triton::common::TritonJson::Value& config)
     for (size_t i = 0; i < filter_json.ArraySize(); i++) {
       triton::common::TritonJson::Value value_json;
       std::string value;
-      if (filter_json.At(i, &value_json) && value_json.AsString(&value)) {
+      if ((filter_json.At(i, &value_json) == nullptr) &&
+          (value_json.AsString(&value) == nullptr)) {
         filter.push_back(value);
       }
     }
   }
+
+  if (config.Find("network_rate_limit", &network_rate_limit_json)) {
+    network_rate_limit_json.AsUInt(&network_rate_limit);
+  }
+
+  if (config.Find("disk_write_rate_limit", &disk_write_rate_limit_json)) {
+    disk_write_rate_limit_json.AsUInt(&disk_write_rate_limit);
+  }
+
+  if (config.Find("connect_timeout_ms", &connect_timeout_ms_json)) {
+    connect_timeout_ms_json.AsUInt(&connect_timeout_ms);
+  }
+
+  if (config.Find("low_speed_limit", &low_speed_limit_json)) {
+    low_speed_limit_json.AsUInt(&low_speed_limit);
+  }
+
+  if (config.Find("low_speed_time", &low_speed_time_json)) {
+    low_speed_time_json.AsUInt(&low_speed_time);
+  }
+
+  if (config.Find("hedge_delay_ms", &hedge_delay_ms_json)) {
+    hedge_delay_ms_json.AsUInt(&hedge_delay_ms);
+  }
+
+  if (config.Find("hedge_proxy", &hedge_proxy_json)) {
+    hedge_proxy_json.AsString(&hedge_proxy);
+  }
+
+  if (config.Find("concurrency", &concurrency_json)) {
+    concurrency_json.AsUInt(&concurrency);
+  }
+
+  if (config.Find("max_concurrency", &max_concurrency_json)) {
+    max_concurrency_json.AsUInt(&max_concurrency);
+  }
+
+  if (config.Find("weight", &weight_json)) {
+    weight_json.AsUInt(&weight);
+  }
+
+  if (config.Find("http_version", &http_version_json)) {
+    http_version_json.AsString(&http_version);
+  }
+
+  if (config.Find("max_concurrent_streams", &max_concurrent_streams_json)) {
+    max_concurrent_streams_json.AsUInt(&max_concurrent_streams);
+  }
+
+  if (config.Find("max_host_connections", &max_host_connections_json)) {
+    max_host_connections_json.AsUInt(&max_host_connections);
+  }
+
+  if (config.Find("prewarm", &prewarm_json)) {
+    for (size_t i = 0; i < prewarm_json.ArraySize(); i++) {
+      triton::common::TritonJson::Value value_json;
+      std::string value;
+      if ((prewarm_json.At(i, &value_json) == nullptr) &&
+          (value_json.AsString(&value) == nullptr)) {
+        prewarm.push_back(value);
+      }
+    }
+  }
+
+  if (config.Find("trace_dir", &trace_dir_json)) {
+    trace_dir_json.AsString(&trace_dir);
+  }
+
+  if (config.Find("preheat_url", &preheat_url_json)) {
+    preheat_url_json.AsString(&preheat_url);
+  }
+
+  if (config.Find("preheat_token", &preheat_token_json)) {
+    preheat_token_json.AsString(&preheat_token);
+  }
+
+  if (config.Find("direct_max_size", &direct_max_size_json)) {
+    direct_max_size_json.AsUInt(&direct_max_size);
+  }
+
+  if (config.Find("direct_patterns", &direct_patterns_json)) {
+    for (size_t i = 0; i < direct_patterns_json.ArraySize(); i++) {
+      triton::common::TritonJson::Value value_json;
+      std::string value;
+      if ((direct_patterns_json.At(i, &value_json) == nullptr) &&
+          (value_json.AsString(&value) == nullptr)) {
+        direct_patterns.push_back(value);
+      }
+    }
+  }
+
+  if (config.Find("cache_dir", &cache_dir_json)) {
+    cache_dir_json.AsString(&cache_dir);
+  }
+
+  if (config.Find("cache_max_size", &cache_max_size_json)) {
+    cache_max_size_json.AsUInt(&cache_max_size);
+  }
+
+  if (config.Find("listing_ttl_ms", &listing_ttl_ms_json)) {
+    listing_ttl_ms_json.AsUInt(&listing_ttl_ms);
+  }
+
+  if (config.Find("prefetch_ensembles", &prefetch_ensembles_json)) {
+    prefetch_ensembles_json.AsBool(&prefetch_ensembles);
+  }
+}
+
+TRITONSERVER_Error*
+DragonflyConfig::ApplyParameters(
+    const std::map<std::string, std::string>& parameters)
+{
+  const std::map<std::string, std::string*> string_params = {
+      {"proxy", &proxy},
+      {"proxy_unix_socket", &proxy_unix_socket},
+      {"hedge_proxy", &hedge_proxy},
+      {"http_version", &http_version},
+      {"trace_dir", &trace_dir},
+      {"preheat_url", &preheat_url},
+      {"cache_dir", &cache_dir},
+  };
+  const std::map<std::string, uint64_t*> uint_params = {
+      {"connect_timeout_ms", &connect_timeout_ms},
+      {"low_speed_limit", &low_speed_limit},
+      {"low_speed_time", &low_speed_time},
+      {"hedge_delay_ms", &hedge_delay_ms},
+      {"concurrency", &concurrency},
+      {"weight", &weight},
+      {"max_concurrent_streams", &max_concurrent_streams},
+      {"max_host_connections", &max_host_connections},
+      {"direct_max_size", &direct_max_size},
+      {"cache_max_size", &cache_max_size},
+      {"listing_ttl_ms", &listing_ttl_ms},
+  };
+  const std::map<std::string, bool*> bool_params = {
+      {"prefetch_ensembles", &prefetch_ensembles},
+  };
+  // Dragonfly request headers with a dedicated parameter name
+  const std::map<std::string, std::string> header_params = {
+      {"priority", "X-Dragonfly-Priority"},
+      {"tag", "X-Dragonfly-Tag"},
+      {"application", "X-Dragonfly-Application"},
+  };
+
+  for (const auto& parameter : parameters) {
+    const std::string& name = parameter.first;
+    const std::string& value = parameter.second;
+
+    auto string_itr = string_params.find(name);
+    auto uint_itr = uint_params.find(name);
+    auto bool_itr = bool_params.find(name);
+    auto header_itr = header_params.find(name);
+    if (string_itr != string_params.end()) {
+      *string_itr->second = value;
+    } else if (uint_itr != uint_params.end()) {
+      char* end = nullptr;
+      errno = 0;
+      const uint64_t parsed = strtoull(value.c_str(), &end, 10);
+      if (value.empty() || (*end != '\0') || (errno != 0) ||
+          (value[0] == '-')) {
+        return TRITONSERVER_ErrorNew(
+            TRITONSERVER_ERROR_INVALID_ARG,
+            ("Invalid value '" + value + "' for dragonfly parameter " + name)
+                .c_str());
+      }
+      *uint_itr->second = parsed;
+    } else if (header_itr != header_params.end()) {
+      headers[header_itr->second] = value;
+    } else if (name.compare(0, 7, "header.") == 0) {
+      headers[name.substr(7)] = value;
+    } else if (name == "filter") {
+      // Same '&' separated form as the X-Dragonfly-Filter header
+      filter = SplitList(value, '&');
+    } else if (name == "direct_patterns") {
+      direct_patterns = SplitList(value, ',');
+    } else if (bool_itr != bool_params.end()) {
+      if ((value != "true") && (value != "false")) {
+        return TRITONSERVER_ErrorNew(
+            TRITONSERVER_ERROR_INVALID_ARG,
+            ("Invalid value '" + value + "' for dragonfly parameter " + name)
+                .c_str());
+      }
+      *bool_itr->second = (value == "true");
+    } else {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INVALID_ARG,
+          ("Unknown dragonfly model parameter: " + name).c_str());
+    }
+  }
+  if (parameters.count("concurrency") > 0) {
+    concurrency_cap = concurrency;
+  }
+  return nullptr;
 }
+
+bool
+DragonflyConfig::FetchDirect(const std::string& path, uint64_t size) const
+{
+  if ((direct_max_size > 0) && (size <= direct_max_size)) {
+    return true;
+  }
+  // '*' matches across '/' as well, so "*.txt" covers every directory
+  for (const auto& pattern : direct_patterns) {
+    if (fnmatch(pattern.c_str(), path.c_str(), 0) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+DragonflyConfig
+DragonflyConfig::OriginConfig() const
+{
+  DragonflyConfig config = *this;
+  config.proxy.clear();
+  config.proxy_unix_socket.clear();
+  config.proxies.clear();
+  config.headers.clear();
+  config.filter.clear();
+  return config;
+}
+
+DragonflyConfig
+DragonflyConfig::ThroughProxy(const std::string& endpoint) const
+{
+  DragonflyConfig config = *this;
+  SplitProxyEndpoint(endpoint, &config.proxy, &config.proxy_unix_socket);
+  config.proxies.clear();
+  return config;
+}
+
 }  // namespace triton::repoagent::dragonfly
@@ -14,6 +14,9 @@
  * limitations under the License.
  */
 
+#include <cstdlib>
+#include <map>
+#include <memory>
 #include <string>
 
 #include "filesystem/api.h"
@@ -21,10 +24,88 @@
 
 namespace triton::repoagent::dragonfly {
 
+namespace {
+
+std::string
+GetCredentialPath()
+{
+  const char* file_path_c_str = std::getenv("TRITON_CLOUD_CREDENTIAL_PATH");
+  if (file_path_c_str != nullptr) {
+    // Load from credential file
+    return std::string(file_path_c_str);
+  }
+  return "/home/triton/cloud_credential.json";
+}
+
+std::string
+GetConfigPath()
+{
+  const char* config_path_c_str = std::getenv("TRITON_DRAGONFLY_CONFIG_PATH");
+  if (config_path_c_str != nullptr) {
+    // Load from config file
+    return std::string(config_path_c_str);
+  }
+  return "/home/triton/dragonfly_config.json";
+}
+
+// Per-model state, created when the model is first seen by the agent and
+// kept across reloads
+struct ModelState {
+  // Per-model overrides of the Dragonfly config, given as parameters of this
+  // agent under 'model_repository_agents' in config.pbtxt
+  std::map<std::string, std::string> parameters;
+};
+
+}  // namespace
+
 /////////////
 
 extern "C" {
 
+TRITONSERVER_Error*
+TRITONREPOAGENT_Initialize(TRITONREPOAGENT_Agent* agent)
+{
+  return InitializeAgent(GetConfigPath(), GetCredentialPath());
+}
+
+TRITONSERVER_Error*
+TRITONREPOAGENT_Finalize(TRITONREPOAGENT_Agent* agent)
+{
+  return FinalizeAgent();
+}
+
+TRITONSERVER_Error*
+TRITONREPOAGENT_ModelInitialize(
+    TRITONREPOAGENT_Agent* agent, TRITONREPOAGENT_AgentModel* model)
+{
+  std::unique_ptr<ModelState> state = std::make_unique<ModelState>();
+  uint32_t parameter_count = 0;
+  RETURN_IF_ERROR(
+      TRITONREPOAGENT_ModelParameterCount(agent, model, &parameter_count));
+  for (uint32_t i = 0; i < parameter_count; ++i) {
+    const char* name = nullptr;
+    const char* value = nullptr;
+    RETURN_IF_ERROR(
+        TRITONREPOAGENT_ModelParameter(agent, model, i, &name, &value));
+    state->parameters[name] = value;
+  }
+
+  RETURN_IF_ERROR(TRITONREPOAGENT_ModelSetState(
+      model, reinterpret_cast<void*>(state.get())));
+  state.release();
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+TRITONREPOAGENT_ModelFinalize(
+    TRITONREPOAGENT_Agent* agent, TRITONREPOAGENT_AgentModel* model)
+{
+  void* state = nullptr;
+  RETURN_IF_ERROR(TRITONREPOAGENT_ModelState(model, &state));
+  delete reinterpret_cast<ModelState*>(state);
+  return nullptr;
+}
+
 TRITONSERVER_Error*
 TRITONREPOAGENT_ModelAction(
     TRITONREPOAGENT_Agent* agent, TRITONREPOAGENT_AgentModel* model,
@@ -38,24 +119,9 @@ TRITONREPOAGENT_ModelAction(
           agent, model, &artifact_type, &location_cstr));
       const std::string location(location_cstr);
 
-      const char* file_path_c_str = std::getenv("TRITON_CLOUD_CREDENTIAL_PATH");
-      std::string cred_path;
-      if (file_path_c_str != nullptr) {
-        // Load from credential file
-        cred_path = std::string(file_path_c_str);
-      } else {
-        cred_path = "/home/triton/cloud_credential.json";
-      }
-
-      const char* config_path_c_str =
-          std::getenv("TRITON_DRAGONFLY_CONFIG_PATH");
-      std::string config_path;
-      if (config_path_c_str != nullptr) {
-        // Load from config file
-        config_path = std::string(config_path_c_str);
-      } else {
-        config_path = "/home/triton/dragonfly_config.json";
-      }
+      void* state = nullptr;
+      RETURN_IF_ERROR(TRITONREPOAGENT_ModelState(model, &state));
+      const ModelState* model_state = reinterpret_cast<ModelState*>(state);
 
       const char* temp_dir_cstr = nullptr;
       RETURN_IF_ERROR(TRITONREPOAGENT_ModelRepositoryLocationAcquire(
@@ -63,8 +129,9 @@ TRITONREPOAGENT_ModelAction(
       const std::string temp_dir(temp_dir_cstr);
 
       try {
-        RETURN_IF_ERROR(
-            LocalizePath(config_path, cred_path, location, temp_dir));
+        RETURN_IF_ERROR(LocalizePath(
+            GetConfigPath(), GetCredentialPath(), location, temp_dir,
+            model_state->parameters));
 
         char* l = const_cast<char*>(temp_dir.c_str());
         RETURN_IF_ERROR(TRITONREPOAGENT_ModelRepositoryUpdate(
@@ -79,7 +146,8 @@ TRITONREPOAGENT_ModelAction(
     default:
       return nullptr;
   }
+}
 
 }  // extern "C"
-}
+
 }  // namespace triton::repoagent::dragonfly
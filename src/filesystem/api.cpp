@@ -15,81 +15,83 @@
  */
 #include "api.h"
 
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "backend_registry.h"
 #include "common_utils.h"
 #include "config.h"
 #include "implementations/common.h"
+#include "implementations/http.h"
+#include "implementations/oci.h"
+#include "planner.h"
+#include "prefetch.h"
+#include "trace.h"
+#include "transfer.h"
 #include "triton/core/tritonserver.h"
 
-#define TRITON_ENABLE_GCS
-#define TRITON_ENABLE_S3
-#define TRITON_ENABLE_AZURE_STORAGE
-
-#ifdef TRITON_ENABLE_GCS
-#include "implementations/gcs.h"
-#endif  // TRITON_ENABLE_GCS
-
-#ifdef TRITON_ENABLE_S3
-#include "implementations/s3.h"
-#endif  // TRITON_ENABLE_S3
-
-#ifdef TRITON_ENABLE_AZURE_STORAGE
-#include "implementations/as.h"
-#endif  // TRITON_ENABLE_AZURE_STORAGE
-
-
-#include <mutex>
-
 namespace triton::repoagent::dragonfly {
 
 namespace {
 
+// Sections of the credential file
+const char* const kCredentialSchemes[] = {"gs", "s3", "as", "oci"};
+
 class FileSystemManager {
  public:
   TRITONSERVER_Error* GetFileSystem(
       const std::string& path, std::shared_ptr<FileSystem>& file_system,
       const std::string& cred_path);
 
-  // 创建file_system
+  // Load the credentials and create a client for every credential that
+  // names a bucket or account, so the first model load finds them ready.
+  void Initialize(const std::string& cred_path);
+
+  // Drop all credentials and clients
+  void Clear();
+
  private:
-  template <class CacheType, class CredentialType, class FileSystemType>
-  TRITONSERVER_Error* GetFileSystem(
-      const std::string& path, CacheType& cache,
-      std::shared_ptr<FileSystem>& file_system, const std::string& cred_path);
+  // Credential names of one scheme and their JSON, longest name first
+  using Credentials = std::vector<std::pair<std::string, std::string>>;
 
   TRITONSERVER_Error* LoadCredentials(const std::string& cred_path);
 
-  template <class CacheType, class CredentialType, class FileSystemType>
-  static void LoadCredential(
-      triton::common::TritonJson::Value& creds_json, const char* fs_type,
-      CacheType& cache);
+  // Client of the backend module serving 'scheme'
+  TRITONSERVER_Error* GetModuleFileSystem(
+      const std::string& scheme, const std::string& path,
+      std::shared_ptr<FileSystem>& file_system, const std::string& cred_path);
 
-  template <class CredentialType, class FileSystemType>
-  static void SortCache(
-      std::vector<std::tuple<
-          std::string, CredentialType, std::shared_ptr<FileSystemType>>>&
-          cache);
+  TRITONSERVER_Error* GetOCIFileSystem(
+      const std::string& path, std::shared_ptr<FileSystem>& file_system,
+      const std::string& cred_path);
+
+  static std::string ClientRoot(const std::string& path);
+
+  static void LoadCredential(
+      triton::common::TritonJson::Value& creds_json, const char* scheme,
+      Credentials* creds);
 
-  template <class CredentialType, class FileSystemType>
   static TRITONSERVER_Error* GetLongestMatchingNameIndex(
-      const std::vector<std::tuple<
-          std::string, CredentialType, std::shared_ptr<FileSystemType>>>& cache,
-      const std::string& path, size_t& idx);
-
-#ifdef TRITON_ENABLE_GCS
-  std::vector<
-      std::tuple<std::string, GCSCredential, std::shared_ptr<GCSFileSystem>>>
-      gs_cache_;
-#endif  // TRITON_ENABLE_GCS
-#ifdef TRITON_ENABLE_S3
-  std::vector<
-      std::tuple<std::string, S3Credential, std::shared_ptr<S3FileSystem>>>
-      s3_cache_;
-#endif  // TRITON_ENABLE_S3
-#ifdef TRITON_ENABLE_AZURE_STORAGE
-  std::vector<
-      std::tuple<std::string, ASCredential, std::shared_ptr<ASFileSystem>>>
-      as_cache_;
-#endif  // TRITON_ENABLE_AZURE_STORAGE
+      const Credentials& creds, const std::string& path, size_t& idx);
+
+  // Credentials by scheme
+  std::map<std::string, Credentials> creds_;
+  // Clients keyed by credential name and ClientRoot() of the path
+  std::map<std::string, std::shared_ptr<FileSystem>> clients_;
+  // Credential file the caches were loaded from, reloaded when it changes
+  std::string cred_path_;
+  struct timespec cred_mtime_ = {};
+  off_t cred_size_ = -1;
+  std::mutex mu_;
 };
 
 TRITONSERVER_Error*
@@ -97,49 +99,30 @@ FileSystemManager::GetFileSystem(
     const std::string& path, std::shared_ptr<FileSystem>& file_system,
     const std::string& cred_path)
 {
-  // Check if this is a GCS path (gs://$BUCKET_NAME)
-  if (!path.empty() && !path.rfind("gs://", 0)) {
-#ifndef TRITON_ENABLE_GCS
-    return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_UNSUPPORTED,
-        "gs:// file-system not supported. To enable, build with "
-        "-DTRITON_ENABLE_GCS=ON.");
-#else
-    return GetFileSystem<
-        std::vector<std::tuple<
-            std::string, GCSCredential, std::shared_ptr<GCSFileSystem>>>,
-        GCSCredential, GCSFileSystem>(path, gs_cache_, file_system, cred_path);
-#endif  // TRITON_ENABLE_GCS
+  // Models may be loaded in parallel
+  std::lock_guard<std::mutex> lock(mu_);
+
+  // Cloud storage (gs://$BUCKET_NAME, s3://$BUCKET_NAME and
+  // as://$ACCOUNT/$CONTAINER) is served by backend modules
+  for (const char* scheme : {"gs", "s3", "as"}) {
+    if (!path.rfind(std::string(scheme) + "://", 0)) {
+      return GetModuleFileSystem(scheme, path, file_system, cred_path);
+    }
   }
 
-  // Check if this is an S3 path (s3://$BUCKET_NAME)
-  if (!path.empty() && !path.rfind("s3://", 0)) {
-#ifndef TRITON_ENABLE_S3
-    return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_UNSUPPORTED,
-        "s3:// file-system not supported. To enable, build with "
-        "-DTRITON_ENABLE_S3=ON.");
-#else
-    return GetFileSystem<
-        std::vector<std::tuple<
-            std::string, S3Credential, std::shared_ptr<S3FileSystem>>>,
-        S3Credential, S3FileSystem>(path, s3_cache_, file_system, cred_path);
-#endif  // TRITON_ENABLE_S3
+  // Check if this is an HTTP(S) path, read without credentials
+  if (!path.rfind("http://", 0) || !path.rfind("https://", 0)) {
+    std::shared_ptr<FileSystem>& fs = clients_["http"];
+    if (!fs) {
+      fs = std::make_shared<HTTPFileSystem>();
+    }
+    file_system = fs;
+    return nullptr;
   }
 
-  // Check if this is an Azure Storage path
-  if (!path.empty() && !path.rfind("as://", 0)) {
-#ifndef TRITON_ENABLE_AZURE_STORAGE
-    return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_UNSUPPORTED,
-        "as:// file-system not supported. To enable, build with "
-        "-DTRITON_ENABLE_AZURE_STORAGE=ON.");
-#else
-    return GetFileSystem<
-        std::vector<std::tuple<
-            std::string, ASCredential, std::shared_ptr<ASFileSystem>>>,
-        ASCredential, ASFileSystem>(path, as_cache_, file_system, cred_path);
-#endif  // TRITON_ENABLE_AZURE_STORAGE
+  // Check if this is an OCI registry path (oci://$REGISTRY/$REPOSITORY)
+  if (!path.rfind("oci://", 0)) {
+    return GetOCIFileSystem(path, file_system, cred_path);
   }
 
   return TRITONSERVER_ErrorNew(
@@ -149,107 +132,212 @@ FileSystemManager::GetFileSystem(
 TRITONSERVER_Error*
 FileSystemManager::LoadCredentials(const std::string& cred_path)
 {
+  // Keep the parsed credentials and their clients until the file changes
+  struct stat st;
+  if (stat(cred_path.c_str(), &st) != 0) {
+    cred_size_ = -1;
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_NOT_FOUND,
+        ("Cannot stat credential file " + cred_path + ": " + strerror(errno))
+            .c_str());
+  }
+  if ((cred_path == cred_path_) && (st.st_size == cred_size_) &&
+      (st.st_mtim.tv_sec == cred_mtime_.tv_sec) &&
+      (st.st_mtim.tv_nsec == cred_mtime_.tv_nsec)) {
+    return nullptr;
+  }
+  TraceSpan span("LoadCredentials", "filesystem");
+  span.Arg("path", cred_path);
+  clients_.clear();
+  cred_size_ = -1;
+
   // 从 cred_path 获取配置文件
   triton::common::TritonJson::Value creds_json;
   std::string cred_file_content;
   RETURN_IF_ERROR(ReadLocalFile(cred_path, &cred_file_content));
   RETURN_IF_ERROR(creds_json.Parse(cred_file_content));
 
-  // 根据文件系统，解析
-#ifdef TRITON_ENABLE_GCS
-  // load GCS credentials
-  LoadCredential<
-      std::vector<std::tuple<
-          std::string, GCSCredential, std::shared_ptr<GCSFileSystem>>>,
-      GCSCredential, GCSFileSystem>(creds_json, "gs", gs_cache_);
-#endif  // TRITON_ENABLE_GCS
-#ifdef TRITON_ENABLE_S3
-  // load S3 credentials
-  LoadCredential<
-      std::vector<
-          std::tuple<std::string, S3Credential, std::shared_ptr<S3FileSystem>>>,
-      S3Credential, S3FileSystem>(creds_json, "s3", s3_cache_);
-#endif  // TRITON_ENABLE_S3
-#ifdef TRITON_ENABLE_AZURE_STORAGE
-  // load AS credentials
-  LoadCredential<
-      std::vector<
-          std::tuple<std::string, ASCredential, std::shared_ptr<ASFileSystem>>>,
-      ASCredential, ASFileSystem>(creds_json, "as", as_cache_);
-#endif  // TRITON_ENABLE_AZURE_STORAGE
+  // Kept as JSON, the backend modules parse their own credentials
+  for (const char* scheme : kCredentialSchemes) {
+    LoadCredential(creds_json, scheme, &creds_[scheme]);
+  }
+
+  cred_path_ = cred_path;
+  cred_mtime_ = st.st_mtim;
+  cred_size_ = st.st_size;
   return nullptr;
 }
 
-
-template <class CacheType, class CredentialType, class FileSystemType>
 void
-FileSystemManager::LoadCredential(
-    triton::common::TritonJson::Value& creds_json, const char* fs_type,
-    CacheType& cache)
+FileSystemManager::Initialize(const std::string& cred_path)
 {
-  cache.clear();
-  triton::common::TritonJson::Value creds_fs_json;
-  if (creds_json.Find(fs_type, &creds_fs_json)) {
-    std::vector<std::string> cred_names;
-    creds_fs_json.Members(&cred_names);
-    for (size_t i = 0; i < cred_names.size(); i++) {
-      std::string cred_name = cred_names[i];
-      triton::common::TritonJson::Value cred_json;
-      creds_fs_json.Find(cred_name.c_str(), &cred_json);
-      ASCredential as(cred_json);
-      cache.push_back(std::make_tuple(
-          cred_name, CredentialType(cred_json),
-          std::shared_ptr<FileSystemType>()));
+  std::vector<std::string> names;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    TRITONSERVER_Error* err = LoadCredentials(cred_path);
+    if (err != nullptr) {
+      // Reported again by the first model load that needs the credentials
+      TRITONSERVER_ErrorDelete(err);
+      return;
+    }
+    for (const auto& scheme_creds : creds_) {
+      for (const auto& cred : scheme_creds.second) {
+        names.push_back(cred.first);
+      }
+    }
+  }
+
+  for (const auto& name : names) {
+    // Default credentials and bare schemes do not say which endpoint to use
+    const size_t scheme_end = name.find("://");
+    if ((scheme_end == std::string::npos) ||
+        (name.size() <= scheme_end + 3)) {
+      continue;
+    }
+    std::shared_ptr<FileSystem> fs;
+    try {
+      TRITONSERVER_Error* err = GetFileSystem(name, fs, cred_path);
+      if (err != nullptr) {
+        TRITONSERVER_ErrorDelete(err);
+      }
+    }
+    catch (const std::exception&) {
+      // Retried on the first model load from this location
     }
-    SortCache(cache);
   }
 }
 
-// 根据filesystem的类型进行处理
-template <class CacheType, class CredentialType, class FileSystemType>
+void
+FileSystemManager::Clear()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  clients_.clear();
+  creds_.clear();
+  cred_path_.clear();
+  cred_size_ = -1;
+}
+
 TRITONSERVER_Error*
-FileSystemManager::GetFileSystem(
-    const std::string& path, CacheType& cache,
+FileSystemManager::GetModuleFileSystem(
+    const std::string& scheme, const std::string& path,
     std::shared_ptr<FileSystem>& file_system, const std::string& cred_path)
 {
+  // Report a backend that was not built before missing credentials
+  Backend* backend;
+  RETURN_IF_ERROR(GetBackendRegistry().Get(scheme, &backend));
   RETURN_IF_ERROR(LoadCredentials(cred_path));
 
+  const Credentials& creds = creds_[scheme];
   size_t idx;
-  RETURN_IF_ERROR(GetLongestMatchingNameIndex(cache, path, idx));
-  CredentialType cred = std::get<1>(cache[idx]);
+  RETURN_IF_ERROR(GetLongestMatchingNameIndex(creds, path, idx));
+  const std::string key = creds[idx].first + '\n' + ClientRoot(path);
+  auto itr = clients_.find(key);
+  if (itr != clients_.end()) {
+    file_system = itr->second;
+    return nullptr;
+  }
 
-  std::shared_ptr<FileSystemType> fs =
-      std::make_shared<FileSystemType>(path, cred);
-  RETURN_IF_ERROR(fs->CheckClient(path));
+  std::shared_ptr<FileSystem> fs;
+  RETURN_IF_ERROR(backend->CreateFileSystem(path, creds[idx].second, &fs));
+  clients_[key] = fs;
   file_system = fs;
   return nullptr;
 }
 
-template <class CredentialType, class FileSystemType>
+TRITONSERVER_Error*
+FileSystemManager::GetOCIFileSystem(
+    const std::string& path, std::shared_ptr<FileSystem>& file_system,
+    const std::string& cred_path)
+{
+  // Public registries allow anonymous pulls, so unlike the storage backends
+  // a missing credential file or entry is not an error
+  std::string name;
+  OCICredential cred;
+  TRITONSERVER_Error* err = LoadCredentials(cred_path);
+  if (err != nullptr) {
+    TRITONSERVER_ErrorDelete(err);
+  } else {
+    const Credentials& creds = creds_["oci"];
+    size_t idx;
+    err = GetLongestMatchingNameIndex(creds, path, idx);
+    if (err != nullptr) {
+      TRITONSERVER_ErrorDelete(err);
+    } else {
+      triton::common::TritonJson::Value cred_json;
+      RETURN_IF_ERROR(cred_json.Parse(creds[idx].second));
+      name = creds[idx].first;
+      cred = OCICredential(cred_json);
+    }
+  }
+
+  const std::string key = "oci\n" + name + '\n' + ClientRoot(path);
+  std::shared_ptr<FileSystem>& fs = clients_[key];
+  if (!fs) {
+    fs = std::make_shared<OCIFileSystem>(path, cred);
+  }
+  file_system = fs;
+  return nullptr;
+}
+
+std::string
+FileSystemManager::ClientRoot(const std::string& path)
+{
+  // The backends derive the endpoint, account and bucket of a client from
+  // the part of the path that follows the scheme
+  size_t start = path.find("://");
+  start = (start == std::string::npos) ? 0 : start + 3;
+  for (const char* protocol : {"http://", "https://"}) {
+    if (path.compare(start, strlen(protocol), protocol) == 0) {
+      start += strlen(protocol);
+    }
+  }
+  size_t end = path.find('/', start);
+  // A 'host:port' endpoint is followed by the bucket
+  if ((end != std::string::npos) && (path.find(':', start) < end)) {
+    end = path.find('/', end + 1);
+  }
+  return path.substr(0, end);
+}
+
 void
-FileSystemManager::SortCache(
-    std::vector<std::tuple<
-        std::string, CredentialType, std::shared_ptr<FileSystemType>>>& cache)
+FileSystemManager::LoadCredential(
+    triton::common::TritonJson::Value& creds_json, const char* scheme,
+    Credentials* creds)
 {
-  std::sort(
-      cache.begin(), cache.end(),
-      [](std::tuple<
-             std::string, CredentialType, std::shared_ptr<FileSystemType>>
-             a,
-         std::tuple<
-             std::string, CredentialType, std::shared_ptr<FileSystemType>>
-             b) { return std::get<0>(a).size() >= std::get<0>(b).size(); });
+  creds->clear();
+  triton::common::TritonJson::Value creds_fs_json;
+  if (creds_json.Find(scheme, &creds_fs_json)) {
+    std::vector<std::string> cred_names;
+    creds_fs_json.Members(&cred_names);
+    for (const auto& cred_name : cred_names) {
+      triton::common::TritonJson::Value cred_json;
+      triton::common::TritonJson::WriteBuffer buffer;
+      if (!creds_fs_json.Find(cred_name.c_str(), &cred_json)) {
+        continue;
+      }
+      TRITONSERVER_Error* err = cred_json.Write(&buffer);
+      if (err != nullptr) {
+        TRITONSERVER_ErrorDelete(err);
+        continue;
+      }
+      creds->emplace_back(cred_name, buffer.Contents());
+    }
+    // The longest matching name is the most specific credential
+    std::stable_sort(
+        creds->begin(), creds->end(),
+        [](const std::pair<std::string, std::string>& a,
+           const std::pair<std::string, std::string>& b) {
+          return a.first.size() > b.first.size();
+        });
+  }
 }
 
-template <class CredentialType, class FileSystemType>
 TRITONSERVER_Error*
 FileSystemManager::GetLongestMatchingNameIndex(
-    const std::vector<std::tuple<
-        std::string, CredentialType, std::shared_ptr<FileSystemType>>>& cache,
-    const std::string& path, size_t& idx)
+    const Credentials& creds, const std::string& path, size_t& idx)
 {
-  for (size_t i = 0; i < cache.size(); i++) {
-    if (!path.rfind(std::get<0>(cache[i]), 0)) {
+  for (size_t i = 0; i < creds.size(); i++) {
+    if (!path.rfind(creds[i].first, 0)) {
       idx = i;
       return nullptr;
     }
@@ -260,23 +348,232 @@ FileSystemManager::GetLongestMatchingNameIndex(
 }
 
 FileSystemManager fsm_;
+
+TRITONSERVER_Error*
+ReadConfig(
+    const std::string& config_path,
+    triton::common::TritonJson::Value* config_json)
+{
+  std::string config_file_content;
+  RETURN_IF_ERROR(ReadLocalFile(config_path, &config_file_content));
+  RETURN_IF_ERROR(config_json->Parse(config_file_content));
+  return nullptr;
+}
+
+void
+ApplyProcessLimits(const DragonflyConfig& config)
+{
+  // Limits are process-wide, so the latest config wins for in-flight
+  // transfers of other models as well
+  GetBandwidthLimiter().network.SetRate(config.network_rate_limit);
+  GetBandwidthLimiter().disk.SetRate(config.disk_write_rate_limit);
+}
+
+// Applies the bandwidth limits of the config file again when it changes, so
+// a tighter limit reaches the transfers already running without waiting for
+// the next model load. The file is checked every kIntervalMs by its mtime
+// and size, like the credential file.
+class ConfigWatcher {
+ public:
+  ~ConfigWatcher() { Stop(); }
+
+  void Start(const std::string& config_path);
+  void Stop();
+
+ private:
+  static constexpr int64_t kIntervalMs = 1000;
+
+  void Run();
+  // Whether the file changed since the last call
+  bool Changed();
+
+  std::string path_;
+  struct timespec mtime_ = {};
+  off_t size_ = -1;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool stopping_ = false;
+  std::thread thread_;
+};
+
+void
+ConfigWatcher::Start(const std::string& config_path)
+{
+  Stop();
+  path_ = config_path;
+  // Read by the caller already
+  Changed();
+  stopping_ = false;
+  thread_ = std::thread(&ConfigWatcher::Run, this);
+}
+
+void
+ConfigWatcher::Stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+bool
+ConfigWatcher::Changed()
+{
+  struct stat st;
+  if (stat(path_.c_str(), &st) != 0) {
+    const bool changed = (size_ != -1);
+    size_ = -1;
+    return changed;
+  }
+  if ((st.st_size == size_) && (st.st_mtim.tv_sec == mtime_.tv_sec) &&
+      (st.st_mtim.tv_nsec == mtime_.tv_nsec)) {
+    return false;
+  }
+  mtime_ = st.st_mtim;
+  size_ = st.st_size;
+  return true;
+}
+
+void
+ConfigWatcher::Run()
+{
+  std::unique_lock<std::mutex> lock(mu_);
+  while (!cv_.wait_for(
+      lock, std::chrono::milliseconds(kIntervalMs),
+      [this]() { return stopping_; })) {
+    if (!Changed()) {
+      continue;
+    }
+    // A missing or broken file keeps the limits in force
+    triton::common::TritonJson::Value config_json;
+    TRITONSERVER_Error* err = ReadConfig(path_, &config_json);
+    if (err != nullptr) {
+      LOG_MESSAGE(
+          TRITONSERVER_LOG_WARN,
+          ("dragonfly: bandwidth limits not reloaded: " +
+           std::string(TRITONSERVER_ErrorMessage(err)))
+              .c_str());
+      TRITONSERVER_ErrorDelete(err);
+      continue;
+    }
+    DragonflyConfig config(config_json);
+    ApplyProcessLimits(config);
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_INFO,
+        ("dragonfly: bandwidth limits reloaded from " + path_).c_str());
+  }
+}
+
+ConfigWatcher config_watcher_;
 }  // namespace
 
+TRITONSERVER_Error*
+InitializeAgent(const std::string& config_path, const std::string& cred_path)
+{
+  if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL, "Failed to initialize libcurl");
+  }
+  InitializeConnectionPool();
+  GetConcurrencyController().CreateMetrics();
+
+  fsm_.Initialize(cred_path);
+  config_watcher_.Start(config_path);
+
+  // The config is read again on every load; a missing or broken one is
+  // reported there rather than failing server start.
+  triton::common::TritonJson::Value config_json;
+  TRITONSERVER_Error* err = ReadConfig(config_path, &config_json);
+  if (err != nullptr) {
+    TRITONSERVER_ErrorDelete(err);
+    return nullptr;
+  }
+  DragonflyConfig config(config_json);
+  ApplyProcessLimits(config);
+  // The adaptive limit and the endpoints are shared by the whole process,
+  // so they come from the config file at server start and never from a
+  // model
+  GetConcurrencyController().Configure(
+      config.concurrency, config.max_concurrency);
+  GetProxyPool().Configure(
+      config.proxies, config.proxy_health_interval_ms,
+      config.proxy_direct_fallback);
+  PrewarmConnections(config.prewarm, config);
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+FinalizeAgent()
+{
+  // Clients hold SDK and curl state, release them first
+  config_watcher_.Stop();
+  GetPrefetcher().Stop();
+  fsm_.Clear();
+  GetBackendRegistry().Finalize();
+  GetProxyPool().Stop();
+  FinalizeConnectionPool();
+  GetConcurrencyController().DeleteMetrics();
+  curl_global_cleanup();
+  return nullptr;
+}
+
 TRITONSERVER_Error*
 LocalizePath(
     const std::string& config_path, const std::string& cred_path,
-    const std::string& location, const std::string& temp_dir)
+    const std::string& location, const std::string& temp_dir,
+    const std::map<std::string, std::string>& parameters)
 {
-  std::shared_ptr<FileSystem> fs;
-  RETURN_IF_ERROR(fsm_.GetFileSystem(location, fs, cred_path));
-
-  std::string config_file_content;
-  RETURN_IF_ERROR(ReadLocalFile(config_path, &config_file_content));
   triton::common::TritonJson::Value config_json;
-  RETURN_IF_ERROR(config_json.Parse(config_file_content));
+  RETURN_IF_ERROR(ReadConfig(config_path, &config_json));
   DragonflyConfig config(config_json);
+  RETURN_IF_ERROR(config.ApplyParameters(parameters));
+  ApplyProcessLimits(config);
 
-  return fs->LocalizePath(location, temp_dir, config);
+  std::unique_ptr<Trace> trace;
+  if (!config.trace_dir.empty()) {
+    trace.reset(new Trace(location));
+  }
+  TRITONSERVER_Error* err = nullptr;
+  {
+    ScopedTrace scoped_trace(trace.get());
+    TraceSpan span("LocalizePath", "load");
+    span.Arg("location", location);
+    span.Arg("temp_dir", temp_dir);
+
+    std::shared_ptr<FileSystem> fs;
+    {
+      TraceSpan fs_span("GetFileSystem", "filesystem");
+      err = fsm_.GetFileSystem(location, fs, cred_path);
+    }
+    if (err == nullptr) {
+      GetPrefetcher().BeginLoad(location);
+      err = LocalizeModel(*fs, location, temp_dir, config);
+      GetPrefetcher().EndLoad(location, err == nullptr);
+      if (err != nullptr) {
+        GetListingCache().Invalidate(*fs, location);
+      } else if (config.prefetch_ensembles) {
+        // Composing models get their own parameters, not the ensemble's
+        DragonflyConfig file_config(config_json);
+        PrefetchEnsemble(fs, location, temp_dir, file_config);
+      }
+    }
+    if (err != nullptr) {
+      span.Arg("error", TRITONSERVER_ErrorMessage(err));
+    }
+  }
+
+  if (trace) {
+    // A trace that cannot be written must not fail the load
+    TRITONSERVER_Error* trace_err = trace->Write(config.trace_dir);
+    if (trace_err != nullptr) {
+      TRITONSERVER_ErrorDelete(trace_err);
+    }
+  }
+  return err;
 }
 
 }  // namespace triton::repoagent::dragonfly
@@ -14,12 +14,20 @@
  * limitations under the License.
  */
 
+#include <map>
 #include <string>
 
 #include "../status.h"
 
 namespace triton::repoagent::dragonfly {
+// Set up SDKs, credentials and clients once per process, and optionally open
+// connections ahead of the first load. Undone by FinalizeAgent().
+TRITONSERVER_Error* InitializeAgent(
+    const std::string& config_path, const std::string& cred_path);
+TRITONSERVER_Error* FinalizeAgent();
+
 TRITONSERVER_Error* LocalizePath(
     const std::string& config_path, const std::string& cred_path,
-    const std::string& location, const std::string& temp_dir);
+    const std::string& location, const std::string& temp_dir,
+    const std::map<std::string, std::string>& parameters);
 }
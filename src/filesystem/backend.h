@@ -0,0 +1,96 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "implementations/common.h"
+#include "trace.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly {
+
+// Storage backends that need a cloud SDK are built as modules of their own,
+// libtritonrepoagent_dragonfly_<name>.so next to the agent, and loaded the
+// first time a location with their scheme is seen. The agent and its modules
+// are built from the same tree and share C++ types; this version guards
+// against mixing builds.
+constexpr uint32_t kBackendApiVersion = 2;
+
+// Name of the function every module exports, of type BackendCreateFn
+#define DRAGONFLY_BACKEND_CREATE "TRITONDRAGONFLY_BackendCreate"
+
+// What the agent hands to a module it loads
+struct BackendHost {
+  uint32_t api_version;
+  // The agent's Trace::Current(), so the module's spans land in the trace
+  // of the load
+  Trace::CurrentFn current_trace;
+};
+
+class Backend {
+ public:
+  // Set up and tear down process-wide SDK state. Finalize() runs once every
+  // client created by the backend is gone; Initialize() may follow again.
+  virtual TRITONSERVER_Error* Initialize() { return nullptr; }
+  virtual void Finalize() {}
+
+  // Client for 'path', given the JSON of the credential the credential file
+  // has for it
+  virtual TRITONSERVER_Error* CreateFileSystem(
+      const std::string& path, const std::string& credential,
+      std::shared_ptr<FileSystem>* file_system) = 0;
+
+  virtual ~Backend() = default;
+};
+
+using BackendCreateFn = Backend* (*)(const BackendHost* host);
+
+// Backend of a FileSystem implementation constructed from its path and
+// credential, as all the SDK based ones are
+template <class CredentialType, class FileSystemType>
+class FileSystemBackend : public Backend {
+ public:
+  TRITONSERVER_Error* CreateFileSystem(
+      const std::string& path, const std::string& credential,
+      std::shared_ptr<FileSystem>* file_system) override
+  {
+    triton::common::TritonJson::Value cred_json;
+    RETURN_IF_ERROR(cred_json.Parse(credential));
+    CredentialType cred(cred_json);
+    std::shared_ptr<FileSystemType> fs =
+        std::make_shared<FileSystemType>(path, cred);
+    RETURN_IF_ERROR(fs->CheckClient(path));
+    *file_system = fs;
+    return nullptr;
+  }
+};
+
+// Called first by a module's create function. Return false if the module
+// was built for another version of the agent.
+bool
+AttachToHost(const BackendHost* host)
+{
+  if ((host == nullptr) || (host->api_version != kBackendApiVersion)) {
+    return false;
+  }
+  Trace::CurrentHook() = host->current_trace;
+  return true;
+}
+
+}  // namespace triton::repoagent::dragonfly
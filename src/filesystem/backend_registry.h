@@ -0,0 +1,153 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <dlfcn.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "backend.h"
+#include "trace.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly {
+
+// Backend modules by URL scheme, loaded with dlopen() on first use. Modules
+// stay mapped until the process exits: clients and SDK state may outlive
+// FinalizeAgent() in threads the SDKs started.
+class BackendRegistry {
+ public:
+  // Backend for 'scheme', e.g. "s3", loaded and initialized if needed
+  TRITONSERVER_Error* Get(const std::string& scheme, Backend** backend);
+
+  // Finalize every initialized backend, after their clients are released
+  void Finalize();
+
+ private:
+  // Scheme, file name suffix and the CMake option that builds the module
+  struct ModuleInfo {
+    const char* scheme;
+    const char* name;
+    const char* option;
+  };
+  static constexpr ModuleInfo kModules[] = {
+      {"s3", "s3", "TRITON_ENABLE_S3"},
+      {"gs", "gcs", "TRITON_ENABLE_GCS"},
+      {"as", "azure", "TRITON_ENABLE_AZURE_STORAGE"},
+  };
+
+  struct Module {
+    std::unique_ptr<Backend> backend;
+    bool initialized = false;
+  };
+
+  static std::string ModuleDir();
+
+  std::mutex mu_;
+  // Modules loaded so far, by scheme
+  std::map<std::string, Module> modules_;
+};
+
+TRITONSERVER_Error*
+BackendRegistry::Get(const std::string& scheme, Backend** backend)
+{
+  const ModuleInfo* info = nullptr;
+  for (const auto& entry : kModules) {
+    if (scheme == entry.scheme) {
+      info = &entry;
+    }
+  }
+  if (info == nullptr) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_UNSUPPORTED,
+        (scheme + ":// file-system not supported").c_str());
+  }
+
+  std::lock_guard<std::mutex> lock(mu_);
+  Module& module = modules_[scheme];
+  if (!module.backend) {
+    TraceSpan span("LoadBackend", "filesystem");
+    const std::string path = ModuleDir() + "libtritonrepoagent_dragonfly_" +
+                             info->name + ".so";
+    span.Arg("path", path);
+    auto unsupported = [&](const std::string& reason) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_UNSUPPORTED,
+          (scheme + ":// file-system not supported: " + reason +
+           ". To enable, build with -D" + info->option + "=ON.")
+              .c_str());
+    };
+    // Local, so the SDKs of one module do not resolve symbols of another
+    void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+      return unsupported(dlerror());
+    }
+    BackendCreateFn create = reinterpret_cast<BackendCreateFn>(
+        dlsym(handle, DRAGONFLY_BACKEND_CREATE));
+    const BackendHost host = {kBackendApiVersion, &Trace::Current};
+    Backend* created = (create == nullptr) ? nullptr : create(&host);
+    if (created == nullptr) {
+      dlclose(handle);
+      return unsupported(path + " was built for another agent version");
+    }
+    module.backend.reset(created);
+  }
+
+  if (!module.initialized) {
+    RETURN_IF_ERROR(module.backend->Initialize());
+    module.initialized = true;
+  }
+  *backend = module.backend.get();
+  return nullptr;
+}
+
+void
+BackendRegistry::Finalize()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  for (auto& entry : modules_) {
+    if (entry.second.initialized) {
+      entry.second.backend->Finalize();
+      entry.second.initialized = false;
+    }
+  }
+}
+
+std::string
+BackendRegistry::ModuleDir()
+{
+  // The directory the agent itself was loaded from
+  Dl_info info;
+  void* self = reinterpret_cast<void*>(&BackendRegistry::ModuleDir);
+  if ((dladdr(self, &info) == 0) || (info.dli_fname == nullptr)) {
+    return "";
+  }
+  const std::string agent = info.dli_fname;
+  const size_t slash = agent.find_last_of('/');
+  return (slash == std::string::npos) ? "" : agent.substr(0, slash + 1);
+}
+
+BackendRegistry&
+GetBackendRegistry()
+{
+  static BackendRegistry registry;
+  return registry;
+}
+
+}  // namespace triton::repoagent::dragonfly
@@ -0,0 +1,444 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "common_utils.h"
+#include "listing.h"
+#include "openssl/evp.h"
+#include "status.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly {
+
+// Name of 'file' in the shared cache. Objects with a declared SHA-256 are
+// stored by content, others by location, ETag and size. Empty for objects
+// without either, which cannot be told apart from a later version.
+std::string
+CacheKey(const Listing& listing, Listing::FileId file)
+{
+  if (!listing.Sha256(file).empty()) {
+    return "sha256-" + std::string(listing.Sha256(file));
+  }
+  if (listing.ETag(file).empty()) {
+    return "";
+  }
+  const std::string identity = listing.Location(file) + '\n' +
+                               std::string(listing.ETag(file)) + '\n' +
+                               std::to_string(listing.Size(file));
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int size = 0;
+  if (EVP_Digest(
+          identity.data(), identity.size(), digest, &size, EVP_sha256(),
+          nullptr) != 1) {
+    return "";
+  }
+  static const char kHex[] = "0123456789abcdef";
+  std::string key = "etag-";
+  for (unsigned int i = 0; i < size; ++i) {
+    key += kHex[digest[i] >> 4];
+    key += kHex[digest[i] & 0xf];
+  }
+  return key;
+}
+
+// One model load's handle on the cache of downloaded objects that every
+// Triton process on the host shares through 'cache_dir'. Objects are files
+// under 'objects', hardlinked into the staging directory of each load that
+// needs them, so a model costs its disk space and its transfer once per
+// host. The process that downloads an object holds an exclusive flock() on
+// the object's lock file until it is published; the others wait for it and
+// link the result. The kernel drops the lock of a process that dies, and a
+// waiter then downloads the object itself.
+//
+// The cache must be on the same filesystem as the model directories;
+// otherwise it is not used.
+class SharedCache {
+ public:
+  enum class Result {
+    // Linked at the path
+    kHit,
+    // To be downloaded by this load and published
+    kClaimed,
+    // Being downloaded by another process, or by this load under another
+    // path
+    kBusy,
+    // Not cached, download as usual
+    kUncached,
+  };
+
+  // Cache in 'dir' for a load staged in 'staging', empty 'dir' disables it.
+  // Least recently used objects that no model links to are evicted to keep
+  // the cache below 'max_size' bytes, 0 for unlimited.
+  SharedCache(
+      const std::string& dir, uint64_t max_size, const std::string& staging);
+  // Releases the claims of objects that were not published
+  ~SharedCache();
+
+  SharedCache(const SharedCache&) = delete;
+  SharedCache& operator=(const SharedCache&) = delete;
+
+  // Link the object 'key' of 'size' bytes to 'path', or claim it. With
+  // 'wait', wait for another process that holds the claim instead of
+  // returning kBusy.
+  Result Lookup(
+      const std::string& key, uint64_t size, const std::string& path,
+      bool wait);
+
+  // Publish the claimed object 'key' downloaded to 'path' and release the
+  // claim. Nothing happens for objects that were not claimed.
+  void Publish(const std::string& key, uint64_t size, const std::string& path);
+
+  // Whether a claim is held; a load that holds one must not wait, or two
+  // processes could end up waiting for each other
+  bool HoldsClaims();
+
+  // Evict objects once the cache is above its size
+  void Evict();
+
+ private:
+  // Claims held at once, each is an open file
+  static constexpr size_t kMaxClaims = 256;
+  // Returned by LockObject() for a lock another process holds
+  static constexpr int kLockBusy = -2;
+
+  std::string ObjectPath(const std::string& key) const;
+  // Descriptor of the lock file of 'object', locked, kLockBusy or -1.
+  // Eviction removes lock files, so a lock taken on one that was removed
+  // meanwhile is taken again on the current one.
+  static int LockObject(const std::string& object, bool wait);
+  // Remove 'object' and its lock file, if no process holds the lock
+  static bool RemoveObject(const std::string& object);
+  static bool Link(
+      const std::string& object, uint64_t size, const std::string& path);
+  // When 'object' was last linked to a model, see Link()
+  static time_t LastUse(
+      const std::string& object, const struct stat& object_st);
+
+  std::string dir_;
+  uint64_t max_size_;
+  std::mutex mu_;
+  // Lock file descriptors by key
+  std::map<std::string, int> claims_;
+  bool published_ = false;
+};
+
+SharedCache::SharedCache(
+    const std::string& dir, uint64_t max_size, const std::string& staging)
+    : max_size_(max_size)
+{
+  if (dir.empty()) {
+    return;
+  }
+  // Links cannot cross filesystems, compare with the directory that will
+  // hold the staging directory
+  const std::string staging_parent =
+      staging.substr(0, staging.find_last_of('/') + 1);
+  struct stat cache_st, staging_st;
+  TRITONSERVER_Error* err = MakeDirectory(dir);
+  if (err == nullptr) {
+    err = MakeDirectory(JoinPath({dir, "objects"}));
+  }
+  if (err != nullptr) {
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_WARN,
+        (std::string("dragonfly: cache_dir not used: ") +
+         TRITONSERVER_ErrorMessage(err))
+            .c_str());
+    TRITONSERVER_ErrorDelete(err);
+    return;
+  }
+  if ((stat(dir.c_str(), &cache_st) != 0) ||
+      (stat(
+           (staging_parent.empty() ? "." : staging_parent.c_str()),
+           &staging_st) != 0) ||
+      (cache_st.st_dev != staging_st.st_dev)) {
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_WARN,
+        ("dragonfly: cache_dir " + dir +
+         " not used: it is not on the filesystem of " + staging_parent)
+            .c_str());
+    return;
+  }
+  dir_ = dir;
+}
+
+SharedCache::~SharedCache()
+{
+  for (const auto& claim : claims_) {
+    close(claim.second);
+  }
+}
+
+SharedCache::Result
+SharedCache::Lookup(
+    const std::string& key, uint64_t size, const std::string& path, bool wait)
+{
+  if (dir_.empty() || key.empty()) {
+    return Result::kUncached;
+  }
+  const std::string object = ObjectPath(key);
+  if (Link(object, size, path)) {
+    return Result::kHit;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    // A flock() on a second descriptor would wait for this load itself
+    if ((claims_.find(key) != claims_.end()) ||
+        (claims_.size() >= kMaxClaims)) {
+      return Result::kBusy;
+    }
+  }
+
+  if (MakeDirectory(object.substr(0, object.find_last_of('/'))) != nullptr) {
+    return Result::kUncached;
+  }
+  const int fd = LockObject(object, wait);
+  if (fd == kLockBusy) {
+    return Result::kBusy;
+  }
+  if (fd < 0) {
+    return Result::kUncached;
+  }
+  // Published by the process that held the claim before
+  if (Link(object, size, path)) {
+    close(fd);
+    return Result::kHit;
+  }
+  std::lock_guard<std::mutex> lock(mu_);
+  claims_[key] = fd;
+  return Result::kClaimed;
+}
+
+void
+SharedCache::Publish(
+    const std::string& key, uint64_t size, const std::string& path)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  auto itr = claims_.find(key);
+  if (itr == claims_.end()) {
+    return;
+  }
+  const std::string object = ObjectPath(key);
+  const std::string temp = object + ".tmp-" + std::to_string(getpid());
+  struct stat st;
+  if ((stat(path.c_str(), &st) == 0) &&
+      (static_cast<uint64_t>(st.st_size) == size)) {
+    // Appears complete under its final name or not at all
+    remove(temp.c_str());
+    if ((link(path.c_str(), temp.c_str()) == 0) &&
+        (rename(temp.c_str(), object.c_str()) == 0)) {
+      published_ = true;
+    } else {
+      remove(temp.c_str());
+    }
+  }
+  close(itr->second);
+  claims_.erase(itr);
+}
+
+bool
+SharedCache::HoldsClaims()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  return !claims_.empty();
+}
+
+void
+SharedCache::Evict()
+{
+  if (dir_.empty() || (max_size_ == 0) || !published_) {
+    return;
+  }
+  // One process evicts at a time, the others skip it
+  const int evict_fd = open(
+      JoinPath({dir_, ".evict.lock"}).c_str(), O_RDWR | O_CREAT | O_CLOEXEC,
+      0644);
+  if (evict_fd < 0) {
+    return;
+  }
+  if (flock(evict_fd, LOCK_EX | LOCK_NB) != 0) {
+    close(evict_fd);
+    return;
+  }
+
+  // (last use, size, path) of the objects only the cache links to
+  std::vector<std::tuple<time_t, uint64_t, std::string>> unused;
+  uint64_t total = 0;
+  const std::string objects = JoinPath({dir_, "objects"});
+  if (DIR* shards = opendir(objects.c_str())) {
+    while (struct dirent* shard = readdir(shards)) {
+      if (shard->d_name[0] == '.') {
+        continue;
+      }
+      const std::string shard_dir = JoinPath({objects, shard->d_name});
+      DIR* entries = opendir(shard_dir.c_str());
+      if (entries == nullptr) {
+        continue;
+      }
+      // Lock files of objects that are not there, e.g. downloads that failed
+      std::vector<std::string> orphans;
+      while (struct dirent* entry = readdir(entries)) {
+        const std::string name = entry->d_name;
+        const std::string path = JoinPath({shard_dir, name});
+        const size_t dot = name.find('.');
+        if ((dot != std::string::npos) && (dot + 5 == name.size()) &&
+            (name.compare(dot, 5, ".lock") == 0)) {
+          struct stat st;
+          if (lstat(path.substr(0, path.size() - 5).c_str(), &st) != 0) {
+            orphans.push_back(path.substr(0, path.size() - 5));
+          }
+          continue;
+        }
+        if ((name[0] == '.') || (dot != std::string::npos)) {
+          // Temporary files
+          continue;
+        }
+        struct stat st;
+        if ((lstat(path.c_str(), &st) != 0) || !S_ISREG(st.st_mode)) {
+          continue;
+        }
+        total += st.st_size;
+        if (st.st_nlink == 1) {
+          unused.emplace_back(LastUse(path, st), st.st_size, path);
+        }
+      }
+      closedir(entries);
+      for (const auto& orphan : orphans) {
+        RemoveObject(orphan);
+      }
+    }
+    closedir(shards);
+  }
+
+  std::sort(unused.begin(), unused.end());
+  for (const auto& object : unused) {
+    if (total <= max_size_) {
+      break;
+    }
+    if (RemoveObject(std::get<2>(object))) {
+      total -= std::get<1>(object);
+    }
+  }
+  close(evict_fd);
+}
+
+int
+SharedCache::LockObject(const std::string& object, bool wait)
+{
+  const std::string lock_path = object + ".lock";
+  for (int attempt = 0; attempt < 3; ++attempt) {
+    const int fd = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return -1;
+    }
+    if (flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB)) != 0) {
+      const bool busy = (errno == EWOULDBLOCK);
+      close(fd);
+      return busy ? kLockBusy : -1;
+    }
+    struct stat fd_st, path_st;
+    if ((fstat(fd, &fd_st) == 0) && (stat(lock_path.c_str(), &path_st) == 0) &&
+        (fd_st.st_dev == path_st.st_dev) && (fd_st.st_ino == path_st.st_ino)) {
+      return fd;
+    }
+    close(fd);
+  }
+  return -1;
+}
+
+bool
+SharedCache::RemoveObject(const std::string& object)
+{
+  // Skip objects that are being published again
+  const int fd = LockObject(object, false /* wait */);
+  if (fd < 0) {
+    return false;
+  }
+  const bool removed = (remove(object.c_str()) == 0) || (errno == ENOENT);
+  if (removed) {
+    remove((object + ".lock").c_str());
+  }
+  close(fd);
+  return removed;
+}
+
+std::string
+SharedCache::ObjectPath(const std::string& key) const
+{
+  // Sharded by the first byte of the hash
+  const size_t hash = key.find('-') + 1;
+  return JoinPath({dir_, "objects", key.substr(hash, 2), key});
+}
+
+bool
+SharedCache::Link(
+    const std::string& object, uint64_t size, const std::string& path)
+{
+  struct stat st;
+  if ((stat(object.c_str(), &st) != 0) ||
+      (static_cast<uint64_t>(st.st_size) != size)) {
+    return false;
+  }
+  // Leftover of an earlier attempt
+  remove(path.c_str());
+  if (link(object.c_str(), path.c_str()) != 0) {
+    // Evicted meanwhile
+    return false;
+  }
+  // Recently used, for eviction. The object is the inode of every model
+  // file linked to it, so the time goes on its lock file instead.
+  const std::string lock_path = object + ".lock";
+  if ((utimensat(AT_FDCWD, lock_path.c_str(), nullptr, 0) != 0) &&
+      (errno == ENOENT)) {
+    const int fd =
+        open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  return true;
+}
+
+time_t
+SharedCache::LastUse(const std::string& object, const struct stat& object_st)
+{
+  // Linked last, or published if it was never linked since
+  struct stat lock_st;
+  if ((stat((object + ".lock").c_str(), &lock_st) == 0) &&
+      (lock_st.st_mtime > object_st.st_mtime)) {
+    return lock_st.st_mtime;
+  }
+  return object_st.st_mtime;
+}
+
+}  // namespace triton::repoagent::dragonfly
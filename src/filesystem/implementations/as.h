@@ -20,6 +20,10 @@
 #include "azure/storage/common/storage_credential.hpp"
 #include "common.h"
 #include "common_utils.h"
+#include "manifest.h"
+#include "memory"
+#include "re2/re2.h"
+#include "trace.h"
 #include "vector"
 
 #undef LOG_INFO
@@ -54,31 +58,21 @@ class ASFileSystem : public FileSystem {
 
   TRITONSERVER_Error* CheckClient(const std::string& path);
 
-  TRITONSERVER_Error* LocalizePath(
-      const std::string& location, const std::string& temp_dir,
-      DragonflyConfig& config_path) override;
-
-
-  TRITONSERVER_Error* FileExists(const std::string& path, bool* exists);
-  TRITONSERVER_Error* IsDirectory(const std::string& path, bool* is_dir);
+  TRITONSERVER_Error* ListFiles(
+      const std::string& location, bool* is_dir, Listing* listing) override;
+  TRITONSERVER_Error* SignUrl(
+      const RemoteFile& file, std::string* url) override;
+  TRITONSERVER_Error* ManifestFile(
+      const std::string& location, RemoteFile* manifest,
+      std::string* location_base) override;
+  TRITONSERVER_Error* Repository(
+      const std::string& location, std::string* repository,
+      std::string* model) override;
 
  private:
   TRITONSERVER_Error* ParsePath(
       const std::string& path, std::string* container, std::string* blob);
 
-  // 'callback' will be invoked when directory content is received, it may
-  // be invoked multiple times within the same ListDirectory() call if the
-  // result is paged.
-  TRITONSERVER_Error* ListDirectory(
-      const std::string& container, const std::string& dir_path,
-      const std::function<TRITONSERVER_Error*(
-          const std::vector<asb::Models::BlobItem>& blobs,
-          const std::vector<std::string>& blob_prefixes)>& callback);
-
-  TRITONSERVER_Error* DownloadFolder(
-      const std::string& container, const std::string& path,
-      const std::string& dest, DragonflyConfig& config);
-
   std::shared_ptr<asb::BlobServiceClient> client_;
   re2::RE2 as_regex_;
 };
@@ -139,64 +133,54 @@ ASFileSystem::CheckClient(const std::string& path)
 }
 
 TRITONSERVER_Error*
-ASFileSystem::IsDirectory(const std::string& path, bool* is_dir)
+ASFileSystem::ListFiles(
+    const std::string& location, bool* is_dir, Listing* listing)
 {
-  *is_dir = false;
-  std::string container, blob_path;
-  RETURN_IF_ERROR(ParsePath(path, &container, &blob_path));
+  *is_dir = true;
+  std::string container, blob;
+  RETURN_IF_ERROR(ParsePath(location, &container, &blob));
 
   auto container_client = client_->GetBlobContainerClient(container);
   auto options = asb::ListBlobsOptions();
   // Append a slash to make it easier to list contents
-  std::string full_dir = AppendSlash(blob_path);
-  options.Prefix = full_dir;
+  const std::string prefix = AppendSlash(blob);
+  options.Prefix = prefix;
+  listing->SetLocationBase(container + '/' + prefix);
   try {
-    for (auto blobPage = container_client.ListBlobsByHierarchy("/", options);
+    // A flat listing returns the whole tree with sizes
+    TraceSpan span("ListBlobs", "listing");
+    for (auto blobPage = container_client.ListBlobs(options);
          blobPage.HasPage(); blobPage.MoveToNextPage()) {
-      if ((blobPage.Blobs.size() == 1) &&
-          (blobPage.Blobs[0].Name == blob_path)) {
-        // It's a file
-        return nullptr;
+      for (const auto& blob_item : blobPage.Blobs) {
+        if (blob_item.Name.size() <= prefix.size()) {
+          continue;
+        }
+        RETURN_IF_ERROR(listing->Add(
+            std::string_view(blob_item.Name).substr(prefix.size()),
+            blob_item.BlobSize, {}, blob_item.Details.ETag.ToString()));
       }
-      *is_dir =
-          ((blobPage.Blobs.size() > 0) || (blobPage.BlobPrefixes.size() > 0));
-      break;
+      RETURN_IF_ERROR(listing->EndPage());
     }
-  }
-  catch (as::StorageException& ex) {
-    return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_INTERNAL,
-        ("Failed to check if directory at " + path + ":" + ex.what()).c_str());
-  }
-
-  return nullptr;
-};
-
-
-TRITONSERVER_Error*
-ASFileSystem::FileExists(const std::string& path, bool* exists)
-{
-  *exists = false;
-
-  std::string container, blob;
-  RETURN_IF_ERROR(ParsePath(path, &container, &blob));
-
-  auto container_client = client_->GetBlobContainerClient(container);
-  auto options = asb::ListBlobsOptions();
-  options.Prefix = blob;
-  try {
-    for (auto blobPage = container_client.ListBlobsByHierarchy("/", options);
-         blobPage.HasPage(); blobPage.MoveToNextPage()) {
-      // If any entries are returned from ListBlobs, the file / directory exists
-      *exists =
-          ((blobPage.Blobs.size() > 0) || (blobPage.BlobPrefixes.size() > 0));
-      break;
+    span.Arg("blobs", listing->FileCount());
+    span.End();
+    if (!listing->Empty() || blob.empty()) {
+      return nullptr;
     }
+
+    // Not a directory, it may still name a single blob
+    *is_dir = false;
+    auto properties = container_client.GetBlobClient(blob).GetProperties();
+    RETURN_IF_ERROR(listing->Add(
+        BaseName(blob), properties.Value.BlobSize, container + '/' + blob,
+        properties.Value.ETag.ToString()));
   }
   catch (as::StorageException& ex) {
+    if (ex.StatusCode == Azure::Core::Http::HttpStatusCode::NotFound) {
+      return nullptr;
+    }
     return TRITONSERVER_ErrorNew(
         TRITONSERVER_ERROR_INTERNAL,
-        ("Failed to check if file exists at " + path + ":" + ex.what())
+        ("Failed to get contents of directory " + location + ":" + ex.what())
             .c_str());
   }
 
@@ -204,100 +188,45 @@ ASFileSystem::FileExists(const std::string& path, bool* exists)
 }
 
 TRITONSERVER_Error*
-ASFileSystem::DownloadFolder(
-    const std::string& container, const std::string& path,
-    const std::string& dest, DragonflyConfig& config)
+ASFileSystem::ManifestFile(
+    const std::string& location, RemoteFile* manifest,
+    std::string* location_base)
 {
-  auto container_client = client_->GetBlobContainerClient(container);
-  auto func = [&](const std::vector<asb::Models::BlobItem>& blobs,
-                  const std::vector<std::string>& blob_prefixes)
-      -> TRITONSERVER_Error* {
-    for (const auto& blob_item : blobs) {
-      const auto& local_path = JoinPath({dest, BaseName(blob_item.Name)});
-      try {
-        std::string url =
-            container_client.GetBlobClient(blob_item.Name).GetUrl();
-        RETURN_IF_ERROR(DownloadFile(url, local_path, config));
-      }
-      catch (as::StorageException& ex) {
-        return TRITONSERVER_ErrorNew(
-            TRITONSERVER_ERROR_INTERNAL,
-            ("Failed to download file at " + blob_item.Name + ":" + ex.what())
-                .c_str());
-      }
-    }
-    for (const auto& directory_item : blob_prefixes) {
-      const auto& local_path = JoinPath({dest, BaseName(directory_item)});
-      int status = mkdir(
-          const_cast<char*>(local_path.c_str()), S_IRUSR | S_IWUSR | S_IXUSR);
-      if (status == -1) {
-        return TRITONSERVER_ErrorNew(
-            TRITONSERVER_ERROR_INTERNAL,
-            ("Failed to create local folder: " + local_path +
-             ", errno:" + strerror(errno))
-                .c_str());
-      }
-      RETURN_IF_ERROR(
-          DownloadFolder(container, directory_item, local_path, config));
-    }
-    return nullptr;
-  };
-  return ListDirectory(container, path, func);
+  std::string container, blob;
+  RETURN_IF_ERROR(ParsePath(location, &container, &blob));
+  *location_base = container + '/' + AppendSlash(blob);
+  manifest->path = MANIFEST_NAME;
+  manifest->location = *location_base + MANIFEST_NAME;
+  return nullptr;
 }
 
 TRITONSERVER_Error*
-ASFileSystem::LocalizePath(
-    const std::string& location, const std::string& temp_dir,
-    DragonflyConfig& config)
+ASFileSystem::Repository(
+    const std::string& location, std::string* repository, std::string* model)
 {
-  bool exists;
-  RETURN_IF_ERROR(FileExists(location, &exists));
-  if (!exists) {
-    return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_INTERNAL,
-        ("directory or file does not exist at " + location).c_str());
-  }
-
-  bool is_dir;
-  RETURN_IF_ERROR(IsDirectory(location, &is_dir));
-  if (!is_dir) {
-    return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_UNSUPPORTED,
-        ("AS file localization not yet implemented " + location).c_str());
-  }
-
   std::string container, blob;
   RETURN_IF_ERROR(ParsePath(location, &container, &blob));
-  return DownloadFolder(container, blob, temp_dir, config);
+  SplitRepository(location, blob, repository, model);
+  return nullptr;
 }
 
 TRITONSERVER_Error*
-ASFileSystem::ListDirectory(
-    const std::string& container, const std::string& dir_path,
-    const std::function<TRITONSERVER_Error*(
-        const std::vector<asb::Models::BlobItem>& blobs,
-        const std::vector<std::string>& blob_prefixes)>& callback)
+ASFileSystem::SignUrl(const RemoteFile& file, std::string* url)
 {
-  auto container_client = client_->GetBlobContainerClient(container);
-  auto options = asb::ListBlobsOptions();
-  // Append a slash to make it easier to list contents
-  std::string full_dir = AppendSlash(dir_path);
-  options.Prefix = full_dir;
-
+  // 'location' is the container and the blob name as listed by ListFiles().
+  // The blob URL carries no SAS token, the blob must be readable by the
+  // proxy.
+  const size_t slash = file.location.find('/');
   try {
-    for (auto blobPage = container_client.ListBlobsByHierarchy("/", options);
-         blobPage.HasPage(); blobPage.MoveToNextPage()) {
-      // per-page per-blob
-      RETURN_IF_ERROR(callback(blobPage.Blobs, blobPage.BlobPrefixes));
-    }
+    *url = client_->GetBlobContainerClient(file.location.substr(0, slash))
+               .GetBlobClient(file.location.substr(slash + 1))
+               .GetUrl();
   }
   catch (as::StorageException& ex) {
     return TRITONSERVER_ErrorNew(
         TRITONSERVER_ERROR_INTERNAL,
-        ("Failed to get contents of directory " + dir_path + ":" + ex.what())
-            .c_str());
+        ("Failed to get URL of " + file.location + ":" + ex.what()).c_str());
   }
-
   return nullptr;
 }
 
@@ -15,18 +15,95 @@
  */
 #pragma once
 
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
 #include "../api.h"
+#include "../listing.h"
 #include "config.h"
 
 namespace triton::repoagent::dragonfly {
 
 class FileSystem {
  public:
-  virtual TRITONSERVER_Error* LocalizePath(
-      const std::string& location, const std::string& temp_dir,
-      DragonflyConfig& config) = 0;
+  // List every object under 'location' recursively, with sizes. If
+  // 'location' names a single object, 'is_dir' is set to false and 'listing'
+  // holds only that object under its base name.
+  virtual TRITONSERVER_Error* ListFiles(
+      const std::string& location, bool* is_dir, Listing* listing) = 0;
+
+  // URL that the proxy can fetch 'file' from
+  virtual TRITONSERVER_Error* SignUrl(
+      const RemoteFile& file, std::string* url) = 0;
+
+  // The manifest object at the root of 'location', see manifest.h, and the
+  // location base of the files it names. A backend that reads manifests in
+  // ListFiles(), or has none, leaves 'manifest' empty.
+  virtual TRITONSERVER_Error* ManifestFile(
+      const std::string& location, RemoteFile* manifest,
+      std::string* location_base)
+  {
+    return nullptr;
+  }
+
+  // The repository 'location' is a model directory of, and the model's name
+  // in it, for backends whose recursive listing of the repository holds
+  // under 'model' exactly what ListFiles() of 'location' returns. Left
+  // empty otherwise. See ListingCache.
+  virtual TRITONSERVER_Error* Repository(
+      const std::string& location, std::string* repository,
+      std::string* model)
+  {
+    return nullptr;
+  }
+
+  // Headers the origin needs on every download of 'location'. Only valid
+  // after ListFiles() of the same location.
+  virtual TRITONSERVER_Error* RequestHeaders(
+      const std::string& location, std::map<std::string, std::string>* headers)
+  {
+    return nullptr;
+  }
 
   virtual ~FileSystem() = default;
 };
 
+// Split 'location', whose path in its bucket or container is 'object', into
+// the location one level up and the last path component. 'repository' is
+// left empty for locations at the top of a bucket or container and for
+// locations with a query.
+void
+SplitRepository(
+    const std::string& location, std::string_view object,
+    std::string* repository, std::string* model)
+{
+  while (!object.empty() && (object.back() == '/')) {
+    object.remove_suffix(1);
+  }
+  const size_t object_slash = object.rfind('/');
+  if ((object_slash == std::string_view::npos) ||
+      (location.find('?') != std::string::npos)) {
+    return;
+  }
+  std::string_view path(location);
+  while (!path.empty() && (path.back() == '/')) {
+    path.remove_suffix(1);
+  }
+  const std::string_view name = object.substr(object_slash + 1);
+  if ((path.size() <= name.size()) ||
+      (path.substr(path.size() - name.size()) != name) ||
+      (path[path.size() - name.size() - 1] != '/')) {
+    return;
+  }
+  path.remove_suffix(name.size());
+  while (!path.empty() && (path.back() == '/')) {
+    path.remove_suffix(1);
+  }
+  *repository = path;
+  *model = name;
+}
+
 }  // namespace triton::repoagent::dragonfly
@@ -16,13 +16,17 @@
 
 #pragma once
 
+#include "chrono"
 #include "common.h"
 #include "common_utils.h"
 #include "fstream"
 #include "google/cloud/storage/client.h"
 #include "iostream"
+#include "manifest.h"
+#include "memory"
 #include "set"
 #include "sys/stat.h"
+#include "trace.h"
 #include "triton/core/tritonserver.h"
 
 namespace triton::repoagent::dragonfly {
@@ -52,19 +56,20 @@ class GCSFileSystem : public FileSystem {
     return CheckClient();
   }
 
-  TRITONSERVER_Error* LocalizePath(
-      const std::string& location, const std::string& temp_dir,
-      DragonflyConfig& config) override;
+  TRITONSERVER_Error* ListFiles(
+      const std::string& location, bool* is_dir, Listing* listing) override;
+  TRITONSERVER_Error* SignUrl(
+      const RemoteFile& file, std::string* url) override;
+  TRITONSERVER_Error* ManifestFile(
+      const std::string& location, RemoteFile* manifest,
+      std::string* location_base) override;
+  TRITONSERVER_Error* Repository(
+      const std::string& location, std::string* repository,
+      std::string* model) override;
 
  private:
-  TRITONSERVER_Error* FileExists(const std::string& path, bool* exists);
-  TRITONSERVER_Error* IsDirectory(const std::string& path, bool* is_dir);
-  TRITONSERVER_Error* GetDirectoryContents(
-      const std::string& path, std::set<std::string>* contents);
   static TRITONSERVER_Error* ParsePath(
       const std::string& path, std::string* bucket, std::string* object);
-  std::string GenerateGetSignedUrl(
-      std::string const& bucket_name, std::string const& object_name);
 
   std::unique_ptr<gcs::Client> client_;
 };
@@ -129,195 +134,107 @@ GCSFileSystem::ParsePath(
   return nullptr;
 }
 
-std::string
-GCSFileSystem::GenerateGetSignedUrl(
-    std::string const& bucket_name, std::string const& object_name)
-{
-  using ::google::cloud::StatusOr;
-  StatusOr<std::string> signed_url = client_->CreateV4SignedUrl(
-      "GET", bucket_name, object_name,
-      gcs::SignedUrlDuration(std::chrono::minutes(150)));
-
-  if (!signed_url)
-    throw std::move(signed_url).status();
-
-  return signed_url.value();
-}
-
 TRITONSERVER_Error*
-GCSFileSystem::FileExists(const std::string& path, bool* exists)
+GCSFileSystem::ListFiles(
+    const std::string& location, bool* is_dir, Listing* listing)
 {
-  *exists = false;
-
+  *is_dir = true;
   std::string bucket, object;
-  RETURN_IF_ERROR(ParsePath(path, &bucket, &object));
-
-  // Make a request for metadata and check the response
-  google::cloud::StatusOr<gcs::ObjectMetadata> object_metadata =
-      client_->GetObjectMetadata(bucket, object);
-
-  if (object_metadata) {
-    *exists = true;
-    return nullptr;
-  }
-
-  // GCS doesn't make objects for directories, so it could still be a directory
-  bool is_dir;
-  RETURN_IF_ERROR(IsDirectory(path, &is_dir));
-  *exists = is_dir;
-
-  return nullptr;
-}
-
-TRITONSERVER_Error*
-GCSFileSystem::IsDirectory(const std::string& path, bool* is_dir)
-{
-  *is_dir = false;
-  std::string bucket, object_path;
-  RETURN_IF_ERROR(ParsePath(path, &bucket, &object_path));
-
-  google::cloud::StatusOr<gcs::BucketMetadata> bucket_metadata =
-      client_->GetBucketMetadata(bucket);
-
-  if (!bucket_metadata) {
-    return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_INTERNAL,
-        ("Could not get MetaData for bucket with name " + bucket + " : " +
-         bucket_metadata.status().message())
-            .c_str());
-  }
-
-  if (object_path.empty()) {
-    *is_dir = true;
-    return nullptr;
-  }
+  RETURN_IF_ERROR(ParsePath(location, &bucket, &object));
 
+  // Without a delimiter the listing covers the whole tree, with sizes
+  const std::string prefix = AppendSlash(object);
+  listing->SetLocationBase(bucket + '/' + prefix);
+  TraceSpan span("ListObjects", "listing");
+  size_t objects = 0;
   for (auto&& object_metadata :
-       client_->ListObjects(bucket, gcs::Prefix(AppendSlash(object_path)))) {
-    if (object_metadata) {
-      *is_dir = true;
-      break;
-    }
-  }
-  return nullptr;
-}
-
-TRITONSERVER_Error*
-GCSFileSystem::GetDirectoryContents(
-    const std::string& path, std::set<std::string>* contents)
-{
-  std::string bucket, dir_path;
-  RETURN_IF_ERROR(ParsePath(path, &bucket, &dir_path));
-  // Append a slash to make it easier to list contents
-  std::string full_dir = AppendSlash(dir_path);
-
-  // Get objects with prefix equal to full directory path
-  for (auto&& object_metadata :
-       client_->ListObjects(bucket, gcs::Prefix(full_dir))) {
+       client_->ListObjects(bucket, gcs::Prefix(prefix))) {
     if (!object_metadata) {
-      std::string msg = "Could not list contents of directory at " + path +
+      std::string msg = "Could not list contents of directory at " + location +
                         " : " + object_metadata.status().message();
       return TRITONSERVER_ErrorNew(TRITONSERVER_ERROR_INTERNAL, msg.c_str());
     }
 
     // In the case of empty directories, the directory itself will appear here
-    if (object_metadata->name() == full_dir) {
+    const std::string& name = object_metadata->name();
+    if (name.size() <= prefix.size()) {
       continue;
     }
-
-    // We have to make sure that subdirectory contents do not appear here
-    std::string name = object_metadata->name();
-    std::string::size_type item_start = name.find(full_dir) + full_dir.size();
-    // GCS response prepends parent directory name
-    std::string::size_type item_end = name.find('/', item_start);
-
-    // Let set take care of subdirectory contents
-    std::string item;
-    if (item_end !=
-        std::string::npos) {  // ensure that item_end is valid before substr
-      item = name.substr(item_start, item_end - item_start);
-    } else {
-      item = name.substr(item_start);
+    RETURN_IF_ERROR(listing->Add(
+        std::string_view(name).substr(prefix.size()), object_metadata->size(),
+        {}, object_metadata->etag()));
+    // The client pages internally, 1000 objects at a time by default
+    if (++objects % 1000 == 0) {
+      RETURN_IF_ERROR(listing->EndPage());
     }
-    contents->insert(item);
+  }
+  span.Arg("objects", listing->FileCount());
+  span.End();
+  RETURN_IF_ERROR(listing->EndPage());
+  if (!listing->Empty() || object.empty()) {
+    return nullptr;
+  }
 
-    // Fail-safe check to ensure the item name is not empty
-    if (item.empty()) {
+  // GCS doesn't make objects for directories, so check for a single object
+  *is_dir = false;
+  google::cloud::StatusOr<gcs::ObjectMetadata> object_metadata =
+      client_->GetObjectMetadata(bucket, object);
+  if (!object_metadata) {
+    if (object_metadata.status().code() !=
+        google::cloud::StatusCode::kNotFound) {
       return TRITONSERVER_ErrorNew(
           TRITONSERVER_ERROR_INTERNAL,
-          ("Cannot handle item with empty name at " + path).c_str());
+          ("Could not get MetaData for object at " + location + " : " +
+           object_metadata.status().message())
+              .c_str());
     }
+    return nullptr;
   }
+  return listing->Add(
+      BaseName(object), object_metadata->size(), bucket + '/' + object,
+      object_metadata->etag());
+}
+
+TRITONSERVER_Error*
+GCSFileSystem::ManifestFile(
+    const std::string& location, RemoteFile* manifest,
+    std::string* location_base)
+{
+  std::string bucket, object;
+  RETURN_IF_ERROR(ParsePath(location, &bucket, &object));
+  *location_base = bucket + '/' + AppendSlash(object);
+  manifest->path = MANIFEST_NAME;
+  manifest->location = *location_base + MANIFEST_NAME;
   return nullptr;
 }
 
 TRITONSERVER_Error*
-GCSFileSystem::LocalizePath(
-    const std::string& location, const std::string& temp_dir,
-    DragonflyConfig& config)
+GCSFileSystem::Repository(
+    const std::string& location, std::string* repository, std::string* model)
 {
-  bool exists;
-  //
-  RETURN_IF_ERROR(FileExists(location, &exists));
-  if (!exists) {
-    return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_INTERNAL, "File does not exist");
-  }
+  std::string bucket, object;
+  RETURN_IF_ERROR(ParsePath(location, &bucket, &object));
+  SplitRepository(location, object, repository, model);
+  return nullptr;
+}
 
-  bool is_dir;
-  RETURN_IF_ERROR(IsDirectory(temp_dir, &is_dir));
-  if (!is_dir) {
+TRITONSERVER_Error*
+GCSFileSystem::SignUrl(const RemoteFile& file, std::string* url)
+{
+  // 'location' is the bucket and the object name as listed by ListFiles()
+  const size_t slash = file.location.find('/');
+  google::cloud::StatusOr<std::string> signed_url = client_->CreateV4SignedUrl(
+      "GET", file.location.substr(0, slash), file.location.substr(slash + 1),
+      gcs::SignedUrlDuration(std::chrono::minutes(150)));
+  if (!signed_url) {
     return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_UNSUPPORTED,
-        "GCS file localization not yet implemented");
-  }
-
-  std::set<std::string> contents, filenames;
-  RETURN_IF_ERROR(GetDirectoryContents(location, &filenames));
-  for (auto itr = filenames.begin(); itr != filenames.end(); ++itr) {
-    contents.insert(JoinPath({location, *itr}));
-  }
-
-  while (!contents.empty()) {
-    std::set<std::string> tmp_contents = contents;
-    contents.clear();
-    for (const auto& gcs_fpath : tmp_contents) {
-      bool is_subdir;
-      std::string gcs_removed_path = gcs_fpath.substr(location.size());
-      std::string local_fpath = JoinPath({temp_dir, gcs_removed_path});
-      RETURN_IF_ERROR(IsDirectory(gcs_fpath, &is_subdir));
-      if (is_subdir) {
-#ifdef _WIN32
-        int status = mkdir(const_cast<char*>(local_fpath.c_str()));
-#else
-        int status = mkdir(
-            const_cast<char*>(local_fpath.c_str()),
-            S_IRUSR | S_IWUSR | S_IXUSR);
-#endif
-        if (status == -1) {
-          return TRITONSERVER_ErrorNew(
-              TRITONSERVER_ERROR_INTERNAL,
-              ("Failed to create local folder: " + local_fpath +
-               ", errno:" + strerror(errno))
-                  .c_str());
-        }
-
-        std::set<std::string> subdir_contents;
-        RETURN_IF_ERROR(GetDirectoryContents(gcs_fpath, &subdir_contents));
-        for (auto itr = subdir_contents.begin(); itr != subdir_contents.end();
-             ++itr) {
-          contents.insert(JoinPath({gcs_fpath, *itr}));
-        }
-      } else {
-        std::string file_bucket, file_object;
-        RETURN_IF_ERROR(ParsePath(gcs_fpath, &file_bucket, &file_object));
-
-        std::string signed_url = GenerateGetSignedUrl(file_bucket, file_object);
-        RETURN_IF_ERROR(DownloadFile(signed_url, local_fpath, config));
-      }
-    }
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to sign URL for " + file.location + " : " +
+         signed_url.status().message())
+            .c_str());
   }
-
+  *url = signed_url.value();
   return nullptr;
 }
+
 }  // namespace triton::repoagent::dragonfly
@@ -0,0 +1,321 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "common_utils.h"
+#include "curl/curl.h"
+#include "manifest.h"
+#include "re2/re2.h"
+#include "trace.h"
+#include "transfer.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly {
+
+// Model directories on plain HTTP(S) servers. The file set comes from the
+// manifest at the location, see manifest.h, or, without one, from the
+// server's HTML index pages. Listing requests go
+// straight to the origin; only the downloads are routed through Dragonfly.
+// File URLs are normalized so that every node asks Dragonfly for the same
+// URL, and therefore the same task, for the same file.
+class HTTPFileSystem : public FileSystem {
+ public:
+  HTTPFileSystem();
+
+  TRITONSERVER_Error* ListFiles(
+      const std::string& location, bool* is_dir, Listing* listing) override;
+  TRITONSERVER_Error* SignUrl(
+      const RemoteFile& file, std::string* url) override;
+
+ private:
+  TRITONSERVER_Error* ListIndex(
+      const std::string& dir_url, const std::string& prefix, int depth,
+      Listing* listing);
+  TRITONSERVER_Error* FillSizes(Listing* listing);
+
+  static std::string NormalizeUrl(const std::string& url);
+  static std::string PercentDecode(const std::string& str);
+  static std::string PercentEncodePath(const std::string& path);
+
+  re2::RE2 href_regex_;
+};
+
+HTTPFileSystem::HTTPFileSystem() : href_regex_("(?i)href\\s*=\\s*\"([^\"]*)\"")
+{
+}
+
+TRITONSERVER_Error*
+HTTPFileSystem::ListFiles(
+    const std::string& location, bool* is_dir, Listing* listing)
+{
+  *is_dir = true;
+  const std::string dir_url = AppendSlash(NormalizeUrl(location));
+
+  HttpResponse manifest;
+  RETURN_IF_ERROR(FetchUrl(dir_url + MANIFEST_NAME, {}, false, &manifest));
+  if (manifest.status == 200) {
+    return ParseManifest(
+        dir_url + MANIFEST_NAME, manifest.body,
+        [&dir_url](const std::string& path) {
+          return dir_url + PercentEncodePath(path);
+        },
+        listing);
+  }
+
+  // No manifest, walk the index pages of the server
+  RETURN_IF_ERROR(ListIndex(dir_url, "", 0, listing));
+  if (!listing->Empty()) {
+    return FillSizes(listing);
+  }
+
+  // Not a directory, it may still name a single file
+  *is_dir = false;
+  HttpResponse file_head;
+  const std::string file_url = NormalizeUrl(location);
+  RETURN_IF_ERROR(FetchUrl(file_url, {}, true, &file_head));
+  if ((file_head.status != 200) || (file_head.content_length < 0)) {
+    return nullptr;
+  }
+  return listing->Add(
+      PercentDecode(BaseName(file_url)), file_head.content_length, file_url);
+}
+
+TRITONSERVER_Error*
+HTTPFileSystem::ListIndex(
+    const std::string& dir_url, const std::string& prefix, int depth,
+    Listing* listing)
+{
+  // Index pages only ever link downwards here, the limit guards against
+  // servers that generate endless trees
+  if (depth > 32) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        ("Directory tree too deep at " + dir_url).c_str());
+  }
+
+  HttpResponse index;
+  RETURN_IF_ERROR(FetchUrl(dir_url, {}, false, &index));
+  if ((index.status != 200) ||
+      (index.content_type.compare(0, 9, "text/html") != 0)) {
+    return nullptr;
+  }
+
+  // Servers link entries either relative to the page or by absolute path
+  std::string dir_path;
+  const size_t authority = dir_url.find("://");
+  const size_t path_start =
+      dir_url.find('/', (authority == std::string::npos) ? 0 : authority + 3);
+  if (path_start != std::string::npos) {
+    dir_path = dir_url.substr(path_start);
+  }
+
+  re2::StringPiece input(index.body);
+  std::string href;
+  std::vector<std::string> subdirs;
+  while (RE2::FindAndConsume(&input, href_regex_, &href)) {
+    const size_t end = href.find_first_of("?#");
+    href = href.substr(0, end);
+    if (!dir_path.empty() &&
+        (href.compare(0, dir_path.size(), dir_path) == 0)) {
+      href = href.substr(dir_path.size());
+    }
+    // Only entries of this directory: no parent, sorting or external links
+    if (href.empty() || (href[0] == '/') || (href[0] == '.') ||
+        (href.find("://") != std::string::npos) ||
+        (href.find('/') < href.size() - 1)) {
+      continue;
+    }
+    if (href.back() == '/') {
+      subdirs.push_back(href);
+      continue;
+    }
+    // Sizes are filled in once the whole tree is listed
+    RETURN_IF_ERROR(
+        listing->Add(prefix + PercentDecode(href), 0, dir_url + href));
+  }
+
+  for (const auto& subdir : subdirs) {
+    // Listed as a directory of its own so that it is kept even if empty
+    const std::string subdir_prefix = prefix + PercentDecode(subdir);
+    RETURN_IF_ERROR(listing->Add(subdir_prefix, 0));
+    RETURN_IF_ERROR(
+        ListIndex(dir_url + subdir, subdir_prefix, depth + 1, listing));
+  }
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+HTTPFileSystem::FillSizes(Listing* listing)
+{
+  // Index pages do not carry exact sizes, ask the origin with HEAD requests
+  // over one multi handle
+  const size_t kMaxRunning = 16;
+  TraceSpan span("FillSizes", "listing");
+  span.Arg("files", listing->FileCount());
+  CURLM* multi = curl_multi_init();
+  std::vector<std::pair<CURL*, Listing::FileId>> requests;
+  Listing::FileId next = 0;
+  int running = 0;
+  TRITONSERVER_Error* err = nullptr;
+  do {
+    while ((next < listing->FileCount()) && (requests.size() < kMaxRunning)) {
+      const Listing::FileId file = next++;
+      CURL* curl = curl_easy_init();
+      curl_easy_setopt(curl, CURLOPT_URL, listing->Location(file).c_str());
+      curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+      curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+      curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+      curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+      curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+      curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L);
+      if (GetConnectionPool()) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, GetConnectionPool()->Share());
+      }
+      curl_multi_add_handle(multi, curl);
+      requests.emplace_back(curl, file);
+    }
+
+    if (curl_multi_perform(multi, &running) != CURLM_OK) {
+      err = TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INTERNAL, "Failed to query file sizes");
+      break;
+    }
+    int msgs_left = 0;
+    while (CURLMsg* msg = curl_multi_info_read(multi, &msgs_left)) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      auto itr = std::find_if(
+          requests.begin(), requests.end(),
+          [msg](const std::pair<CURL*, Listing::FileId>& request) {
+            return request.first == msg->easy_handle;
+          });
+      curl_off_t length = -1;
+      curl_easy_getinfo(
+          msg->easy_handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+      if ((err == nullptr) &&
+          ((msg->data.result != CURLE_OK) || (length < 0))) {
+        err = TRITONSERVER_ErrorNew(
+            TRITONSERVER_ERROR_INTERNAL,
+            ("Cannot determine size of " + listing->Location(itr->second))
+                .c_str());
+      }
+      listing->SetSize(itr->second, std::max<curl_off_t>(length, 0));
+      curl_multi_remove_handle(multi, itr->first);
+      curl_easy_cleanup(itr->first);
+      requests.erase(itr);
+    }
+    if ((err == nullptr) && (running > 0)) {
+      curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+    }
+  } while ((err == nullptr) &&
+           ((running > 0) || (next < listing->FileCount()) ||
+            !requests.empty()));
+
+  for (auto& request : requests) {
+    curl_multi_remove_handle(multi, request.first);
+    curl_easy_cleanup(request.first);
+  }
+  curl_multi_cleanup(multi);
+  return err;
+}
+
+TRITONSERVER_Error*
+HTTPFileSystem::SignUrl(const RemoteFile& file, std::string* url)
+{
+  // Plain URLs need no signing and stay the same across nodes and loads
+  *url = file.location;
+  return nullptr;
+}
+
+std::string
+HTTPFileSystem::NormalizeUrl(const std::string& url)
+{
+  // Lower-case scheme and host, and collapse repeated slashes in the path
+  const size_t scheme_end = url.find("://");
+  if (scheme_end == std::string::npos) {
+    return url;
+  }
+  size_t path_start = url.find('/', scheme_end + 3);
+  if (path_start == std::string::npos) {
+    path_start = url.size();
+  }
+  std::string normalized = url.substr(0, path_start);
+  for (auto& c : normalized) {
+    c = std::tolower(static_cast<unsigned char>(c));
+  }
+  for (size_t i = path_start; i < url.size(); ++i) {
+    if ((url[i] == '/') && (normalized.back() == '/')) {
+      continue;
+    }
+    normalized += url[i];
+  }
+  return normalized;
+}
+
+std::string
+HTTPFileSystem::PercentDecode(const std::string& str)
+{
+  auto hex_value = [](char c) {
+    return std::isdigit(static_cast<unsigned char>(c))
+               ? (c - '0')
+               : (std::tolower(static_cast<unsigned char>(c)) - 'a' + 10);
+  };
+  std::string decoded;
+  decoded.reserve(str.size());
+  for (size_t i = 0; i < str.size(); ++i) {
+    if ((str[i] == '%') && (i + 2 < str.size()) &&
+        std::isxdigit(static_cast<unsigned char>(str[i + 1])) &&
+        std::isxdigit(static_cast<unsigned char>(str[i + 2]))) {
+      decoded += static_cast<char>(
+          (hex_value(str[i + 1]) << 4) | hex_value(str[i + 2]));
+      i += 2;
+    } else {
+      decoded += str[i];
+    }
+  }
+  return decoded;
+}
+
+std::string
+HTTPFileSystem::PercentEncodePath(const std::string& path)
+{
+  static const char kHex[] = "0123456789ABCDEF";
+  std::string encoded;
+  encoded.reserve(path.size());
+  for (const char c : path) {
+    const unsigned char u = static_cast<unsigned char>(c);
+    if (std::isalnum(u) || (c == '/') || (c == '-') || (c == '.') ||
+        (c == '_') || (c == '~')) {
+      encoded += c;
+    } else {
+      encoded += '%';
+      encoded += kHex[u >> 4];
+      encoded += kHex[u & 0xf];
+    }
+  }
+  return encoded;
+}
+
+}  // namespace triton::repoagent::dragonfly
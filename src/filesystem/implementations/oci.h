@@ -0,0 +1,485 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "archive.h"
+#include "common.h"
+#include "common_utils.h"
+#include "transfer.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly {
+
+const std::string OCI_MANIFEST_ACCEPT =
+    "Accept: application/vnd.oci.image.index.v1+json, "
+    "application/vnd.oci.image.manifest.v1+json, "
+    "application/vnd.oci.artifact.manifest.v1+json, "
+    "application/vnd.docker.distribution.manifest.list.v2+json, "
+    "application/vnd.docker.distribution.manifest.v2+json";
+
+struct OCICredential {
+  std::string username_;
+  std::string password_;
+  // Talk plain HTTP to the registry, always the case for localhost
+  bool insecure_ = false;
+
+  OCICredential() = default;
+  explicit OCICredential(triton::common::TritonJson::Value& cred_json);
+};
+
+OCICredential::OCICredential(triton::common::TritonJson::Value& cred_json)
+{
+  triton::common::TritonJson::Value username_json, password_json,
+      insecure_json;
+  if (cred_json.Find("username", &username_json))
+    username_json.AsString(&username_);
+  if (cred_json.Find("password", &password_json))
+    password_json.AsString(&password_);
+  if (cred_json.Find("insecure", &insecure_json))
+    insecure_json.AsBool(&insecure_);
+}
+
+// Models stored as OCI artifacts, 'oci://registry/repository:tag' or
+// 'oci://registry/repository@digest'. Layers with an
+// 'org.opencontainers.image.title' annotation are placed at that path, tar
+// layers (image layers, or ORAS directories) are unpacked into the model
+// directory. Blobs are fetched by digest through the proxy, so every model
+// version that shares a blob shares its Dragonfly task.
+class OCIFileSystem : public FileSystem {
+ public:
+  OCIFileSystem(const std::string& path, const OCICredential& oci_cred);
+
+  TRITONSERVER_Error* CheckClient(const std::string& path) { return nullptr; }
+
+  TRITONSERVER_Error* ListFiles(
+      const std::string& location, bool* is_dir, Listing* listing) override;
+  TRITONSERVER_Error* SignUrl(
+      const RemoteFile& file, std::string* url) override;
+  TRITONSERVER_Error* RequestHeaders(
+      const std::string& location,
+      std::map<std::string, std::string>* headers) override;
+
+ private:
+  struct Reference {
+    std::string registry;
+    std::string repository;
+    // Tag or digest
+    std::string reference;
+  };
+
+  static TRITONSERVER_Error* ParsePath(
+      const std::string& path, Reference* ref);
+  std::string RepositoryUrl(const Reference& ref);
+
+  TRITONSERVER_Error* Get(
+      const Reference& ref, const std::string& url, const std::string& accept,
+      HttpResponse* response);
+  TRITONSERVER_Error* Authenticate(
+      const Reference& ref, const std::string& challenge);
+  TRITONSERVER_Error* GetManifest(
+      const Reference& ref, const std::string& reference,
+      triton::common::TritonJson::Value* manifest);
+
+  static std::string Base64Encode(const std::string& data);
+  static std::string EscapeQuery(const std::string& value);
+
+  OCICredential cred_;
+  std::mutex mu_;
+  // Authorization header value by repository
+  std::map<std::string, std::string> authorization_;
+};
+
+OCIFileSystem::OCIFileSystem(
+    const std::string& path, const OCICredential& oci_cred)
+    : cred_(oci_cred)
+{
+}
+
+TRITONSERVER_Error*
+OCIFileSystem::ParsePath(const std::string& path, Reference* ref)
+{
+  const std::string prefix = "oci://";
+  if (path.compare(0, prefix.size(), prefix) != 0) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        ("Invalid OCI location: " + path).c_str());
+  }
+  const size_t registry_end = path.find('/', prefix.size());
+  if (registry_end == std::string::npos) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        ("No repository in OCI location: " + path).c_str());
+  }
+  ref->registry = path.substr(prefix.size(), registry_end - prefix.size());
+
+  std::string name = path.substr(registry_end + 1);
+  while (!name.empty() && (name.back() == '/')) {
+    name.pop_back();
+  }
+  const size_t at = name.find('@');
+  const size_t colon = name.rfind(':');
+  if (at != std::string::npos) {
+    ref->repository = name.substr(0, at);
+    ref->reference = name.substr(at + 1);
+  } else if (
+      (colon != std::string::npos) &&
+      ((name.rfind('/') == std::string::npos) || (colon > name.rfind('/')))) {
+    ref->repository = name.substr(0, colon);
+    ref->reference = name.substr(colon + 1);
+  } else {
+    ref->repository = name;
+    ref->reference = "latest";
+  }
+
+  if (ref->registry.empty() || ref->repository.empty() ||
+      ref->reference.empty()) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        ("Invalid OCI location: " + path).c_str());
+  }
+  return nullptr;
+}
+
+std::string
+OCIFileSystem::RepositoryUrl(const Reference& ref)
+{
+  const std::string host = ref.registry.substr(0, ref.registry.rfind(':'));
+  const bool local =
+      (host == "localhost") || (host == "127.0.0.1") || (host == "[::1]");
+  return std::string((cred_.insecure_ || local) ? "http" : "https") + "://" +
+         ref.registry + "/v2/" + ref.repository;
+}
+
+TRITONSERVER_Error*
+OCIFileSystem::Get(
+    const Reference& ref, const std::string& url, const std::string& accept,
+    HttpResponse* response)
+{
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    std::vector<std::string> headers;
+    if (!accept.empty()) {
+      headers.push_back(accept);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      auto itr = authorization_.find(ref.repository);
+      if (itr != authorization_.end()) {
+        headers.push_back("Authorization: " + itr->second);
+      }
+    }
+
+    *response = HttpResponse();
+    RETURN_IF_ERROR(FetchUrl(url, headers, false, response));
+    if ((response->status != 401) || (attempt > 0)) {
+      break;
+    }
+    // Missing or expired token, answer the challenge and retry once
+    RETURN_IF_ERROR(
+        Authenticate(ref, response->headers["www-authenticate"]));
+  }
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+OCIFileSystem::Authenticate(const Reference& ref, const std::string& challenge)
+{
+  const std::string basic =
+      cred_.username_.empty()
+          ? ""
+          : "Basic " + Base64Encode(cred_.username_ + ":" + cred_.password_);
+
+  std::string scheme = challenge.substr(0, challenge.find(' '));
+  std::transform(scheme.begin(), scheme.end(), scheme.begin(), ::tolower);
+  std::string authorization;
+  if (scheme == "basic") {
+    if (basic.empty()) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_UNAVAILABLE,
+          ("Registry " + ref.registry + " requires credentials").c_str());
+    }
+    authorization = basic;
+  } else if (scheme == "bearer") {
+    // Bearer realm="https://auth/token",service="registry",scope="..."
+    std::map<std::string, std::string> params;
+    size_t pos = challenge.find(' ');
+    while (pos != std::string::npos) {
+      const size_t key_start = challenge.find_first_not_of(" ,", pos);
+      const size_t eq = challenge.find('=', key_start);
+      if ((key_start == std::string::npos) || (eq == std::string::npos)) {
+        break;
+      }
+      const std::string key = challenge.substr(key_start, eq - key_start);
+      size_t value_end;
+      std::string value;
+      if (challenge[eq + 1] == '"') {
+        value_end = challenge.find('"', eq + 2);
+        value = challenge.substr(eq + 2, value_end - (eq + 2));
+        pos = (value_end == std::string::npos) ? value_end : value_end + 1;
+      } else {
+        value_end = challenge.find(',', eq + 1);
+        value = challenge.substr(eq + 1, value_end - (eq + 1));
+        pos = value_end;
+      }
+      params[key] = value;
+    }
+    if (params["realm"].empty()) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INTERNAL,
+          ("Invalid challenge from registry " + ref.registry + ": " +
+           challenge)
+              .c_str());
+    }
+    if (params["scope"].empty()) {
+      params["scope"] = "repository:" + ref.repository + ":pull";
+    }
+
+    std::string token_url = params["realm"] + "?scope=" +
+                            EscapeQuery(params["scope"]);
+    if (!params["service"].empty()) {
+      token_url += "&service=" + EscapeQuery(params["service"]);
+    }
+    std::vector<std::string> headers;
+    if (!basic.empty()) {
+      headers.push_back("Authorization: " + basic);
+    }
+    HttpResponse token_response;
+    RETURN_IF_ERROR(FetchUrl(token_url, headers, false, &token_response));
+    if (token_response.status != 200) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_UNAVAILABLE,
+          ("Failed to get a token for " + ref.repository + " from " +
+           params["realm"] + ", status " +
+           std::to_string(token_response.status))
+              .c_str());
+    }
+    triton::common::TritonJson::Value token_json;
+    std::string token;
+    RETURN_IF_ERROR(token_json.Parse(token_response.body));
+    TRITONSERVER_Error* err = token_json.MemberAsString("token", &token);
+    if (err != nullptr) {
+      TRITONSERVER_ErrorDelete(err);
+      RETURN_IF_ERROR(token_json.MemberAsString("access_token", &token));
+    }
+    authorization = "Bearer " + token;
+  } else {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_UNAVAILABLE,
+        ("Unsupported authentication from registry " + ref.registry + ": " +
+         challenge)
+            .c_str());
+  }
+
+  std::lock_guard<std::mutex> lock(mu_);
+  authorization_[ref.repository] = authorization;
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+OCIFileSystem::GetManifest(
+    const Reference& ref, const std::string& reference,
+    triton::common::TritonJson::Value* manifest)
+{
+  HttpResponse response;
+  RETURN_IF_ERROR(Get(
+      ref, RepositoryUrl(ref) + "/manifests/" + reference, OCI_MANIFEST_ACCEPT,
+      &response));
+  if (response.status != 200) {
+    return TRITONSERVER_ErrorNew(
+        (response.status == 404) ? TRITONSERVER_ERROR_NOT_FOUND
+                                 : TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to get manifest " + ref.repository + ":" + reference +
+         " from " + ref.registry + ", status " +
+         std::to_string(response.status))
+            .c_str());
+  }
+  return manifest->Parse(response.body);
+}
+
+TRITONSERVER_Error*
+OCIFileSystem::ListFiles(
+    const std::string& location, bool* is_dir, Listing* listing)
+{
+  *is_dir = true;
+  Reference ref;
+  RETURN_IF_ERROR(ParsePath(location, &ref));
+
+  triton::common::TritonJson::Value index, platform_manifest;
+  RETURN_IF_ERROR(GetManifest(ref, ref.reference, &index));
+  triton::common::TritonJson::Value* manifest = &index;
+
+  // An index lists one manifest per platform. Models are platform neutral,
+  // take the first one.
+  triton::common::TritonJson::Value manifests_json;
+  if (index.Find("manifests", &manifests_json)) {
+    triton::common::TritonJson::Value first_json;
+    std::string digest;
+    if (manifests_json.ArraySize() == 0) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_NOT_FOUND,
+          ("Empty image index at " + location).c_str());
+    }
+    RETURN_IF_ERROR(manifests_json.IndexAsObject(0, &first_json));
+    RETURN_IF_ERROR(first_json.MemberAsString("digest", &digest));
+    RETURN_IF_ERROR(GetManifest(ref, digest, &platform_manifest));
+    manifest = &platform_manifest;
+  }
+
+  // Image and artifact manifests list their content as 'layers', the OCI 1.1
+  // artifact manifest as 'blobs'
+  triton::common::TritonJson::Value layers_json;
+  if (!manifest->Find("layers", &layers_json) &&
+      !manifest->Find("blobs", &layers_json)) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        ("No layers in manifest at " + location).c_str());
+  }
+
+  for (size_t i = 0; i < layers_json.ArraySize(); i++) {
+    triton::common::TritonJson::Value layer_json, annotations_json;
+    std::string media_type, digest, title, unpack;
+    uint64_t size = 0;
+    RETURN_IF_ERROR(layers_json.IndexAsObject(i, &layer_json));
+    RETURN_IF_ERROR(layer_json.MemberAsString("digest", &digest));
+    RETURN_IF_ERROR(layer_json.MemberAsUInt("size", &size));
+    triton::common::TritonJson::Value media_type_json;
+    if (layer_json.Find("mediaType", &media_type_json)) {
+      media_type_json.AsString(&media_type);
+    }
+    if (layer_json.Find("annotations", &annotations_json)) {
+      triton::common::TritonJson::Value value_json;
+      if (annotations_json.Find(
+              "org.opencontainers.image.title", &value_json)) {
+        value_json.AsString(&title);
+      }
+      if (annotations_json.Find("io.deis.oras.content.unpack", &value_json)) {
+        value_json.AsString(&unpack);
+      }
+    }
+
+    const std::string blob_url = RepositoryUrl(ref) + "/blobs/" + digest;
+    auto ends_with = [&media_type](const std::string& suffix) {
+      return (media_type.size() >= suffix.size()) &&
+             (media_type.compare(
+                  media_type.size() - suffix.size(), suffix.size(), suffix) ==
+              0);
+    };
+    const bool is_tar = (media_type.find(".tar") != std::string::npos);
+    // The digest identifies the content, it serves as the ETag
+    if (!title.empty() && (unpack != "true")) {
+      RETURN_IF_ERROR(listing->Add(title, size, blob_url, digest));
+    } else if ((unpack == "true") || is_tar) {
+      // ORAS packs directories as gzip'ed tars named after the directory
+      std::string blob_name = digest;
+      std::replace(blob_name.begin(), blob_name.end(), ':', '-');
+      Listing::FileId file;
+      RETURN_IF_ERROR(listing->Add(blob_name, size, blob_url, digest, &file));
+      if (ends_with("zstd")) {
+        listing->SetUnpack(file, ArchiveCompression::ZSTD);
+      } else if (ends_with("gzip") || (unpack == "true")) {
+        listing->SetUnpack(file, ArchiveCompression::GZIP);
+      } else {
+        listing->SetUnpack(file, ArchiveCompression::NONE);
+      }
+    } else {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INVALID_ARG,
+          ("Layer " + digest + " of type '" + media_type + "' at " + location +
+           " has no 'org.opencontainers.image.title' annotation")
+              .c_str());
+    }
+  }
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+OCIFileSystem::SignUrl(const RemoteFile& file, std::string* url)
+{
+  // Blob URLs are addressed by digest and need no signing, the registry
+  // token goes with RequestHeaders()
+  *url = file.location;
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+OCIFileSystem::RequestHeaders(
+    const std::string& location, std::map<std::string, std::string>* headers)
+{
+  Reference ref;
+  RETURN_IF_ERROR(ParsePath(location, &ref));
+  std::lock_guard<std::mutex> lock(mu_);
+  auto itr = authorization_.find(ref.repository);
+  if (itr != authorization_.end()) {
+    (*headers)["Authorization"] = itr->second;
+  }
+  return nullptr;
+}
+
+std::string
+OCIFileSystem::Base64Encode(const std::string& data)
+{
+  static const char kAlphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string encoded;
+  size_t i = 0;
+  for (; i + 2 < data.size(); i += 3) {
+    const uint32_t n = (static_cast<uint8_t>(data[i]) << 16) |
+                       (static_cast<uint8_t>(data[i + 1]) << 8) |
+                       static_cast<uint8_t>(data[i + 2]);
+    encoded += kAlphabet[(n >> 18) & 0x3f];
+    encoded += kAlphabet[(n >> 12) & 0x3f];
+    encoded += kAlphabet[(n >> 6) & 0x3f];
+    encoded += kAlphabet[n & 0x3f];
+  }
+  if (i < data.size()) {
+    uint32_t n = static_cast<uint8_t>(data[i]) << 16;
+    if (i + 1 < data.size()) {
+      n |= static_cast<uint8_t>(data[i + 1]) << 8;
+    }
+    encoded += kAlphabet[(n >> 18) & 0x3f];
+    encoded += kAlphabet[(n >> 12) & 0x3f];
+    encoded += (i + 1 < data.size()) ? kAlphabet[(n >> 6) & 0x3f] : '=';
+    encoded += '=';
+  }
+  return encoded;
+}
+
+std::string
+OCIFileSystem::EscapeQuery(const std::string& value)
+{
+  static const char kHex[] = "0123456789ABCDEF";
+  std::string escaped;
+  for (const char c : value) {
+    const unsigned char u = static_cast<unsigned char>(c);
+    if (std::isalnum(u) || (c == '-') || (c == '.') || (c == '_') ||
+        (c == '~')) {
+      escaped += c;
+    } else {
+      escaped += '%';
+      escaped += kHex[u >> 4];
+      escaped += kHex[u & 0xf];
+    }
+  }
+  return escaped;
+}
+
+}  // namespace triton::repoagent::dragonfly
@@ -28,8 +28,13 @@
 #include "common_utils.h"
 #include "fstream"
 #include "iostream"
-#include "re2/re2.h"
+#include "manifest.h"
+#include "memory"
+#include "mutex"
+#include "stdexcept"
+#include "string_view"
 #include "sys/stat.h"
+#include "trace.h"
 #include "triton/core/tritonserver.h"
 
 namespace triton::repoagent::dragonfly {
@@ -111,143 +116,140 @@ class S3FileSystem : public FileSystem {
  public:
   S3FileSystem(const std::string& s3_path, const S3Credential& s3_cred);
 
-  TRITONSERVER_Error* LocalizePath(
-      const std::string& location, const std::string& temp_dir,
-      DragonflyConfig& config) override;
+  // Bring the AWS SDK up and down once per process. Clients must not outlive
+  // ShutdownSDK().
+  static void InitializeSDK();
+  static void ShutdownSDK();
+
+  TRITONSERVER_Error* ListFiles(
+      const std::string& location, bool* is_dir, Listing* listing) override;
+  TRITONSERVER_Error* SignUrl(
+      const RemoteFile& file, std::string* url) override;
+  TRITONSERVER_Error* ManifestFile(
+      const std::string& location, RemoteFile* manifest,
+      std::string* location_base) override;
+  TRITONSERVER_Error* Repository(
+      const std::string& location, std::string* repository,
+      std::string* model) override;
 
   TRITONSERVER_Error* CheckClient(const std::string& s3_path);
 
  private:
-  TRITONSERVER_Error* FileExists(const std::string& path, bool* exists);
-  TRITONSERVER_Error* IsDirectory(const std::string& path, bool* is_dir);
-  TRITONSERVER_Error* GetDirectoryContents(
-      const std::string& path, std::set<std::string>* contents);
-  TRITONSERVER_Error* ParsePath(
-      const std::string& path, std::string* bucket, std::string* object);
-  static TRITONSERVER_Error* CleanPath(
-      const std::string& s3_path, std::string* clean_path);
+  // Parts of 's3://[http://|https://][host:port/]bucket[/object]'
+  struct S3Path {
+    std::string protocol;
+    std::string endpoint;
+    std::string bucket;
+    std::string object;
+  };
+
+  static TRITONSERVER_Error* ParsePath(std::string_view path, S3Path* parsed);
   std::unique_ptr<s3::S3Client> client_;  // init after Aws::InitAPI is called
-  re2::RE2 s3_regex_;
+
+  static std::mutex sdk_mu_;
+  static bool sdk_initialized_;
+  static Aws::SDKOptions sdk_options_;
 };
 
-TRITONSERVER_Error*
-S3FileSystem::ParsePath(
-    const std::string& path, std::string* bucket, std::string* object)
+std::mutex S3FileSystem::sdk_mu_;
+bool S3FileSystem::sdk_initialized_ = false;
+Aws::SDKOptions S3FileSystem::sdk_options_;
+
+void
+S3FileSystem::InitializeSDK()
 {
-  // Cleanup extra slashes
-  std::string clean_path;
-  RETURN_IF_ERROR(CleanPath(path, &clean_path));
-
-  // Get the bucket name and the object path. Return error if path is malformed
-  std::string protocol, host_name, host_port;
-  if (!RE2::FullMatch(
-          clean_path, s3_regex_, &protocol, &host_name, &host_port, bucket,
-          object)) {
-    int bucket_start = clean_path.find("s3://") + strlen("s3://");
-    int bucket_end = clean_path.find("/", bucket_start);
-
-    // If there isn't a slash, the address has only the bucket
-    if (bucket_end > bucket_start) {
-      *bucket = clean_path.substr(bucket_start, bucket_end - bucket_start);
-      *object = clean_path.substr(bucket_end + 1);
-    } else {
-      *bucket = clean_path.substr(bucket_start);
-      *object = "";
-    }
-  } else {
-    // Erase leading '/' that is left behind in object name
-    if ((*object)[0] == '/') {
-      object->erase(0, 1);
-    }
+  std::lock_guard<std::mutex> lock(sdk_mu_);
+  if (sdk_initialized_) {
+    return;
   }
+  // Install the client factory as part of InitAPI rather than replacing the
+  // default one afterwards
+  sdk_options_.httpOptions.httpClientFactory_create_fn = [] {
+    return Aws::MakeShared<S3HttpClientFactory>(S3_ALLOCATION_TAG);
+  };
+  Aws::InitAPI(sdk_options_);
+  sdk_initialized_ = true;
+}
 
-
-  if (bucket->empty()) {
-    return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_INTERNAL,
-        ("No bucket name found in path: " + path).c_str());
+void
+S3FileSystem::ShutdownSDK()
+{
+  std::lock_guard<std::mutex> lock(sdk_mu_);
+  if (!sdk_initialized_) {
+    return;
   }
-
-  return nullptr;
+  Aws::ShutdownAPI(sdk_options_);
+  sdk_initialized_ = false;
 }
 
-// Clean and normalize the S3 path
+// Parse the location once per listing rather than per object. Extra slashes
+// are dropped.
 TRITONSERVER_Error*
-S3FileSystem::CleanPath(const std::string& s3_path, std::string* clean_path)
+S3FileSystem::ParsePath(std::string_view path, S3Path* parsed)
 {
-  // Must handle paths with s3 prefix
-  size_t start = s3_path.find("s3://");
-  std::string path;
-  if (start != std::string::npos) {
-    path = s3_path.substr(start + strlen("s3://"));
-    *clean_path = "s3://";
-  } else {
-    path = s3_path;
-    *clean_path = "";
-  }
-
-  // Must handle paths with https:// or http:// prefix
-  size_t https_start = path.find("https://");
-  if (https_start != std::string::npos) {
-    path = path.substr(https_start + strlen("https://"));
-    *clean_path += "https://";
-  } else {
-    size_t http_start = path.find("http://");
-    if (http_start != std::string::npos) {
-      path = path.substr(http_start + strlen("http://"));
-      *clean_path += "http://";
+  const std::string_view original = path;
+  auto consume_prefix = [&path](std::string_view prefix) {
+    if (path.substr(0, prefix.size()) != prefix) {
+      return false;
+    }
+    path.remove_prefix(prefix.size());
+    return true;
+  };
+  auto next_segment = [&path]() {
+    const size_t start = path.find_first_not_of('/');
+    if (start == std::string_view::npos) {
+      path = std::string_view();
+      return std::string_view();
+    }
+    path.remove_prefix(start);
+    const std::string_view segment = path.substr(0, path.find('/'));
+    path.remove_prefix(segment.size());
+    return segment;
+  };
+
+  consume_prefix("s3://");
+  parsed->protocol.clear();
+  for (std::string_view protocol : {"https://", "http://"}) {
+    if (consume_prefix(protocol)) {
+      parsed->protocol = protocol;
+      break;
     }
   }
 
-  // Remove trailing slashes
-  size_t rtrim_length = path.find_last_not_of('/');
-  if (rtrim_length == std::string::npos) {
-    return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_INVALID_ARG,
-        ("Invalid bucket name: '" + path + "'").c_str());
+  // A 'host:port' segment names an S3 compatible endpoint, the bucket
+  // follows it
+  std::string_view segment = next_segment();
+  const size_t colon = segment.find(':');
+  parsed->endpoint.clear();
+  if ((colon != std::string_view::npos) && (colon + 1 < segment.size()) &&
+      (segment.find_first_not_of("0123456789", colon + 1) ==
+       std::string_view::npos)) {
+    parsed->endpoint = segment;
+    segment = next_segment();
   }
-
-  // Remove leading slashes
-  size_t ltrim_length = path.find_first_not_of('/');
-  if (ltrim_length == std::string::npos) {
+  if (segment.empty()) {
     return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_INVALID_ARG,
-        ("Invalid bucket name: '" + path + "'").c_str());
+        TRITONSERVER_ERROR_INTERNAL,
+        ("No bucket name found in path: " + std::string(original)).c_str());
   }
+  parsed->bucket = segment;
 
-  // Remove extra internal slashes
-  std::string true_path = path.substr(ltrim_length, rtrim_length + 1);
-  std::vector<int> slash_locations;
-  bool previous_slash = false;
-  for (size_t i = 0; i < true_path.size(); i++) {
-    if (true_path[i] == '/') {
-      if (!previous_slash) {
-        *clean_path += true_path[i];
-      }
-      previous_slash = true;
-    } else {
-      *clean_path += true_path[i];
-      previous_slash = false;
+  parsed->object.clear();
+  parsed->object.reserve(path.size());
+  for (segment = next_segment(); !segment.empty(); segment = next_segment()) {
+    if (!parsed->object.empty()) {
+      parsed->object.push_back('/');
     }
+    parsed->object.append(segment);
   }
-
   return nullptr;
 }
 
 S3FileSystem::S3FileSystem(
     const std::string& s3_path, const S3Credential& s3_cred)
-    : s3_regex_(
-          "s3://(http://|https://|)([0-9a-zA-Z\\-.]+):([0-9]+)/"
-          "([0-9a-z.\\-]+)(((/[0-9a-zA-Z.\\-_]+)*)?)")
 {
-  // init aws api if not already
-  Aws::SDKOptions options;
-  static std::once_flag onceFlag;
-  std::call_once(onceFlag, [&options] { Aws::InitAPI(options); });
-
-  // [FIXME: DLIS-4973]
-  Aws::Http::SetHttpClientFactory(
-      Aws::MakeShared<S3HttpClientFactory>(S3_ALLOCATION_TAG));
+  // No-op once the module is initialized
+  InitializeSDK();
 
   Aws::Client::ClientConfiguration config;
   Aws::Auth::AWSCredentials credentials;
@@ -269,20 +271,16 @@ S3FileSystem::S3FileSystem(
     config = Aws::Client::ClientConfiguration("default");
   }
 
-  // Cleanup extra slashes
-  std::string clean_path;
-  TRITONSERVER_Error* err = CleanPath(s3_path, &clean_path);
+  S3Path parsed;
+  TRITONSERVER_Error* err = ParsePath(s3_path, &parsed);
   if (err != nullptr) {
     TRITONSERVER_ErrorDelete(err);
     throw std::runtime_error("failed to parse S3 path");
   }
 
-  std::string protocol, host_name, host_port, bucket, object;
-  if (RE2::FullMatch(
-          clean_path, s3_regex_, &protocol, &host_name, &host_port, &bucket,
-          &object)) {
-    config.endpointOverride = Aws::String(host_name + ":" + host_port);
-    if (protocol == "https://") {
+  if (!parsed.endpoint.empty()) {
+    config.endpointOverride = Aws::String(parsed.endpoint);
+    if (parsed.protocol == "https://") {
       config.scheme = Aws::Http::Scheme::HTTPS;
     } else {
       config.scheme = Aws::Http::Scheme::HTTP;
@@ -304,11 +302,11 @@ S3FileSystem::S3FileSystem(
 TRITONSERVER_Error*
 S3FileSystem::CheckClient(const std::string& s3_path)
 {
-  std::string bucket, object_path;
-  RETURN_IF_ERROR(ParsePath(s3_path, &bucket, &object_path));
+  S3Path parsed;
+  RETURN_IF_ERROR(ParsePath(s3_path, &parsed));
   // check if can connect to the bucket
   s3::Model::HeadBucketRequest head_request;
-  head_request.WithBucket(bucket.c_str());
+  head_request.WithBucket(parsed.bucket.c_str());
   auto head_object_outcome = client_->HeadBucket(head_request);
   if (!head_object_outcome.IsSuccess()) {
     auto err = head_object_outcome.GetError();
@@ -323,119 +321,30 @@ S3FileSystem::CheckClient(const std::string& s3_path)
 }
 
 TRITONSERVER_Error*
-S3FileSystem::FileExists(const std::string& path, bool* exists)
-{
-  *exists = false;
-
-  // S3 doesn't make objects for directories, so it could still be a directory
-  bool is_dir;
-  RETURN_IF_ERROR(IsDirectory(path, &is_dir));
-  if (is_dir) {
-    *exists = is_dir;
-    return nullptr;
-  }
-
-  std::string bucket, object;
-  RETURN_IF_ERROR(ParsePath(path, &bucket, &object));
-
-  // Construct request for object metadata
-  s3::Model::HeadObjectRequest head_request;
-  head_request.SetBucket(bucket.c_str());
-  head_request.SetKey(object.c_str());
-
-  auto head_object_outcome = client_->HeadObject(head_request);
-  if (!head_object_outcome.IsSuccess()) {
-    if (head_object_outcome.GetError().GetErrorType() !=
-        s3::S3Errors::RESOURCE_NOT_FOUND) {
-      return TRITONSERVER_ErrorNew(
-
-          TRITONSERVER_ERROR_INTERNAL,
-          ("Could not get MetaData for object at " + path +
-           " due to exception: " +
-           head_object_outcome.GetError().GetExceptionName() +
-           ", error message: " + head_object_outcome.GetError().GetMessage())
-              .c_str());
-    }
-  } else {
-    *exists = true;
-  }
-
-  return nullptr;
-}
-
-TRITONSERVER_Error*
-S3FileSystem::IsDirectory(const std::string& path, bool* is_dir)
-{
-  *is_dir = false;
-  std::string bucket, object_path;
-  RETURN_IF_ERROR(ParsePath(path, &bucket, &object_path));
-
-  // Check if the bucket exists
-  s3::Model::HeadBucketRequest head_request;
-  head_request.WithBucket(bucket.c_str());
-
-  auto head_bucket_outcome = client_->HeadBucket(head_request);
-  if (!head_bucket_outcome.IsSuccess()) {
-    return TRITONSERVER_ErrorNew(
-
-        TRITONSERVER_ERROR_INTERNAL,
-        ("Could not get MetaData for bucket with name " + bucket +
-         " due to exception: " +
-         head_bucket_outcome.GetError().GetExceptionName() +
-         ", error message: " + head_bucket_outcome.GetError().GetMessage())
-            .c_str());
-  }
-
-  // Root case - bucket exists and object path is empty
-  if (object_path.empty()) {
-    *is_dir = true;
-    return nullptr;
-  }
-
-  // List the objects in the bucket
-  s3::Model::ListObjectsV2Request list_objects_request;
-  list_objects_request.SetBucket(bucket.c_str());
-  list_objects_request.SetPrefix(AppendSlash(object_path).c_str());
-  auto list_objects_outcome = client_->ListObjectsV2(list_objects_request);
-
-  if (list_objects_outcome.IsSuccess()) {
-    *is_dir = !list_objects_outcome.GetResult().GetContents().empty();
-  } else {
-    return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_INTERNAL,
-        ("Failed to list objects with prefix " + path + " due to exception: " +
-         list_objects_outcome.GetError().GetExceptionName() +
-         ", error message: " + list_objects_outcome.GetError().GetMessage())
-            .c_str());
-  }
-  return nullptr;
-}
-
-TRITONSERVER_Error*
-S3FileSystem::GetDirectoryContents(
-    const std::string& path, std::set<std::string>* contents)
+S3FileSystem::ListFiles(
+    const std::string& location, bool* is_dir, Listing* listing)
 {
-  // Parse bucket and dir_path
-  std::string bucket, dir_path, full_dir;
-  RETURN_IF_ERROR(ParsePath(path, &bucket, &dir_path));
-  std::string true_path = "s3://" + bucket + '/' + dir_path;
-
-  // Capture the full path to facilitate content listing
-  full_dir = AppendSlash(dir_path);
-
-  // Issue request for objects with prefix
+  *is_dir = true;
+  S3Path parsed;
+  RETURN_IF_ERROR(ParsePath(location, &parsed));
+  const std::string& bucket = parsed.bucket;
+  const std::string& object = parsed.object;
+
+  // A flat listing of the prefix returns the whole tree with sizes
+  const std::string prefix = AppendSlash(object);
   s3::Model::ListObjectsV2Request objects_request;
   objects_request.SetBucket(bucket.c_str());
-  objects_request.SetPrefix(full_dir.c_str());
+  objects_request.SetPrefix(prefix.c_str());
+  listing->SetLocationBase(bucket + '/' + prefix);
 
   bool done_listing = false;
   while (!done_listing) {
+    TraceSpan span("ListObjectsV2", "listing");
     auto list_objects_outcome = client_->ListObjectsV2(objects_request);
-
     if (!list_objects_outcome.IsSuccess()) {
       return TRITONSERVER_ErrorNew(
           TRITONSERVER_ERROR_INTERNAL,
-          ("Could not list contents of directory at " + true_path +
+          ("Could not list contents of directory at " + location +
            " due to exception: " +
            list_objects_outcome.GetError().GetExceptionName() +
            ", error message: " + list_objects_outcome.GetError().GetMessage())
@@ -443,29 +352,22 @@ S3FileSystem::GetDirectoryContents(
     }
     const auto& list_objects_result = list_objects_outcome.GetResult();
     for (const auto& s3_object : list_objects_result.GetContents()) {
+      const std::string_view key(
+          s3_object.GetKey().data(), s3_object.GetKey().size());
       // In the case of empty directories, the directory itself will appear
       // here
-      if (s3_object.GetKey().c_str() == full_dir) {
+      if (key.size() <= prefix.size()) {
         continue;
       }
-
-      // We have to make sure that subdirectory contents do not appear here
-      std::string name(s3_object.GetKey().c_str());
-      int item_start = name.find(full_dir) + full_dir.size();
-      // S3 response prepends parent directory name
-      int item_end = name.find("/", item_start);
-
-      // Let set take care of subdirectory contents
-      std::string item = name.substr(item_start, item_end - item_start);
-      contents->insert(item);
-
-      // Fail-safe check to ensure the item name is not empty
-      if (item.empty()) {
-        return TRITONSERVER_ErrorNew(
-            TRITONSERVER_ERROR_INTERNAL,
-            ("Cannot handle item with empty name at " + true_path).c_str());
-      }
+      // The location is the base and the path, so only the path is stored
+      RETURN_IF_ERROR(listing->Add(
+          key.substr(prefix.size()), s3_object.GetSize(), {},
+          std::string_view(
+              s3_object.GetETag().data(), s3_object.GetETag().size())));
     }
+    span.Arg("objects", list_objects_result.GetContents().size());
+    span.End();
+    RETURN_IF_ERROR(listing->EndPage());
     // If there are more pages to retrieve, set the marker to the next page.
     if (list_objects_result.GetIsTruncated()) {
       objects_request.SetContinuationToken(
@@ -474,92 +376,68 @@ S3FileSystem::GetDirectoryContents(
       done_listing = true;
     }
   }
-  return nullptr;
-}
-
-TRITONSERVER_Error*
-S3FileSystem::LocalizePath(
-    const std::string& location, const std::string& temp_dir,
-    DragonflyConfig& config)
-{
-  bool exists;
-  RETURN_IF_ERROR(FileExists(location, &exists));
-  if (!exists) {
-    return TRITONSERVER_ErrorNew(
-        TRITONSERVER_ERROR_INTERNAL,
-        ("directory or file does not exist at " + location).c_str());
-  }
-
-  std::string clean_path;
-  RETURN_IF_ERROR(CleanPath(location, &clean_path));
-
-  std::string effective_path, protocol, host_name, host_port, bucket, object;
-  if (RE2::FullMatch(
-          clean_path, s3_regex_, &protocol, &host_name, &host_port, &bucket,
-          &object)) {
-    effective_path = "s3://" + bucket + object;
-  } else {
-    effective_path = location;
+  if (!listing->Empty() || object.empty()) {
+    return nullptr;
   }
 
-  std::set<std::string> contents;
-  bool is_dir;
-  RETURN_IF_ERROR(IsDirectory(location, &is_dir));
-  if (is_dir) {
-    std::set<std::string> filenames;
-    RETURN_IF_ERROR(GetDirectoryContents(effective_path, &filenames));
-    for (auto itr = filenames.begin(); itr != filenames.end(); ++itr) {
-      contents.insert(JoinPath({effective_path, *itr}));
+  // Not a directory, it may still name a single object
+  *is_dir = false;
+  s3::Model::HeadObjectRequest head_request;
+  head_request.SetBucket(bucket.c_str());
+  head_request.SetKey(object.c_str());
+  TraceSpan span("HeadObject", "listing");
+  auto head_object_outcome = client_->HeadObject(head_request);
+  if (!head_object_outcome.IsSuccess()) {
+    if (head_object_outcome.GetError().GetErrorType() !=
+        s3::S3Errors::RESOURCE_NOT_FOUND) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INTERNAL,
+          ("Could not get MetaData for object at " + location +
+           " due to exception: " +
+           head_object_outcome.GetError().GetExceptionName() +
+           ", error message: " + head_object_outcome.GetError().GetMessage())
+              .c_str());
     }
-  } else {
-    std::string filename =
-        effective_path.substr(effective_path.find_last_of('/') + 1);
-    std::string local_file_path = JoinPath({temp_dir, filename});
-    contents.insert(local_file_path);
+    return nullptr;
   }
+  const auto& head_result = head_object_outcome.GetResult();
+  return listing->Add(
+      BaseName(object), head_result.GetContentLength(), bucket + '/' + object,
+      std::string_view(
+          head_result.GetETag().data(), head_result.GetETag().size()));
+}
 
-  while (!contents.empty()) {
-    std::set<std::string> tmp_contents = contents;
-    contents.clear();
-    for (const auto& s3_fpath : tmp_contents) {
-      std::string s3_removed_path = s3_fpath.substr(effective_path.size());
-      std::string local_fpath = s3_removed_path.empty()
-                                    ? temp_dir
-                                    : JoinPath({temp_dir, s3_removed_path});
-      bool is_subdir;
-      RETURN_IF_ERROR(IsDirectory(s3_fpath, &is_subdir));
-      if (is_subdir) {
-#ifdef _WIN32
-        int status = mkdir(const_cast<char*>(local_fpath.c_str()));
-#else
-        int status = mkdir(
-            const_cast<char*>(local_fpath.c_str()),
-            S_IRUSR | S_IWUSR | S_IXUSR);
-#endif
-        if (status == -1) {
-          return TRITONSERVER_ErrorNew(
-              TRITONSERVER_ERROR_INTERNAL,
-              ("Failed to create local folder: " + local_fpath +
-               ", errno:" + strerror(errno))
-                  .c_str());
-        }
-
-        std::set<std::string> subdir_contents;
-        RETURN_IF_ERROR(GetDirectoryContents(s3_fpath, &subdir_contents));
-        for (const auto& subdir_content : subdir_contents) {
-          contents.insert(JoinPath({s3_fpath, subdir_content}));
-        }
-      } else {
-        std::string file_bucket, file_object;
-        RETURN_IF_ERROR(ParsePath(s3_fpath, &file_bucket, &file_object));
-
-        std::string url = client_->GeneratePresignedUrl(
-            file_bucket, file_object, Aws::Http::HttpMethod::HTTP_GET);
-        RETURN_IF_ERROR(DownloadFile(url, local_fpath, config));
-      }
-    }
-  }
+TRITONSERVER_Error*
+S3FileSystem::ManifestFile(
+    const std::string& location, RemoteFile* manifest,
+    std::string* location_base)
+{
+  S3Path parsed;
+  RETURN_IF_ERROR(ParsePath(location, &parsed));
+  *location_base = parsed.bucket + '/' + AppendSlash(parsed.object);
+  manifest->path = MANIFEST_NAME;
+  manifest->location = *location_base + MANIFEST_NAME;
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+S3FileSystem::Repository(
+    const std::string& location, std::string* repository, std::string* model)
+{
+  S3Path parsed;
+  RETURN_IF_ERROR(ParsePath(location, &parsed));
+  SplitRepository(location, parsed.object, repository, model);
+  return nullptr;
+}
 
+TRITONSERVER_Error*
+S3FileSystem::SignUrl(const RemoteFile& file, std::string* url)
+{
+  // 'location' is the bucket and the key as listed by ListFiles()
+  const size_t slash = file.location.find('/');
+  *url = client_->GeneratePresignedUrl(
+      file.location.substr(0, slash), file.location.substr(slash + 1),
+      Aws::Http::HttpMethod::HTTP_GET);
   return nullptr;
 }
 
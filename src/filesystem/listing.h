@@ -0,0 +1,451 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "archive_format.h"
+#include "status.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly {
+
+// A single listed object, as handed to FileSystem::SignUrl()
+struct RemoteFile {
+  // Path relative to the model location, '/' separated
+  std::string path;
+  // Backend location of the object
+  std::string location;
+  uint64_t size = 0;
+  // Set for tar archives that are unpacked into the model directory instead
+  // of being placed at 'path'. 'path' then only names the downloaded blob.
+  bool unpack = false;
+  ArchiveCompression compression = ArchiveCompression::NONE;
+};
+
+// Trie of '/' separated path components. Every distinct component under a
+// parent is stored once, in a single arena, and nodes are plain indices into
+// flat per-node columns, so a listing of many files under a few directories
+// costs little more than the bytes of its distinct names. Nodes are numbered
+// in creation order, which puts every directory before its children.
+class PathTree {
+ public:
+  using NodeId = uint32_t;
+  static constexpr NodeId kRoot = 0;
+
+  PathTree();
+
+  // Node for 'name' under 'parent', created if missing
+  NodeId Child(NodeId parent, std::string_view name);
+
+  size_t NodeCount() const { return parent_.size(); }
+  NodeId Parent(NodeId node) const { return parent_[node]; }
+  std::string_view Name(NodeId node) const
+  {
+    return std::string_view(
+        names_.data() + name_offset_[node], name_size_[node]);
+  }
+
+  // Path of 'node' from the root, without a leading '/'
+  std::string Path(NodeId node) const;
+  void AppendPath(NodeId node, std::string* path) const;
+
+ private:
+  size_t Slot(NodeId parent, std::string_view name) const;
+  void Grow();
+
+  // Arena of the component names
+  std::string names_;
+  std::vector<NodeId> parent_;
+  std::vector<uint32_t> name_offset_;
+  std::vector<uint32_t> name_size_;
+  // Open addressing index of (parent, name), 0 marks a free slot since the
+  // root is nobody's child
+  std::vector<NodeId> slots_;
+};
+
+// Files listed at a model location. Paths live in a PathTree, everything
+// else in columns indexed by the file's position in listing order, so the
+// planner and caches walk it without touching per-file heap objects.
+class Listing {
+ public:
+  using FileId = uint32_t;
+
+  // Location of files added without one is 'base' followed by their path
+  void SetLocationBase(std::string base) { location_base_ = std::move(base); }
+
+  // Add the file at 'path'. A trailing '/' lists an empty directory, which
+  // gets no file entry. Listing a path again replaces the earlier entry.
+  TRITONSERVER_Error* Add(
+      std::string_view path, uint64_t size, std::string_view location = {},
+      std::string_view etag = {}, FileId* id = nullptr);
+
+  void SetSize(FileId file, uint64_t size) { size_[file] = size; }
+  void SetUnpack(FileId file, ArchiveCompression compression);
+  // Lower case hex SHA-256 the downloaded file must have
+  void SetSha256(FileId file, std::string_view sha256)
+  {
+    sha256_[file] = Store(sha256);
+  }
+
+  // Handed the files [begin, end) at the end of every page, so they can be
+  // downloaded while the listing goes on. An error ends the listing.
+  using PageCallback =
+      std::function<TRITONSERVER_Error*(FileId begin, FileId end)>;
+  void SetPageCallback(PageCallback callback)
+  {
+    page_callback_ = std::move(callback);
+  }
+
+  // Called by the backends after each page of a directory listing whose
+  // entries are final, with their exact sizes and no request headers needed
+  // to fetch them. Files added after the last page, such as a single object,
+  // are left to the caller.
+  TRITONSERVER_Error* EndPage();
+
+  // No files and no directories
+  bool Empty() const { return node_.empty() && (tree_.NodeCount() == 1); }
+  size_t FileCount() const { return node_.size(); }
+  const PathTree& Tree() const { return tree_; }
+
+  PathTree::NodeId Node(FileId file) const { return node_[file]; }
+  bool IsDirectory(PathTree::NodeId node) const
+  {
+    return (node != PathTree::kRoot) && (node_file_[node] == kNoFile);
+  }
+  std::string Path(FileId file) const { return tree_.Path(node_[file]); }
+  std::string Location(FileId file) const;
+  uint64_t Size(FileId file) const { return size_[file]; }
+  std::string_view ETag(FileId file) const { return View(etag_[file]); }
+  // Empty when the backend declares no checksum
+  std::string_view Sha256(FileId file) const { return View(sha256_[file]); }
+  bool Unpack(FileId file) const { return unpack_[file] != kNotArchive; }
+  ArchiveCompression Compression(FileId file) const
+  {
+    return Unpack(file) ? static_cast<ArchiveCompression>(unpack_[file])
+                        : ArchiveCompression::NONE;
+  }
+
+  // The file as a standalone object, for FileSystem::SignUrl()
+  RemoteFile File(FileId file) const;
+
+  // Everything under each top level directory as a listing of its own,
+  // rooted at that directory, by directory name. Files at the top level are
+  // left out.
+  TRITONSERVER_Error* SplitDirectories(
+      std::map<std::string, Listing>* directories) const;
+
+ private:
+  static constexpr FileId kNoFile = UINT32_MAX;
+  static constexpr uint8_t kNotArchive = UINT8_MAX;
+
+  struct StringRef {
+    uint32_t offset = 0;
+    uint32_t size = 0;
+  };
+  StringRef Store(std::string_view value);
+  std::string_view View(StringRef ref) const
+  {
+    return std::string_view(strings_.data() + ref.offset, ref.size);
+  }
+
+  PageCallback page_callback_;
+  // Files handed to the page callback so far
+  FileId paged_ = 0;
+
+  PathTree tree_;
+  // File of every tree node, kNoFile for directories
+  std::vector<FileId> node_file_ = std::vector<FileId>(1, kNoFile);
+  std::string location_base_;
+  // Arena of locations, ETags and checksums
+  std::string strings_;
+
+  std::vector<PathTree::NodeId> node_;
+  std::vector<uint64_t> size_;
+  // Empty for locations derived from the base
+  std::vector<StringRef> location_;
+  std::vector<StringRef> etag_;
+  std::vector<StringRef> sha256_;
+  std::vector<uint8_t> unpack_;
+};
+
+PathTree::PathTree()
+{
+  parent_.push_back(kRoot);
+  name_offset_.push_back(0);
+  name_size_.push_back(0);
+  slots_.resize(64, kRoot);
+}
+
+size_t
+PathTree::Slot(NodeId parent, std::string_view name) const
+{
+  const size_t mask = slots_.size() - 1;
+  size_t slot = (std::hash<std::string_view>()(name) ^
+                 (static_cast<size_t>(parent) * 0x9e3779b97f4a7c15ULL)) &
+                mask;
+  while ((slots_[slot] != kRoot) &&
+         ((parent_[slots_[slot]] != parent) || (Name(slots_[slot]) != name))) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+void
+PathTree::Grow()
+{
+  std::vector<NodeId> nodes;
+  nodes.swap(slots_);
+  slots_.resize(nodes.size() * 2, kRoot);
+  for (const NodeId node : nodes) {
+    if (node != kRoot) {
+      slots_[Slot(parent_[node], Name(node))] = node;
+    }
+  }
+}
+
+PathTree::NodeId
+PathTree::Child(NodeId parent, std::string_view name)
+{
+  size_t slot = Slot(parent, name);
+  if (slots_[slot] != kRoot) {
+    return slots_[slot];
+  }
+
+  const NodeId node = parent_.size();
+  parent_.push_back(parent);
+  name_offset_.push_back(names_.size());
+  name_size_.push_back(name.size());
+  names_.append(name);
+  // Keep the index at most half full
+  if (NodeCount() * 2 > slots_.size()) {
+    Grow();
+    slot = Slot(parent, name);
+  }
+  slots_[slot] = node;
+  return node;
+}
+
+std::string
+PathTree::Path(NodeId node) const
+{
+  std::string path;
+  AppendPath(node, &path);
+  return path;
+}
+
+void
+PathTree::AppendPath(NodeId node, std::string* path) const
+{
+  // Size the result first, then fill it in from the leaf upwards
+  size_t size = 0;
+  for (NodeId n = node; n != kRoot; n = parent_[n]) {
+    size += name_size_[n] + 1;
+  }
+  if (size == 0) {
+    return;
+  }
+  const size_t start = path->size();
+  path->resize(start + size - 1, '/');
+  size = path->size();
+  for (NodeId n = node; n != kRoot; n = parent_[n]) {
+    size -= name_size_[n];
+    path->replace(size, name_size_[n], Name(n));
+    size -= 1;
+  }
+}
+
+TRITONSERVER_Error*
+Listing::Add(
+    std::string_view path, uint64_t size, std::string_view location,
+    std::string_view etag, FileId* id)
+{
+  // Reject names that would escape the model directory. A trailing '/'
+  // (empty directory) is the only empty component allowed.
+  auto invalid = [&path]() {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        ("Invalid object name in model directory: '" + std::string(path) +
+         "'")
+            .c_str());
+  };
+  if (path.empty() || (path[0] == '/')) {
+    return invalid();
+  }
+
+  PathTree::NodeId node = PathTree::kRoot;
+  size_t start = 0;
+  bool created = false;
+  while (start < path.size()) {
+    size_t end = path.find('/', start);
+    if (end == std::string_view::npos) {
+      end = path.size();
+    }
+    const std::string_view component = path.substr(start, end - start);
+    if (component.empty() || (component == "..") || (component == ".")) {
+      return invalid();
+    }
+    if (node_file_[node] != kNoFile) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INVALID_ARG,
+          ("'" + tree_.Path(node) + "' is listed as both a file and a " +
+           "directory")
+              .c_str());
+    }
+    const size_t count = tree_.NodeCount();
+    node = tree_.Child(node, component);
+    created = (tree_.NodeCount() > count);
+    if (created) {
+      node_file_.push_back(kNoFile);
+    }
+    start = end + 1;
+  }
+  if (path.back() == '/') {
+    return nullptr;
+  }
+
+  FileId file = node_file_[node];
+  if (file == kNoFile) {
+    if (!created) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INVALID_ARG,
+          ("'" + std::string(path) + "' is listed as both a file and a " +
+           "directory")
+              .c_str());
+    }
+    file = node_.size();
+    node_file_[node] = file;
+    node_.push_back(node);
+    size_.push_back(0);
+    location_.emplace_back();
+    etag_.emplace_back();
+    sha256_.emplace_back();
+    unpack_.push_back(kNotArchive);
+  }
+  size_[file] = size;
+  location_[file] = Store(location);
+  etag_[file] = Store(etag);
+  sha256_[file] = StringRef();
+  if (id != nullptr) {
+    *id = file;
+  }
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+Listing::EndPage()
+{
+  const FileId end = FileCount();
+  if (!page_callback_ || (end == paged_)) {
+    return nullptr;
+  }
+  const FileId begin = paged_;
+  paged_ = end;
+  return page_callback_(begin, end);
+}
+
+void
+Listing::SetUnpack(FileId file, ArchiveCompression compression)
+{
+  unpack_[file] = static_cast<uint8_t>(compression);
+}
+
+Listing::StringRef
+Listing::Store(std::string_view value)
+{
+  StringRef ref;
+  ref.offset = strings_.size();
+  ref.size = value.size();
+  strings_.append(value);
+  return ref;
+}
+
+std::string
+Listing::Location(FileId file) const
+{
+  if (location_[file].size > 0) {
+    return std::string(View(location_[file]));
+  }
+  std::string location = location_base_;
+  tree_.AppendPath(node_[file], &location);
+  return location;
+}
+
+RemoteFile
+Listing::File(FileId file) const
+{
+  RemoteFile remote_file;
+  remote_file.path = Path(file);
+  remote_file.location = Location(file);
+  remote_file.size = Size(file);
+  remote_file.unpack = Unpack(file);
+  remote_file.compression = Compression(file);
+  return remote_file;
+}
+
+TRITONSERVER_Error*
+Listing::SplitDirectories(std::map<std::string, Listing>* directories) const
+{
+  // Nodes are numbered parents first, so the top level directory of every
+  // node is known by the time it is reached, and so is its listing
+  std::vector<PathTree::NodeId> top(tree_.NodeCount(), PathTree::kRoot);
+  std::vector<Listing*> split(tree_.NodeCount(), nullptr);
+  std::string path;
+  for (PathTree::NodeId node = PathTree::kRoot + 1; node < tree_.NodeCount();
+       ++node) {
+    const PathTree::NodeId parent = tree_.Parent(node);
+    if (parent == PathTree::kRoot) {
+      if (IsDirectory(node)) {
+        const std::string name(tree_.Name(node));
+        Listing& directory = (*directories)[name];
+        directory.SetLocationBase(location_base_ + name + '/');
+        split[node] = &directory;
+        top[node] = node;
+      }
+      continue;
+    }
+    top[node] = top[parent];
+    Listing* directory = split[top[node]];
+    if (directory == nullptr) {
+      continue;
+    }
+
+    // Path below the top level directory
+    path.clear();
+    tree_.AppendPath(node, &path);
+    path.erase(0, tree_.Name(top[node]).size() + 1);
+    const FileId file = node_file_[node];
+    if (file == kNoFile) {
+      // Keeps empty directories, such as model versions without files
+      path += '/';
+      RETURN_IF_ERROR(directory->Add(path, 0));
+      continue;
+    }
+    FileId id;
+    RETURN_IF_ERROR(directory->Add(
+        path, size_[file], View(location_[file]), View(etag_[file]), &id));
+    directory->sha256_[id] = directory->Store(View(sha256_[file]));
+    directory->unpack_[id] = unpack_[file];
+  }
+  return nullptr;
+}
+
+}  // namespace triton::repoagent::dragonfly
@@ -0,0 +1,212 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "implementations/common.h"
+#include "listing.h"
+#include "manifest.h"
+#include "status.h"
+#include "trace.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly {
+
+// Listings of whole repositories, shared by the loads of the models in them.
+// Triton loads every model of a repository on its own, so at server start
+// each load would list its own prefix and a repository of many models costs
+// as many listings. Once a second model of a repository is loaded within
+// the TTL of the first, the repository is listed in one pass and split by
+// model directory, and the loads that follow within the TTL take their
+// listing from memory. A single model loaded on its own is never charged
+// for listing its neighbours.
+class ListingCache {
+ public:
+  // Move the listing of the model at 'location' into 'listing' and return
+  // true if a listing of its repository at most 'ttl_ms' old has it. Return
+  // false if the model is to be listed on its own: its backend does not
+  // share listings, the model is new, has a manifest, or was taken before.
+  bool Take(
+      FileSystem& fs, const std::string& location, uint64_t ttl_ms,
+      Listing* listing);
+
+  // Drop the repository listing the model at 'location' was taken from,
+  // after its load failed, in case the listing is out of date
+  void Invalidate(FileSystem& fs, const std::string& location);
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Repository {
+    // Client the repository was listed with
+    const FileSystem* fs = nullptr;
+    // Set while a load lists the repository for the others
+    bool listing = false;
+    // Last listing of the whole repository, and last model of it listed on
+    // its own
+    Clock::time_point listed;
+    Clock::time_point seen;
+    // Listings of the models not taken yet, by name
+    std::map<std::string, Listing> models;
+    // Models taken from the current listing
+    std::set<std::string> taken;
+  };
+
+  static TRITONSERVER_Error* ListRepository(
+      FileSystem& fs, const std::string& repository,
+      std::map<std::string, Listing>* models);
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::map<std::string, Repository> repositories_;
+};
+
+bool
+ListingCache::Take(
+    FileSystem& fs, const std::string& location, uint64_t ttl_ms,
+    Listing* listing)
+{
+  if (ttl_ms == 0) {
+    return false;
+  }
+  std::string repository, model;
+  TRITONSERVER_Error* err = fs.Repository(location, &repository, &model);
+  if (err != nullptr) {
+    TRITONSERVER_ErrorDelete(err);
+    return false;
+  }
+  if (repository.empty()) {
+    return false;
+  }
+
+  std::unique_lock<std::mutex> lock(mu_);
+  Repository& repo = repositories_[repository];
+  cv_.wait(lock, [&repo]() { return !repo.listing; });
+  if (repo.fs != &fs) {
+    repo = Repository();
+    repo.fs = &fs;
+  }
+  const Clock::time_point now = Clock::now();
+  auto recent = [&now, ttl_ms](Clock::time_point time) {
+    return (time != Clock::time_point()) &&
+           (now - time < std::chrono::milliseconds(ttl_ms));
+  };
+  if (!recent(repo.listed)) {
+    repo.models.clear();
+    repo.taken.clear();
+    if (!recent(repo.seen)) {
+      repo.seen = now;
+      return false;
+    }
+
+    // A second model of the repository, list it for this one and the rest
+    repo.listing = true;
+    lock.unlock();
+    std::map<std::string, Listing> models;
+    err = ListRepository(fs, repository, &models);
+    lock.lock();
+    repo.listing = false;
+    cv_.notify_all();
+    // A failed listing is not tried again before it expires
+    repo.listed = Clock::now();
+    if (err != nullptr) {
+      LOG_MESSAGE(
+          TRITONSERVER_LOG_WARN,
+          ("dragonfly: models of " + repository +
+           " are listed one by one: " + TRITONSERVER_ErrorMessage(err))
+              .c_str());
+      TRITONSERVER_ErrorDelete(err);
+    } else {
+      LOG_MESSAGE(
+          TRITONSERVER_LOG_VERBOSE,
+          ("dragonfly: listed " + repository + " for its " +
+           std::to_string(models.size()) + " models")
+              .c_str());
+    }
+    repo.models.swap(models);
+  }
+
+  const auto itr = repo.models.find(model);
+  if (itr == repo.models.end()) {
+    return false;
+  }
+  // A model with a manifest is read from it, see ReadManifest()
+  const Listing& found = itr->second;
+  for (Listing::FileId file = 0; file < found.FileCount(); ++file) {
+    if ((found.Tree().Parent(found.Node(file)) == PathTree::kRoot) &&
+        (found.Tree().Name(found.Node(file)) == MANIFEST_NAME)) {
+      repo.models.erase(itr);
+      return false;
+    }
+  }
+  *listing = std::move(itr->second);
+  repo.models.erase(itr);
+  repo.taken.insert(model);
+  return true;
+}
+
+void
+ListingCache::Invalidate(FileSystem& fs, const std::string& location)
+{
+  std::string repository, model;
+  TRITONSERVER_Error* err = fs.Repository(location, &repository, &model);
+  if (err != nullptr) {
+    TRITONSERVER_ErrorDelete(err);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mu_);
+  const auto itr = repositories_.find(repository);
+  if ((itr == repositories_.end()) || (itr->second.fs != &fs) ||
+      (itr->second.taken.count(model) == 0)) {
+    return;
+  }
+  itr->second.listed = Clock::time_point();
+  itr->second.models.clear();
+  itr->second.taken.clear();
+}
+
+TRITONSERVER_Error*
+ListingCache::ListRepository(
+    FileSystem& fs, const std::string& repository,
+    std::map<std::string, Listing>* models)
+{
+  TraceSpan span("ListRepository", "listing");
+  span.Arg("repository", repository);
+  Listing listing;
+  bool is_dir = false;
+  RETURN_IF_ERROR(fs.ListFiles(repository, &is_dir, &listing));
+  span.Arg("files", listing.FileCount());
+  RETURN_IF_ERROR(listing.SplitDirectories(models));
+  span.Arg("models", models->size());
+  return nullptr;
+}
+
+ListingCache&
+GetListingCache()
+{
+  static ListingCache cache;
+  return cache;
+}
+
+}  // namespace triton::repoagent::dragonfly
@@ -0,0 +1,85 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "listing.h"
+#include "status.h"
+#include "triton/common/triton_json.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly {
+
+// Name of the manifest object at the root of a model location. When it is
+// there the location is not listed: the files it names are signed and
+// downloaded as they are,
+//
+//   {"files": [{"path": "1/model.onnx", "size": 1234, "sha256": "..."}, ...]}
+//
+// 'sha256' is optional and checked once a file is downloaded. Paths are
+// relative to the location, '/' separated.
+const std::string MANIFEST_NAME = ".dragonfly-manifest.json";
+
+// Add the files of the manifest read from 'source' to 'listing'. 'location'
+// gives a file's backend location from its path, without it the location is
+// derived from the listing's base.
+TRITONSERVER_Error*
+ParseManifest(
+    const std::string& source, const std::string& manifest,
+    const std::function<std::string(const std::string& path)>& location,
+    Listing* listing)
+{
+  triton::common::TritonJson::Value manifest_json, files_json;
+  RETURN_IF_ERROR(manifest_json.Parse(manifest));
+  if (!manifest_json.Find("files", &files_json)) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG, ("No 'files' in " + source).c_str());
+  }
+  for (size_t i = 0; i < files_json.ArraySize(); i++) {
+    triton::common::TritonJson::Value file_json;
+    std::string path, sha256;
+    uint64_t size = 0;
+    RETURN_IF_ERROR(files_json.IndexAsObject(i, &file_json));
+    RETURN_IF_ERROR(file_json.MemberAsString("path", &path));
+    RETURN_IF_ERROR(file_json.MemberAsUInt("size", &size));
+    Listing::FileId file;
+    RETURN_IF_ERROR(listing->Add(
+        path, size, location ? location(path) : std::string(), {}, &file));
+    // A trailing '/' lists an empty directory
+    if ((path.back() == '/') || !file_json.Find("sha256")) {
+      continue;
+    }
+    RETURN_IF_ERROR(file_json.MemberAsString("sha256", &sha256));
+    bool hex = (sha256.size() == 64);
+    for (char& c : sha256) {
+      c = std::tolower(static_cast<unsigned char>(c));
+      hex = hex && std::isxdigit(static_cast<unsigned char>(c));
+    }
+    if (!hex) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INVALID_ARG,
+          ("Invalid sha256 of '" + path + "' in " + source).c_str());
+    }
+    listing->SetSha256(file, sha256);
+  }
+  return nullptr;
+}
+
+}  // namespace triton::repoagent::dragonfly
@@ -0,0 +1,589 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "archive.h"
+#include "cache.h"
+#include "common_utils.h"
+#include "config.h"
+#include "implementations/common.h"
+#include "listing.h"
+#include "listing_cache.h"
+#include "manifest.h"
+#include "preheat.h"
+#include "staging.h"
+#include "trace.h"
+#include "transfer.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly {
+
+// Longest-processing-time-first order. The engine runs a bounded number of
+// transfers and starts them in the order given, so the largest files start
+// first and the small ones fill the slots they leave idle, instead of one
+// large file starting last and deciding the total load time. Ties keep the
+// listing order, which the backends return sorted, so the order is stable
+// between loads.
+void
+PlanTransfers(const Listing& listing, std::vector<Listing::FileId>* files)
+{
+  std::stable_sort(
+      files->begin(), files->end(),
+      [&listing](Listing::FileId a, Listing::FileId b) {
+        return listing.Size(a) > listing.Size(b);
+      });
+}
+
+// Move every entry of 'staging' into 'temp_dir', merging directories that
+// exist in both
+TRITONSERVER_Error*
+CommitDirectory(const std::string& staging, const std::string& temp_dir)
+{
+  DIR* dir = opendir(staging.c_str());
+  if (dir == nullptr) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to open " + staging + ", errno:" + strerror(errno)).c_str());
+  }
+  TRITONSERVER_Error* err = nullptr;
+  while (struct dirent* entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    if ((name == ".") || (name == "..")) {
+      continue;
+    }
+    const std::string from = JoinPath({staging, name});
+    const std::string to = JoinPath({temp_dir, name});
+    struct stat from_st, to_st;
+    if ((lstat(from.c_str(), &from_st) == 0) && S_ISDIR(from_st.st_mode) &&
+        (stat(to.c_str(), &to_st) == 0) && S_ISDIR(to_st.st_mode)) {
+      err = CommitDirectory(from, to);
+      if (err != nullptr) {
+        break;
+      }
+      continue;
+    }
+    if (rename(from.c_str(), to.c_str()) != 0) {
+      err = TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INTERNAL,
+          ("Failed to rename " + from + " to " + to + ", errno:" +
+           strerror(errno))
+              .c_str());
+      break;
+    }
+  }
+  closedir(dir);
+  return err;
+}
+
+// Download of 'file' from 'url' into 'path', recorded in 'journal' and
+// published to 'cache' once complete if the load claimed it there
+TransferRequest
+TransferFor(
+    const Listing& listing, Listing::FileId file, const DragonflyConfig& config,
+    const std::string& url, const std::string& path, SharedCache* cache,
+    StagingJournal* journal)
+{
+  TransferRequest request;
+  request.url = url;
+  request.path = path;
+  request.size = listing.Size(file);
+  request.sha256 = listing.Sha256(file);
+  request.direct = config.FetchDirect(listing.Path(file), request.size);
+  // Whatever was staged at the path is overwritten
+  journal->Forget(path);
+  const std::string key = CacheKey(listing, file);
+  const uint64_t size = request.size;
+  request.on_complete = [cache, journal, key, size, path]() {
+    journal->Record(path, key);
+    if (!key.empty()) {
+      cache->Publish(key, size, path);
+    }
+  };
+  return request;
+}
+
+// Read the files of 'location' from its manifest object, see manifest.h,
+// with a single GET straight to the origin. 'found' is false when the
+// backend reads no manifests here or the object cannot be fetched, e.g. it
+// does not exist; the location is then listed. A manifest that is there but
+// invalid fails the load.
+TRITONSERVER_Error*
+ReadManifest(
+    FileSystem& fs, const std::string& location, Listing* listing,
+    bool* found)
+{
+  *found = false;
+  RemoteFile manifest;
+  std::string location_base;
+  RETURN_IF_ERROR(fs.ManifestFile(location, &manifest, &location_base));
+  if (manifest.location.empty()) {
+    return nullptr;
+  }
+
+  TraceSpan span("ReadManifest", "listing");
+  std::string url;
+  RETURN_IF_ERROR(fs.SignUrl(manifest, &url));
+  HttpResponse response;
+  TRITONSERVER_Error* err = FetchUrl(url, {}, false, &response);
+  if (err != nullptr) {
+    TRITONSERVER_ErrorDelete(err);
+    return nullptr;
+  }
+  // A missing object is 404, or 403 without permission to list
+  span.Arg("status", response.status);
+  if (response.status != 200) {
+    return nullptr;
+  }
+  listing->SetLocationBase(location_base);
+  RETURN_IF_ERROR(
+      ParseManifest(manifest.location, response.body, nullptr, listing));
+  span.Arg("files", listing->FileCount());
+  *found = true;
+  return nullptr;
+}
+
+// Hand the downloads of the files [begin, end) of 'listing' into
+// 'files_dir' to 'start', largest first. Archives are left to the plan of
+// the whole listing, and files that are staged already, see StagingJournal,
+// linked from 'cache' or being downloaded into it by another process are
+// skipped.
+TRITONSERVER_Error*
+StageFiles(
+    FileSystem& fs, const Listing& listing, Listing::FileId begin,
+    Listing::FileId end, const std::string& files_dir,
+    const DragonflyConfig& config, SharedCache* cache, StagingJournal* journal,
+    const std::function<TRITONSERVER_Error*(TransferRequest)>& start)
+{
+  std::vector<Listing::FileId> files;
+  for (Listing::FileId file = begin; file < end; ++file) {
+    if (!listing.Unpack(file)) {
+      files.push_back(file);
+    }
+  }
+  PlanTransfers(listing, &files);
+  for (const auto file : files) {
+    const std::string path = JoinPath({files_dir, listing.Path(file)});
+    const std::string key = CacheKey(listing, file);
+    if (journal->Staged(path, key, listing.Size(file))) {
+      continue;
+    }
+    const SharedCache::Result cached =
+        cache->Lookup(key, listing.Size(file), path, false /* wait */);
+    if (cached == SharedCache::Result::kHit) {
+      journal->Record(path, key);
+      continue;
+    }
+    if (cached == SharedCache::Result::kBusy) {
+      continue;
+    }
+    std::string url;
+    TraceSpan span("SignUrl", "sign");
+    const RemoteFile remote_file = listing.File(file);
+    span.Arg("path", remote_file.path);
+    RETURN_IF_ERROR(fs.SignUrl(remote_file, &url));
+    span.End();
+    RETURN_IF_ERROR(start(
+        TransferFor(listing, file, config, url, path, cache, journal)));
+  }
+  return nullptr;
+}
+
+// List 'location' into 'listing'. For backends that report pages, see
+// Listing::EndPage(), a second thread lists and signs while this one
+// downloads the files of every page into 'files_dir' of the staging
+// directory, so the listing latency overlaps with the transfers instead of
+// adding to them. Downloads that completed are found in 'journal' by the
+// plan of the whole listing, which then fetches the rest, including the
+// objects another process was downloading into 'cache'.
+TRITONSERVER_Error*
+ListAndTransfer(
+    FileSystem& fs, const std::string& location, const std::string& files_dir,
+    DragonflyConfig& config, SharedCache* cache, StagingJournal* journal,
+    bool* is_dir, Listing* listing)
+{
+  TransferFeed feed(
+      2 * std::max<uint64_t>(config.concurrency, config.max_concurrency));
+  const PathTree& tree = listing->Tree();
+  PathTree::NodeId made_dirs = PathTree::kRoot + 1;
+  bool made_files_dir = false;
+  auto on_page = [&](Listing::FileId begin,
+                     Listing::FileId end) -> TRITONSERVER_Error* {
+    // Nothing is staged for a location that turns out not to exist
+    if (!made_files_dir) {
+      RETURN_IF_ERROR(MakeDirectory(files_dir));
+      made_files_dir = true;
+    }
+    for (; made_dirs < tree.NodeCount(); ++made_dirs) {
+      if (listing->IsDirectory(made_dirs)) {
+        RETURN_IF_ERROR(
+            MakeDirectory(JoinPath({files_dir, tree.Path(made_dirs)})));
+      }
+    }
+
+    return StageFiles(
+        fs, *listing, begin, end, files_dir, config, cache, journal,
+        [&](TransferRequest request) -> TRITONSERVER_Error* {
+          if (feed.Push(std::move(request))) {
+            return nullptr;
+          }
+          return TRITONSERVER_ErrorNew(
+              TRITONSERVER_ERROR_UNAVAILABLE,
+              ("Listing of " + location + " stopped by a failed transfer")
+                  .c_str());
+        });
+  };
+  listing->SetPageCallback(on_page);
+
+  TRITONSERVER_Error* list_err = nullptr;
+  Trace* trace = Trace::Current();
+  std::thread lister([&]() {
+    ScopedTrace scoped_trace(trace);
+    TraceSpan span("ListFiles", "listing");
+    list_err = fs.ListFiles(location, is_dir, listing);
+    span.Arg("files", listing->FileCount());
+    feed.Close();
+  });
+  TRITONSERVER_Error* err;
+  {
+    TraceSpan span("PipelinedTransfers", "transfer");
+    TransferEngine engine(config);
+    err = engine.Run(&feed);
+    feed.Stop();
+    lister.join();
+  }
+  listing->SetPageCallback(nullptr);
+
+  // A failed transfer also fails the listing it stopped
+  if (err != nullptr) {
+    if (list_err != nullptr) {
+      TRITONSERVER_ErrorDelete(list_err);
+    }
+    return err;
+  }
+  return list_err;
+}
+
+// Download the model at 'location' into 'temp_dir'. The backend only lists
+// and signs, every backend shares the same directory layout, archive
+// handling and transfer order.
+//
+// Files are downloaded into a staging directory and only moved into
+// 'temp_dir' once every one of them is complete and has its listed size,
+// followed by a single syncfs() for the whole model. The staging directory
+// holds the model files under 'files', archives listed for unpacking under
+// 'blobs', and their contents under 'unpack' once all downloads verified.
+//
+// With 'cache_dir' set, files are linked from the cache shared by the
+// processes of the host when they are there, and published to it once
+// downloaded, see SharedCache.
+//
+// A manifest object at the location replaces the listing, see manifest.h,
+// and so does a listing of the whole repository that other loads of its
+// models share, see ListingCache.
+// With 'preheat_url' set, the first load of a model version has the
+// Dragonfly manager preheat every file before its own transfers start, so
+// the listing is complete before any transfer. Otherwise transfers start
+// with the first page of the listing.
+TRITONSERVER_Error*
+StageModel(
+    FileSystem& fs, const std::string& location, const std::string& temp_dir,
+    Staging* staging, DragonflyConfig& config)
+{
+  const std::string files_dir = JoinPath({staging->Dir(), "files"});
+  const std::string blobs_dir = JoinPath({staging->Dir(), "blobs"});
+  const std::string unpack_dir = JoinPath({staging->Dir(), "unpack"});
+  StagingJournal* journal = &staging->Journal();
+  SharedCache cache(config.cache_dir, config.cache_max_size, staging->Dir());
+
+  bool is_dir = false;
+  Listing listing;
+  const bool shared =
+      GetListingCache().Take(fs, location, config.listing_ttl_ms, &listing);
+  bool from_manifest = false;
+  if (!shared) {
+    RETURN_IF_ERROR(ReadManifest(fs, location, &listing, &from_manifest));
+  }
+  if (shared || from_manifest) {
+    is_dir = true;
+  } else if (config.preheat_url.empty()) {
+    RETURN_IF_ERROR(ListAndTransfer(
+        fs, location, files_dir, config, &cache, journal, &is_dir, &listing));
+  } else {
+    TraceSpan span("ListFiles", "listing");
+    RETURN_IF_ERROR(fs.ListFiles(location, &is_dir, &listing));
+    span.Arg("files", listing.FileCount());
+  }
+  if (listing.Empty()) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_NOT_FOUND,
+        ("directory or file does not exist at " + location).c_str());
+  }
+
+  DragonflyConfig request_config = config;
+  RETURN_IF_ERROR(fs.RequestHeaders(location, &request_config.origin_headers));
+
+  std::string preheat_key;
+  if (!config.preheat_url.empty()) {
+    preheat_key = PreheatKey(location, listing);
+    if (!GetPreheatRegistry().Claim(preheat_key)) {
+      preheat_key.clear();
+    }
+  }
+
+  RETURN_IF_ERROR(RemoveAll(unpack_dir));
+
+  ArchiveCompression compression;
+  if (!is_dir && IsArchivePath(location, &compression)) {
+    // Streamed straight into the unpack directory, there is nothing to
+    // resume from
+    std::string url;
+    {
+      TraceSpan span("SignUrl", "sign");
+      RETURN_IF_ERROR(fs.SignUrl(listing.File(0), &url));
+    }
+    if (!preheat_key.empty()) {
+      PreheatModel(preheat_key, location, {url}, request_config);
+    }
+    RETURN_IF_ERROR(MakeDirectory(unpack_dir));
+    {
+      TraceSpan span("DownloadArchive", "transfer");
+      span.Arg("size", listing.Size(0));
+      DragonflyConfig archive_config =
+          config.FetchDirect(listing.Path(0), listing.Size(0))
+              ? request_config.OriginConfig()
+              : request_config;
+      RETURN_IF_ERROR(
+          DownloadArchive(url, unpack_dir, compression, archive_config));
+    }
+    TraceSpan span("Commit", "commit");
+    RETURN_IF_ERROR(CommitDirectory(unpack_dir, temp_dir));
+    return SyncFileSystem(temp_dir);
+  }
+
+  // Archives are only downloaded into 'blobs', model files at their path
+  // in 'files'
+  const PathTree& tree = listing.Tree();
+  std::vector<Listing::FileId> transfers;
+  std::vector<Listing::FileId> archives;
+  for (Listing::FileId file = 0; file < listing.FileCount(); ++file) {
+    if (listing.Unpack(file)) {
+      if (tree.Parent(listing.Node(file)) != PathTree::kRoot) {
+        return TRITONSERVER_ErrorNew(
+            TRITONSERVER_ERROR_INVALID_ARG,
+            ("Invalid archive name: '" + listing.Path(file) + "'").c_str());
+      }
+      archives.push_back(file);
+    }
+    transfers.push_back(file);
+  }
+
+  // Tree nodes are numbered parents first, so the whole directory tree is
+  // created in one pass
+  std::vector<std::string> dirs;
+  for (PathTree::NodeId node = 0; node < tree.NodeCount(); ++node) {
+    if (listing.IsDirectory(node)) {
+      dirs.push_back(tree.Path(node));
+    }
+  }
+  RETURN_IF_ERROR(MakeDirectory(files_dir));
+  RETURN_IF_ERROR(MakeDirectory(blobs_dir));
+  for (const auto& dir : dirs) {
+    RETURN_IF_ERROR(MakeDirectory(JoinPath({files_dir, dir})));
+  }
+  auto staged_path = [&](Listing::FileId file) {
+    return JoinPath(
+        {listing.Unpack(file) ? blobs_dir : files_dir, listing.Path(file)});
+  };
+
+  // Files an earlier attempt completed are in the journal. Other nodes need
+  // the whole model, so a preheat signs those too.
+  PlanTransfers(listing, &transfers);
+  TransferEngine engine(request_config);
+  std::vector<std::string> preheat_urls;
+  // Objects another process is downloading into the shared cache
+  std::vector<Listing::FileId> waiting;
+  size_t cache_hits = 0;
+  for (const auto file : transfers) {
+    const std::string path = staged_path(file);
+    const std::string key = CacheKey(listing, file);
+    bool staged = journal->Staged(path, key, listing.Size(file));
+    bool busy = false;
+    if (!staged) {
+      const SharedCache::Result cached =
+          cache.Lookup(key, listing.Size(file), path, false /* wait */);
+      staged = (cached == SharedCache::Result::kHit);
+      busy = (cached == SharedCache::Result::kBusy);
+      if (staged) {
+        journal->Record(path, key);
+        ++cache_hits;
+      }
+      if (busy) {
+        waiting.push_back(file);
+      }
+    }
+    if ((staged || busy) && preheat_key.empty()) {
+      continue;
+    }
+    std::string url;
+    TraceSpan span("SignUrl", "sign");
+    const RemoteFile remote_file = listing.File(file);
+    span.Arg("path", remote_file.path);
+    RETURN_IF_ERROR(fs.SignUrl(remote_file, &url));
+    span.End();
+    if (!staged && !busy) {
+      engine.Add(
+          TransferFor(listing, file, config, url, path, &cache, journal));
+    }
+    if (!preheat_key.empty()) {
+      preheat_urls.push_back(std::move(url));
+    }
+  }
+  if (!preheat_key.empty()) {
+    PreheatModel(preheat_key, location, preheat_urls, request_config);
+  }
+  {
+    TraceSpan span("Transfers", "transfer");
+    span.Arg("files", transfers.size());
+    span.Arg("cache_hits", cache_hits);
+    RETURN_IF_ERROR(engine.Run());
+  }
+
+  // Wait for the other processes, then link what they published and
+  // download what they did not. Only a load that holds no claim waits, so
+  // each round waits for at most the first object and takes the rest that
+  // are free.
+  while (!waiting.empty()) {
+    TraceSpan span("CacheWait", "transfer");
+    span.Arg("files", waiting.size());
+    TransferEngine retry(request_config);
+    std::vector<Listing::FileId> busy;
+    for (const auto file : waiting) {
+      const std::string path = staged_path(file);
+      const std::string key = CacheKey(listing, file);
+      const SharedCache::Result cached = cache.Lookup(
+          key, listing.Size(file), path, !cache.HoldsClaims() /* wait */);
+      if (cached == SharedCache::Result::kHit) {
+        journal->Record(path, key);
+        continue;
+      }
+      if (cached == SharedCache::Result::kBusy) {
+        busy.push_back(file);
+        continue;
+      }
+      std::string url;
+      RETURN_IF_ERROR(fs.SignUrl(listing.File(file), &url));
+      retry.Add(
+          TransferFor(listing, file, config, url, path, &cache, journal));
+    }
+    RETURN_IF_ERROR(retry.Run());
+    waiting.swap(busy);
+  }
+
+  TraceSpan verify_span("Verify", "verify");
+  for (const auto file : transfers) {
+    const std::string path = staged_path(file);
+    struct stat st;
+    if ((stat(path.c_str(), &st) != 0) ||
+        (static_cast<uint64_t>(st.st_size) != listing.Size(file))) {
+      // Let the next attempt download it again
+      remove(path.c_str());
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INTERNAL,
+          ("Downloaded size of " + listing.Path(file) +
+           " does not match the " + std::to_string(listing.Size(file)) +
+           " bytes listed at " + location)
+              .c_str());
+    }
+  }
+  verify_span.End();
+
+  // Archives are unpacked in listing order, so later ones win like image
+  // layers do
+  if (!archives.empty()) {
+    RETURN_IF_ERROR(MakeDirectory(unpack_dir));
+    for (const auto archive : archives) {
+      TraceSpan span("ExtractArchive", "unpack");
+      span.Arg("path", listing.Path(archive));
+      RETURN_IF_ERROR(ExtractArchiveFile(
+          staged_path(archive), unpack_dir, listing.Compression(archive)));
+    }
+  }
+
+  TraceSpan commit_span("Commit", "commit");
+
+  // Commit only what was listed, leftovers of earlier attempts are dropped
+  // with the staging directory
+  for (const auto& dir : dirs) {
+    RETURN_IF_ERROR(MakeDirectory(JoinPath({temp_dir, dir})));
+  }
+  for (const auto file : transfers) {
+    if (listing.Unpack(file)) {
+      continue;
+    }
+    const std::string from = staged_path(file);
+    const std::string to = JoinPath({temp_dir, listing.Path(file)});
+    if (rename(from.c_str(), to.c_str()) != 0) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INTERNAL,
+          ("Failed to rename " + from + " to " + to + ", errno:" +
+           strerror(errno))
+              .c_str());
+    }
+  }
+  if (!archives.empty()) {
+    RETURN_IF_ERROR(CommitDirectory(unpack_dir, temp_dir));
+  }
+  commit_span.End();
+  cache.Evict();
+
+  TraceSpan sync_span("SyncFileSystem", "commit");
+  return SyncFileSystem(temp_dir);
+}
+
+// Download the model at 'location' into 'temp_dir', see StageModel(), in
+// the staging directory of the location, or in one of its own while another
+// load holds that one
+TRITONSERVER_Error*
+LocalizeModel(
+    FileSystem& fs, const std::string& location, const std::string& temp_dir,
+    DragonflyConfig& config)
+{
+  Staging staging(temp_dir, location);
+  bool claimed = false;
+  RETURN_IF_ERROR(staging.Claim(true /* fallback */, &claimed));
+  if (!claimed) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_UNAVAILABLE,
+        ("Failed to claim a staging directory for " + location).c_str());
+  }
+  RETURN_IF_ERROR(StageModel(fs, location, temp_dir, &staging, config));
+  staging.Release(true /* committed */);
+  return nullptr;
+}
+
+}  // namespace triton::repoagent::dragonfly
@@ -0,0 +1,562 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cache.h"
+#include "common_utils.h"
+#include "config.h"
+#include "implementations/common.h"
+#include "listing.h"
+#include "planner.h"
+#include "status.h"
+#include "transfer.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly {
+
+// Next token of the protobuf text 'config' from '*pos': an identifier, the
+// contents of a quoted string with '*quoted' set, or a single punctuation
+// character. Comments and whitespace are skipped. False at the end.
+bool
+NextConfigToken(
+    const std::string& config, size_t* pos, std::string* token, bool* quoted)
+{
+  while (*pos < config.size()) {
+    if (config[*pos] == '#') {
+      *pos = config.find('\n', *pos);
+      *pos = (*pos == std::string::npos) ? config.size() : *pos;
+    } else if (isspace(static_cast<unsigned char>(config[*pos]))) {
+      ++*pos;
+    } else {
+      break;
+    }
+  }
+  if (*pos >= config.size()) {
+    return false;
+  }
+  token->clear();
+  *quoted = false;
+  const char c = config[*pos];
+  if ((c == '"') || (c == '\'')) {
+    for (++*pos; (*pos < config.size()) && (config[*pos] != c); ++*pos) {
+      if ((config[*pos] == '\\') && (*pos + 1 < config.size())) {
+        ++*pos;
+      }
+      *token += config[*pos];
+    }
+    ++*pos;
+    *quoted = true;
+  } else if (isalnum(static_cast<unsigned char>(c)) || (c == '_')) {
+    const size_t start = *pos;
+    while ((*pos < config.size()) &&
+           (isalnum(static_cast<unsigned char>(config[*pos])) ||
+            (config[*pos] == '_') || (config[*pos] == '.'))) {
+      ++*pos;
+    }
+    *token = config.substr(start, *pos - start);
+  } else {
+    *token = c;
+    ++*pos;
+  }
+  return true;
+}
+
+// Whether 'token' of NextConfigToken() is an identifier
+bool
+IsConfigIdentifier(const std::string& token, bool quoted)
+{
+  return !quoted && !token.empty() &&
+         (isalnum(static_cast<unsigned char>(token[0])) || (token[0] == '_'));
+}
+
+// Names of the models run by the steps of the ensemble described by the
+// config.pbtxt text 'config', in step order and without repeats. Empty for
+// a model that is not an ensemble. Only the tokens needed to find
+// 'ensemble_scheduling { step [ { model_name: "..." } ] }' are recognized.
+std::vector<std::string>
+EnsembleSteps(const std::string& config)
+{
+  std::vector<std::string> steps;
+  // Brace depth, and the depth inside 'ensemble_scheduling', 0 outside it
+  int depth = 0;
+  int scheduling = 0;
+  // The last identifier and whether a ':' followed it
+  std::string name;
+  bool colon = false;
+  size_t pos = 0;
+  std::string token;
+  bool quoted = false;
+  while (NextConfigToken(config, &pos, &token, &quoted)) {
+    if (quoted) {
+      if ((scheduling > 0) && colon && (name == "model_name") &&
+          (std::find(steps.begin(), steps.end(), token) == steps.end())) {
+        steps.push_back(token);
+      }
+      name.clear();
+    } else if (IsConfigIdentifier(token, quoted)) {
+      name = token;
+      colon = false;
+    } else {
+      const char c = token[0];
+      if ((c == '{') || (c == '<')) {
+        ++depth;
+        if ((scheduling == 0) && (depth == 1) &&
+            (name == "ensemble_scheduling")) {
+          scheduling = depth;
+        }
+      } else if ((c == '}') || (c == '>')) {
+        if (depth == scheduling) {
+          scheduling = 0;
+        }
+        --depth;
+      }
+      colon = (c == ':');
+      if (!colon) {
+        name.clear();
+      }
+    }
+  }
+  return steps;
+}
+
+// Parameters of the dragonfly agent in the config.pbtxt text 'config', from
+// 'model_repository_agents { agents [ { name: "dragonfly" parameters [ {
+// key: "..." value: "..." } ] } ] }'. False when the model is not loaded
+// through the agent.
+bool
+AgentParameters(
+    const std::string& config, std::map<std::string, std::string>* parameters)
+{
+  // Brace depth, and the depths of 'model_repository_agents', of an agent
+  // and of one of its parameters, 0 outside them
+  int depth = 0;
+  int agents = 0;
+  int agent = 0;
+  int parameter = 0;
+  // The last identifier, whether a ':' followed it, and the fields of the
+  // lists that are open
+  std::string name;
+  bool colon = false;
+  std::vector<std::string> lists;
+  std::string agent_name, key, value;
+  std::map<std::string, std::string> agent_parameters;
+  bool found = false;
+  size_t pos = 0;
+  std::string token;
+  bool quoted = false;
+  while (NextConfigToken(config, &pos, &token, &quoted)) {
+    if (quoted) {
+      if (colon && (agent > 0) && (depth == agent) && (name == "name")) {
+        agent_name = token;
+      } else if (colon && (parameter > 0) && (depth == parameter)) {
+        if (name == "key") {
+          key = token;
+        } else if (name == "value") {
+          value = token;
+        }
+      }
+      name.clear();
+    } else if (IsConfigIdentifier(token, quoted)) {
+      name = token;
+      colon = false;
+    } else {
+      const char c = token[0];
+      if (c == '[') {
+        lists.push_back(name);
+      } else if ((c == ']') && !lists.empty()) {
+        lists.pop_back();
+      } else if ((c == '{') || (c == '<')) {
+        const std::string field =
+            (name.empty() && !lists.empty()) ? lists.back() : name;
+        ++depth;
+        if ((depth == 1) && (field == "model_repository_agents")) {
+          agents = depth;
+        } else if (
+            (agents > 0) && (depth == agents + 1) && (field == "agents")) {
+          agent = depth;
+          agent_name.clear();
+          agent_parameters.clear();
+        } else if (
+            (agent > 0) && (depth == agent + 1) && (field == "parameters")) {
+          parameter = depth;
+          key.clear();
+          value.clear();
+        }
+      } else if ((c == '}') || (c == '>')) {
+        if (depth == parameter) {
+          agent_parameters[key] = value;
+          parameter = 0;
+        } else if (depth == agent) {
+          if (agent_name == "dragonfly") {
+            found = true;
+            parameters->insert(
+                agent_parameters.begin(), agent_parameters.end());
+          }
+          agent = 0;
+        } else if (depth == agents) {
+          agents = 0;
+        }
+        --depth;
+      }
+      colon = (c == ':');
+      if (!colon) {
+        name.clear();
+      }
+    }
+  }
+  return found;
+}
+
+// Download the model at 'location' into the staging directory its load
+// into 'temp_dir' uses, as that load would, and publish it to the shared
+// cache. The model's config.pbtxt is read first: a model that is not loaded
+// through the agent is skipped, and the parameters it gives the agent apply
+// on top of 'file_config'. Nothing is committed; the load finds the files
+// staged and only fetches what changed since. Models another process is
+// staging are left to it.
+TRITONSERVER_Error*
+PrefetchModel(
+    FileSystem& fs, const std::string& location, const std::string& temp_dir,
+    const DragonflyConfig& file_config)
+{
+  Listing listing;
+  bool from_manifest = false;
+  RETURN_IF_ERROR(ReadManifest(fs, location, &listing, &from_manifest));
+  if (!from_manifest) {
+    bool is_dir = false;
+    RETURN_IF_ERROR(fs.ListFiles(location, &is_dir, &listing));
+    if (!is_dir) {
+      return nullptr;
+    }
+  }
+  const PathTree& tree = listing.Tree();
+  Listing::FileId model_config = listing.FileCount();
+  for (Listing::FileId file = 0; file < listing.FileCount(); ++file) {
+    if ((tree.Parent(listing.Node(file)) == PathTree::kRoot) &&
+        (tree.Name(listing.Node(file)) == "config.pbtxt")) {
+      model_config = file;
+      break;
+    }
+  }
+  if (model_config == listing.FileCount()) {
+    return nullptr;
+  }
+
+  std::string url;
+  RETURN_IF_ERROR(fs.SignUrl(listing.File(model_config), &url));
+  HttpResponse response;
+  RETURN_IF_ERROR(FetchUrl(url, {}, false, &response));
+  if (response.status != 200) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to fetch config.pbtxt of " + location + ": HTTP " +
+         std::to_string(response.status))
+            .c_str());
+  }
+  std::map<std::string, std::string> parameters;
+  if (!AgentParameters(response.body, &parameters)) {
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_VERBOSE,
+        ("dragonfly: " + location + " does not use the agent, not prefetched")
+            .c_str());
+    return nullptr;
+  }
+  DragonflyConfig config = file_config;
+  RETURN_IF_ERROR(config.ApplyParameters(parameters));
+
+  Staging staging(temp_dir, location);
+  bool claimed = false;
+  RETURN_IF_ERROR(staging.Claim(false /* fallback */, &claimed));
+  if (!claimed) {
+    return nullptr;
+  }
+  const std::string files_dir = JoinPath({staging.Dir(), "files"});
+  StagingJournal* journal = &staging.Journal();
+  SharedCache cache(config.cache_dir, config.cache_max_size, staging.Dir());
+  RETURN_IF_ERROR(MakeDirectory(files_dir));
+  for (PathTree::NodeId node = 0; node < tree.NodeCount(); ++node) {
+    if (listing.IsDirectory(node)) {
+      RETURN_IF_ERROR(MakeDirectory(JoinPath({files_dir, tree.Path(node)})));
+    }
+  }
+  // The config.pbtxt fetched above is staged as it is
+  if (response.body.size() == listing.Size(model_config)) {
+    const std::string path = JoinPath({files_dir, "config.pbtxt"});
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (fp != nullptr) {
+      const bool written =
+          (fwrite(response.body.data(), 1, response.body.size(), fp) ==
+           response.body.size());
+      if ((fclose(fp) == 0) && written) {
+        journal->Record(path, CacheKey(listing, model_config));
+      }
+    }
+  }
+
+  TransferEngine engine(config);
+  RETURN_IF_ERROR(StageFiles(
+      fs, listing, 0, listing.FileCount(), files_dir, config, &cache, journal,
+      [&engine](TransferRequest request) -> TRITONSERVER_Error* {
+        engine.Add(std::move(request));
+        return nullptr;
+      }));
+  RETURN_IF_ERROR(engine.Run());
+  cache.Evict();
+  return nullptr;
+}
+
+// Background downloads of the composing models of an ensemble. Once an
+// ensemble is loaded, Triton loads the models its steps run one after
+// another, each a cold listing and download; the prefetcher starts on them
+// in step order, one model at a time, as soon as the ensemble is in place.
+// A load never races a prefetch of its own model: it takes a model off the
+// queue, or waits for the one running to finish and then finds its files
+// staged. The staging directories of prefetched models that are not loaded
+// by the time the prefetcher stops are removed then.
+class Prefetcher {
+ public:
+  // Queue the models at 'locations' for download into the staging
+  // directories their loads will use next to 'temp_dir', see Staging, each
+  // with its own parameters on top of 'config'. Models being loaded, loaded
+  // before or queued already are left out.
+  void Start(
+      const std::shared_ptr<FileSystem>& fs,
+      const std::vector<std::string>& locations, const std::string& temp_dir,
+      const DragonflyConfig& config);
+
+  // Called around the load of 'location'
+  void BeginLoad(const std::string& location);
+  void EndLoad(const std::string& location, bool loaded);
+
+  // Drop the queue, cancel the running download and remove what no load
+  // used
+  void Stop();
+
+ private:
+  struct Job {
+    std::shared_ptr<FileSystem> fs;
+    std::string location;
+    std::string temp_dir;
+    DragonflyConfig config;
+  };
+
+  void Run();
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<Job> queue_;
+  // Location of the running download, empty when idle
+  std::string running_;
+  std::set<std::string> loading_;
+  // Models this process loaded, which need no prefetch
+  std::set<std::string> loaded_;
+  // Staging directory of the models prefetched since they were last loaded,
+  // by location
+  std::map<std::string, std::string> prefetched_;
+  bool stopping_ = false;
+  // Set to abort the running download, see ScopedCancel
+  std::atomic<bool> cancel_{false};
+  std::thread worker_;
+};
+
+void
+Prefetcher::Start(
+    const std::shared_ptr<FileSystem>& fs,
+    const std::vector<std::string>& locations, const std::string& temp_dir,
+    const DragonflyConfig& config)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  for (const auto& location : locations) {
+    if ((location == running_) || (loading_.count(location) > 0) ||
+        (loaded_.count(location) > 0) ||
+        std::any_of(queue_.begin(), queue_.end(), [&location](const Job& job) {
+          return job.location == location;
+        })) {
+      continue;
+    }
+    queue_.push_back({fs, location, temp_dir, config});
+  }
+  if (!worker_.joinable()) {
+    worker_ = std::thread(&Prefetcher::Run, this);
+  }
+  cv_.notify_all();
+}
+
+void
+Prefetcher::BeginLoad(const std::string& location)
+{
+  std::unique_lock<std::mutex> lock(mu_);
+  queue_.erase(
+      std::remove_if(
+          queue_.begin(), queue_.end(),
+          [&location](const Job& job) { return job.location == location; }),
+      queue_.end());
+  cv_.wait(lock, [this, &location]() { return running_ != location; });
+  loading_.insert(location);
+  prefetched_.erase(location);
+}
+
+void
+Prefetcher::EndLoad(const std::string& location, bool loaded)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  loading_.erase(location);
+  if (loaded) {
+    loaded_.insert(location);
+  }
+}
+
+void
+Prefetcher::Stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    queue_.clear();
+    stopping_ = true;
+  }
+  cancel_ = true;
+  cv_.notify_all();
+  if (worker_.joinable()) {
+    worker_.join();
+  }
+  cancel_ = false;
+
+  std::map<std::string, std::string> prefetched;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stopping_ = false;
+    prefetched.swap(prefetched_);
+  }
+  for (const auto& model : prefetched) {
+    // A load of the model holds its directory and keeps it
+    Staging staging(model.second, model.first);
+    bool claimed = false;
+    TRITONSERVER_Error* err = staging.Claim(false /* fallback */, &claimed);
+    if (err != nullptr) {
+      TRITONSERVER_ErrorDelete(err);
+    } else if (claimed) {
+      staging.Release(true /* committed */);
+    }
+  }
+}
+
+void
+Prefetcher::Run()
+{
+  ScopedCancel scoped_cancel(&cancel_);
+  std::unique_lock<std::mutex> lock(mu_);
+  while (true) {
+    cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+    if (stopping_) {
+      return;
+    }
+    Job job = std::move(queue_.front());
+    queue_.pop_front();
+    running_ = job.location;
+    lock.unlock();
+
+    TRITONSERVER_Error* err =
+        PrefetchModel(*job.fs, job.location, job.temp_dir, job.config);
+    if (err != nullptr) {
+      // The load fetches whatever is missing
+      LOG_MESSAGE(
+          TRITONSERVER_LOG_WARN,
+          ("dragonfly: prefetch of " + job.location +
+           " failed: " + TRITONSERVER_ErrorMessage(err))
+              .c_str());
+      TRITONSERVER_ErrorDelete(err);
+    } else {
+      LOG_MESSAGE(
+          TRITONSERVER_LOG_VERBOSE,
+          ("dragonfly: prefetched " + job.location).c_str());
+    }
+
+    lock.lock();
+    // Even a failed prefetch may leave files staged
+    prefetched_[job.location] = job.temp_dir;
+    running_.clear();
+    cv_.notify_all();
+  }
+}
+
+Prefetcher&
+GetPrefetcher()
+{
+  static Prefetcher prefetcher;
+  return prefetcher;
+}
+
+// Queue the composing models of the ensemble just loaded from 'location'
+// into 'temp_dir' for prefetch, on top of the settings of the config file
+// 'config'. They are looked up next to it, in the same repository, so only
+// backends that know the repository of a model, see FileSystem::Repository(),
+// prefetch.
+void
+PrefetchEnsemble(
+    const std::shared_ptr<FileSystem>& fs, const std::string& location,
+    const std::string& temp_dir, const DragonflyConfig& config)
+{
+  std::string text;
+  TRITONSERVER_Error* err =
+      ReadLocalFile(JoinPath({temp_dir, "config.pbtxt"}), &text);
+  if (err != nullptr) {
+    TRITONSERVER_ErrorDelete(err);
+    return;
+  }
+  const std::vector<std::string> steps = EnsembleSteps(text);
+  if (steps.empty()) {
+    return;
+  }
+  std::string repository, model;
+  err = fs->Repository(location, &repository, &model);
+  if (err != nullptr) {
+    TRITONSERVER_ErrorDelete(err);
+    return;
+  }
+  if (repository.empty()) {
+    return;
+  }
+
+  std::vector<std::string> locations;
+  for (const auto& step : steps) {
+    // Names that would leave the repository are not models of it
+    if ((step != model) && (step.find('/') == std::string::npos) &&
+        (step != ".") && (step != "..")) {
+      locations.push_back(repository + '/' + step);
+    }
+  }
+  LOG_MESSAGE(
+      TRITONSERVER_LOG_INFO,
+      ("dragonfly: prefetching " + std::to_string(locations.size()) +
+       " composing models of " + location)
+          .c_str());
+  GetPrefetcher().Start(fs, locations, temp_dir, config);
+}
+
+}  // namespace triton::repoagent::dragonfly
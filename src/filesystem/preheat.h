@@ -0,0 +1,217 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "config.h"
+#include "curl/curl.h"
+#include "listing.h"
+#include "status.h"
+#include "trace.h"
+#include "transfer.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly {
+
+// Model versions this process already had preheated, so that only the first
+// load of a version, and not every reload, creates a manager job
+class PreheatRegistry {
+ public:
+  // Return false if 'key' was claimed before
+  bool Claim(const std::string& key);
+  // Let a later load try again after the job could not be created
+  void Release(const std::string& key);
+
+ private:
+  std::mutex mu_;
+  std::set<std::string> keys_;
+};
+
+bool
+PreheatRegistry::Claim(const std::string& key)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  return keys_.insert(key).second;
+}
+
+void
+PreheatRegistry::Release(const std::string& key)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  keys_.erase(key);
+}
+
+PreheatRegistry&
+GetPreheatRegistry()
+{
+  static PreheatRegistry registry;
+  return registry;
+}
+
+// Identity of the model version at 'location': every listed path, size,
+// ETag and checksum, so a new version is preheated even if it reuses the
+// location
+std::string
+PreheatKey(const std::string& location, const Listing& listing)
+{
+  size_t hash = 0;
+  auto combine = [&hash](size_t value) {
+    hash ^= value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+  };
+  std::string path;
+  for (Listing::FileId file = 0; file < listing.FileCount(); ++file) {
+    path.clear();
+    listing.Tree().AppendPath(listing.Node(file), &path);
+    combine(std::hash<std::string>()(path));
+    combine(std::hash<uint64_t>()(listing.Size(file)));
+    combine(std::hash<std::string_view>()(listing.ETag(file)));
+    combine(std::hash<std::string_view>()(listing.Sha256(file)));
+  }
+  char fingerprint[20];
+  snprintf(fingerprint, sizeof(fingerprint), "\n%016zx", hash);
+  return location + fingerprint;
+}
+
+// Create a Dragonfly manager preheat job for 'urls', so that seed peers pull
+// them from the origin while this node downloads. The job carries the tag,
+// application and filter of 'config', which make up the Dragonfly task ID,
+// so the peers' pieces serve this node and every other one, and the origin
+// headers the seed peers need to fetch the files themselves.
+TRITONSERVER_Error*
+Preheat(const std::vector<std::string>& urls, const DragonflyConfig& config)
+{
+  TraceSpan span("Preheat", "preheat");
+  span.Arg("urls", urls.size());
+
+  std::string body = "{\"type\":\"preheat\",\"args\":{\"type\":\"file\"";
+  body += ",\"urls\":[";
+  for (size_t i = 0; i < urls.size(); ++i) {
+    body += ((i == 0) ? "\"" : ",\"") + JsonEscape(urls[i]) + "\"";
+  }
+  body += "]";
+  std::string filter;
+  for (const auto& param : config.filter) {
+    filter += (filter.empty() ? "" : "&") + param;
+  }
+  if (!filter.empty()) {
+    body += ",\"filtered_query_params\":\"" + JsonEscape(filter) + "\"";
+  }
+  for (const auto& arg :
+       {std::make_pair("tag", "X-Dragonfly-Tag"),
+        std::make_pair("application", "X-Dragonfly-Application")}) {
+    const auto itr = config.headers.find(arg.second);
+    if (itr != config.headers.end()) {
+      body += ",\"" + std::string(arg.first) + "\":\"" +
+              JsonEscape(itr->second) + "\"";
+    }
+  }
+  if (!config.origin_headers.empty()) {
+    body += ",\"headers\":{";
+    bool first = true;
+    for (const auto& header : config.origin_headers) {
+      body += (first ? "\"" : ",\"") + JsonEscape(header.first) + "\":\"" +
+              JsonEscape(header.second) + "\"";
+      first = false;
+    }
+    body += "}";
+  }
+  body += "}}";
+
+  CURL* curl = curl_easy_init();
+  if (!curl) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL, "Failed to initialize curl.");
+  }
+  struct curl_slist* headers =
+      curl_slist_append(nullptr, "Content-Type: application/json");
+  if (!config.preheat_token.empty()) {
+    headers = curl_slist_append(
+        headers, ("Authorization: Bearer " + config.preheat_token).c_str());
+  }
+  HttpResponse response;
+  curl_easy_setopt(curl, CURLOPT_URL, config.preheat_url.c_str());
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, static_cast<long>(body.size()));
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  // The job is only queued by the manager, a slow one must not hold up the
+  // load it is meant to speed up
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, 2000L);
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 5000L);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, HttpResponseBody);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+  if (GetConnectionPool()) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, GetConnectionPool()->Share());
+  }
+
+  CURLcode res = curl_easy_perform(curl);
+  if (res == CURLE_OK) {
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.status);
+    span.Arg("status", response.status);
+  }
+  curl_slist_free_all(headers);
+  curl_easy_cleanup(curl);
+  if (res != CURLE_OK) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_UNAVAILABLE,
+        ("Failed to reach " + config.preheat_url + ": " +
+         curl_easy_strerror(res))
+            .c_str());
+  }
+  if ((response.status < 200) || (response.status >= 300)) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_UNAVAILABLE,
+        ("Preheat job rejected with HTTP " + std::to_string(response.status) +
+         ": " + response.body.substr(0, 256))
+            .c_str());
+  }
+  return nullptr;
+}
+
+// Preheat the model version 'key' once per process. Failures are only
+// logged, the load goes on without the seed peers.
+void
+PreheatModel(
+    const std::string& key, const std::string& location,
+    const std::vector<std::string>& urls, const DragonflyConfig& config)
+{
+  TRITONSERVER_Error* err = Preheat(urls, config);
+  if (err != nullptr) {
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_WARN,
+        ("dragonfly: preheat of " + location +
+         " failed: " + TRITONSERVER_ErrorMessage(err))
+            .c_str());
+    TRITONSERVER_ErrorDelete(err);
+    GetPreheatRegistry().Release(key);
+    return;
+  }
+  LOG_MESSAGE(
+      TRITONSERVER_LOG_INFO,
+      ("dragonfly: preheating " + std::to_string(urls.size()) +
+       " files of " + location)
+          .c_str());
+}
+
+}  // namespace triton::repoagent::dragonfly
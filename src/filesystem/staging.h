@@ -0,0 +1,377 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "common_utils.h"
+#include "status.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly {
+
+#define STAGING_PREFIX ".dragonfly-staging-"
+
+// Hidden directory next to 'temp_dir' that a model is downloaded into before
+// it is committed. It is named after the location rather than 'temp_dir', so
+// a failed load leaves the files it completed to the next attempt, and it is
+// on the same filesystem so the commit is a set of renames.
+std::string
+StagingDir(const std::string& temp_dir, const std::string& location)
+{
+  std::string parent = temp_dir;
+  while ((parent.size() > 1) && (parent.back() == '/')) {
+    parent.pop_back();
+  }
+  const size_t slash = parent.find_last_of('/');
+  parent = (slash == std::string::npos) ? "." : parent.substr(0, slash + 1);
+
+  char name[sizeof(STAGING_PREFIX) + 16];
+  snprintf(
+      name, sizeof(name), STAGING_PREFIX "%016zx",
+      std::hash<std::string>()(location));
+  return JoinPath({parent, name});
+}
+
+// Objects whose download completed in a staging directory, by the path they
+// were staged at, see CacheKey(). A file an earlier attempt staged is only
+// reused for the same object, not for a replacement of the same size.
+// Objects without a key are only known complete to the load that
+// downloaded them.
+class StagingJournal {
+ public:
+  ~StagingJournal();
+
+  // Read the journal kept in 'staging' and append to it
+  void Open(const std::string& staging);
+
+  // Whether 'path' holds the complete object 'key' of 'size' bytes
+  bool Staged(const std::string& path, const std::string& key, uint64_t size);
+
+  // Record that the object 'key' was downloaded to 'path'
+  void Record(const std::string& path, const std::string& key);
+
+  // Record that 'path' is about to be overwritten
+  void Forget(const std::string& path);
+
+  // Whether no download a later attempt can reuse completed
+  bool Empty();
+
+ private:
+  void Write(const std::string& path, const std::string& key);
+
+  std::mutex mu_;
+  FILE* file_ = nullptr;
+  std::map<std::string, std::string> keys_;
+};
+
+StagingJournal::~StagingJournal()
+{
+  if (file_ != nullptr) {
+    fclose(file_);
+  }
+}
+
+void
+StagingJournal::Open(const std::string& staging)
+{
+  // One "<key> <path>" line per record, "-" once the path is overwritten
+  const std::string path = JoinPath({staging, "journal"});
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    const size_t space = line.find(' ');
+    if (space == std::string::npos) {
+      continue;
+    }
+    const std::string key = line.substr(0, space);
+    if (key == "-") {
+      keys_.erase(line.substr(space + 1));
+    } else {
+      keys_[line.substr(space + 1)] = key;
+    }
+  }
+  file_ = fopen(path.c_str(), "ae");
+}
+
+bool
+StagingJournal::Staged(
+    const std::string& path, const std::string& key, uint64_t size)
+{
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    const auto itr = keys_.find(path);
+    if ((itr == keys_.end()) || (itr->second != key)) {
+      return false;
+    }
+  }
+  struct stat st;
+  return (stat(path.c_str(), &st) == 0) && S_ISREG(st.st_mode) &&
+         (static_cast<uint64_t>(st.st_size) == size);
+}
+
+void
+StagingJournal::Record(const std::string& path, const std::string& key)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  keys_[path] = key;
+  if (!key.empty()) {
+    Write(path, key);
+  }
+}
+
+void
+StagingJournal::Forget(const std::string& path)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  const auto itr = keys_.find(path);
+  if (itr == keys_.end()) {
+    return;
+  }
+  const bool written = !itr->second.empty();
+  keys_.erase(itr);
+  if (written) {
+    Write(path, "-");
+  }
+}
+
+bool
+StagingJournal::Empty()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  for (const auto& entry : keys_) {
+    if (!entry.second.empty()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void
+StagingJournal::Write(const std::string& path, const std::string& key)
+{
+  // A path that does not fit on one line is not reused
+  if ((file_ == nullptr) || (path.find('\n') != std::string::npos)) {
+    return;
+  }
+  fprintf(file_, "%s %s\n", key.c_str(), path.c_str());
+  fflush(file_);
+}
+
+// One load's claim on the directory it stages a model in. The directory
+// named after the location, see StagingDir(), is shared by the processes of
+// the host, so a load holds an exclusive flock() on the 'lock' file in it
+// while it stages there. A load that finds it held by another stages in a
+// directory of its own instead, which never outlives the load.
+//
+// A failed load keeps the shared directory for the next attempt if it
+// completed any download. Directories no load holds that were last claimed
+// more than kExpirySeconds ago are removed by the next load staged next to
+// them, which covers failed loads that are not retried and processes that
+// died.
+class Staging {
+ public:
+  static constexpr time_t kExpirySeconds = 60 * 60;
+
+  // Stage the model at 'location' loaded into 'temp_dir'
+  Staging(const std::string& temp_dir, const std::string& location);
+  // Releases the claim of a load whose files were not committed
+  ~Staging();
+
+  Staging(const Staging&) = delete;
+  Staging& operator=(const Staging&) = delete;
+
+  // Claim the shared directory, or with 'fallback' a private one when
+  // another load holds it. '*claimed' is false when nothing was claimed.
+  TRITONSERVER_Error* Claim(bool fallback, bool* claimed);
+
+  // End the claim. The directory is removed once its files were
+  // 'committed', or else when it is private or nothing completed in it.
+  void Release(bool committed);
+
+  const std::string& Dir() const { return dir_; }
+  StagingJournal& Journal() { return journal_; }
+
+ private:
+  // Take the lock of 'dir', '*busy' when another load holds it
+  TRITONSERVER_Error* Lock(const std::string& dir, bool* busy);
+  // Remove the expired directories next to this one
+  void Expire();
+
+  std::string shared_;
+  std::string dir_;
+  bool private_ = false;
+  int fd_ = -1;
+  StagingJournal journal_;
+};
+
+Staging::Staging(const std::string& temp_dir, const std::string& location)
+    : shared_(StagingDir(temp_dir, location))
+{
+}
+
+Staging::~Staging()
+{
+  Release(false /* committed */);
+}
+
+TRITONSERVER_Error*
+Staging::Claim(bool fallback, bool* claimed)
+{
+  *claimed = false;
+  Expire();
+  bool busy = false;
+  RETURN_IF_ERROR(Lock(shared_, &busy));
+  if (busy) {
+    if (!fallback) {
+      return nullptr;
+    }
+    static std::atomic<uint64_t> count(0);
+    const std::string dir = shared_ + "-" + std::to_string(getpid()) + "-" +
+                            std::to_string(++count);
+    RETURN_IF_ERROR(Lock(dir, &busy));
+    if (busy) {
+      return nullptr;
+    }
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_VERBOSE,
+        ("dragonfly: " + shared_ + " is in use, staging in " + dir).c_str());
+    private_ = true;
+    dir_ = dir;
+  } else {
+    dir_ = shared_;
+  }
+  journal_.Open(dir_);
+  *claimed = true;
+  return nullptr;
+}
+
+void
+Staging::Release(bool committed)
+{
+  if (fd_ < 0) {
+    return;
+  }
+  if (committed || private_ || journal_.Empty()) {
+    TRITONSERVER_Error* err = RemoveAll(dir_);
+    if (err != nullptr) {
+      LOG_MESSAGE(TRITONSERVER_LOG_WARN, TRITONSERVER_ErrorMessage(err));
+      TRITONSERVER_ErrorDelete(err);
+    }
+  }
+  close(fd_);
+  fd_ = -1;
+}
+
+TRITONSERVER_Error*
+Staging::Lock(const std::string& dir, bool* busy)
+{
+  *busy = false;
+  const std::string lock_path = JoinPath({dir, "lock"});
+  // The load that held the lock may remove the directory before this one
+  // gets it, then the lock is taken on the directory created again
+  for (int attempt = 0; attempt < 3; ++attempt) {
+    RETURN_IF_ERROR(MakeDirectory(dir));
+    const int fd =
+        open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      if (errno == ENOENT) {
+        continue;
+      }
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INTERNAL,
+          ("Failed to open " + lock_path + ", errno:" + strerror(errno))
+              .c_str());
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+      close(fd);
+      *busy = true;
+      return nullptr;
+    }
+    struct stat fd_st, path_st;
+    if ((fstat(fd, &fd_st) == 0) && (stat(lock_path.c_str(), &path_st) == 0) &&
+        (fd_st.st_dev == path_st.st_dev) && (fd_st.st_ino == path_st.st_ino)) {
+      // Claimed now, for expiry
+      futimens(fd, nullptr);
+      fd_ = fd;
+      return nullptr;
+    }
+    close(fd);
+  }
+  *busy = true;
+  return nullptr;
+}
+
+void
+Staging::Expire()
+{
+  const std::string parent = shared_.substr(0, shared_.find_last_of('/'));
+  DIR* entries = opendir(parent.empty() ? "/" : parent.c_str());
+  if (entries == nullptr) {
+    return;
+  }
+  const time_t now = time(nullptr);
+  const size_t prefix_size = strlen(STAGING_PREFIX);
+  while (struct dirent* entry = readdir(entries)) {
+    if (strncmp(entry->d_name, STAGING_PREFIX, prefix_size) != 0) {
+      continue;
+    }
+    const std::string dir = JoinPath({parent, entry->d_name});
+    const std::string lock_path = JoinPath({dir, "lock"});
+    // A directory without a lock file was never claimed, or is being
+    // claimed right now
+    struct stat st;
+    if (((stat(lock_path.c_str(), &st) != 0) &&
+         (stat(dir.c_str(), &st) != 0)) ||
+        !(now - st.st_mtime > kExpirySeconds)) {
+      continue;
+    }
+    const int fd =
+        open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      continue;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+      LOG_MESSAGE(
+          TRITONSERVER_LOG_INFO,
+          ("dragonfly: removing expired staging directory " + dir).c_str());
+      TRITONSERVER_Error* err = RemoveAll(dir);
+      if (err != nullptr) {
+        TRITONSERVER_ErrorDelete(err);
+      }
+    }
+    close(fd);
+  }
+  closedir(entries);
+}
+
+}  // namespace triton::repoagent::dragonfly
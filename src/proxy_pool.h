@@ -0,0 +1,403 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+#include "curl/curl.h"
+#include "status.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly {
+
+// Endpoint a request was sent through, see ProxyPool::Acquire()
+struct ProxyLease {
+  // Entry of 'proxies', empty to go straight to the origin
+  std::string endpoint;
+  // Trial request of an endpoint whose breaker is half open
+  bool trial = false;
+};
+
+// How a request through a ProxyLease ended
+enum class ProxyOutcome {
+  // The endpoint answered, even if the origin turned the request away
+  kSuccess,
+  // The endpoint could not be reached, reset the connection, timed out or
+  // answered 502, 503 or 504
+  kFailure,
+  // Says nothing about the endpoint, e.g. the request was stopped or the
+  // origin turned it away
+  kNone,
+};
+
+// Process-wide set of the Dragonfly proxy endpoints in 'proxies'. Each
+// request goes to the endpoint with the fewest outstanding requests,
+// weighted by its recent time to first byte. Every endpoint has a circuit
+// breaker: it opens after a few failures in a row, or a failed health probe,
+// and the endpoint gets no requests until the cool-down is over or a health
+// probe connects to it again. Then a single trial request decides whether it
+// closes again or stays open for twice as long, since a proxy that accepts
+// connections may still fail requests. When every breaker is open,
+// requests go straight to the origin if 'proxy_direct_fallback' is set, and
+// to the endpoint due to recover first otherwise.
+class ProxyPool {
+ public:
+  ~ProxyPool() { Stop(); }
+
+  // Use 'endpoints', keeping the state of the ones already known, and probe
+  // them every 'health_interval_ms' (0 disables probing). An empty list
+  // turns the pool off.
+  void Configure(
+      const std::vector<std::string>& endpoints, uint64_t health_interval_ms,
+      bool direct_fallback);
+  bool Enabled();
+
+  // Endpoint for the next request. 'exclude' is an endpoint that just
+  // failed the request; with 'origin' set, the origin is preferred over
+  // 'exclude' and over open breakers, as for hedges.
+  ProxyLease Acquire(const std::string& exclude = "", bool origin = false);
+  // Report how a request through 'lease' ended, 'ttfb' in seconds on
+  // success
+  void Release(ProxyLease* lease, ProxyOutcome outcome, double ttfb = 0);
+
+  // Stop the health probes, before libcurl is cleaned up
+  void Stop();
+
+ private:
+  // Failures in a row that open a breaker
+  static constexpr size_t kFailureThreshold = 3;
+  // Cool-down of a breaker that just opened, and at most after failed trials
+  static constexpr double kMinCooldownSeconds = 5.0;
+  static constexpr double kMaxCooldownSeconds = 120.0;
+  // Weight of the latest sample in the latency average
+  static constexpr double kLatencyWeight = 0.2;
+
+  enum class State { kClosed, kOpen, kHalfOpen };
+
+  struct Endpoint {
+    std::string name;
+    State state = State::kClosed;
+    size_t outstanding = 0;
+    size_t failures = 0;
+    // Moving average of time to first byte or probe connect time, seconds
+    double latency = 0;
+    double cooldown = kMinCooldownSeconds;
+    std::chrono::steady_clock::time_point open_until;
+    bool trial_in_flight = false;
+  };
+
+  Endpoint* Find(const std::string& name);
+  void RecordLatency(Endpoint* endpoint, double seconds);
+  void Open(Endpoint* endpoint, const std::string& reason);
+  void Close(Endpoint* endpoint);
+  void ProbeLoop();
+  // Open a connection to 'endpoint', returning the connect time in seconds
+  // or a negative value if it failed
+  static double Probe(const std::string& endpoint);
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::vector<Endpoint> endpoints_;
+  uint64_t health_interval_ms_ = 0;
+  bool direct_fallback_ = false;
+  std::thread prober_;
+  bool stopping_ = false;
+};
+
+void
+ProxyPool::Configure(
+    const std::vector<std::string>& endpoints, uint64_t health_interval_ms,
+    bool direct_fallback)
+{
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    direct_fallback_ = direct_fallback;
+    health_interval_ms_ = health_interval_ms;
+    std::vector<Endpoint> configured;
+    for (const auto& name : endpoints) {
+      Endpoint* known = Find(name);
+      if (known != nullptr) {
+        configured.push_back(*known);
+      } else {
+        configured.emplace_back();
+        configured.back().name = name;
+      }
+    }
+    endpoints_.swap(configured);
+    cv_.notify_all();
+    if (prober_.joinable() || endpoints_.empty() ||
+        (health_interval_ms_ == 0)) {
+      return;
+    }
+    stopping_ = false;
+  }
+  prober_ = std::thread(&ProxyPool::ProbeLoop, this);
+}
+
+bool
+ProxyPool::Enabled()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  return !endpoints_.empty();
+}
+
+ProxyLease
+ProxyPool::Acquire(const std::string& exclude, bool origin)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  const auto now = std::chrono::steady_clock::now();
+  Endpoint* best = nullptr;
+  Endpoint* excluded = nullptr;
+  Endpoint* recovering = nullptr;
+  double best_score = 0;
+  for (auto& endpoint : endpoints_) {
+    if ((endpoint.state == State::kOpen) && (now >= endpoint.open_until)) {
+      endpoint.state = State::kHalfOpen;
+    }
+    const bool available =
+        (endpoint.state == State::kClosed) ||
+        ((endpoint.state == State::kHalfOpen) && !endpoint.trial_in_flight);
+    if (!available) {
+      if ((recovering == nullptr) ||
+          (endpoint.open_until < recovering->open_until)) {
+        recovering = &endpoint;
+      }
+      continue;
+    }
+    if (endpoint.name == exclude) {
+      excluded = &endpoint;
+      continue;
+    }
+    // Unmeasured endpoints count as fast so that they get tried
+    const double score = (endpoint.outstanding + 1) *
+                         std::max(endpoint.latency, 0.001);
+    if ((best == nullptr) || (score < best_score)) {
+      best = &endpoint;
+      best_score = score;
+    }
+  }
+
+  ProxyLease lease;
+  if (best == nullptr) {
+    if (origin || direct_fallback_ || endpoints_.empty()) {
+      return lease;
+    }
+    best = (excluded != nullptr) ? excluded : recovering;
+  }
+  lease.endpoint = best->name;
+  lease.trial = (best->state == State::kHalfOpen);
+  best->trial_in_flight = best->trial_in_flight || lease.trial;
+  ++best->outstanding;
+  return lease;
+}
+
+void
+ProxyPool::Release(ProxyLease* lease, ProxyOutcome outcome, double ttfb)
+{
+  if (lease->endpoint.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mu_);
+  Endpoint* endpoint = Find(lease->endpoint);
+  const bool trial = lease->trial;
+  lease->endpoint.clear();
+  lease->trial = false;
+  if (endpoint == nullptr) {
+    // Removed from the config meanwhile
+    return;
+  }
+  endpoint->outstanding -= std::min<size_t>(endpoint->outstanding, 1);
+  if (trial) {
+    endpoint->trial_in_flight = false;
+  }
+
+  switch (outcome) {
+    case ProxyOutcome::kSuccess:
+      RecordLatency(endpoint, ttfb);
+      endpoint->failures = 0;
+      if (endpoint->state != State::kClosed) {
+        Close(endpoint);
+      }
+      break;
+    case ProxyOutcome::kFailure:
+      ++endpoint->failures;
+      if (endpoint->state == State::kHalfOpen) {
+        // The trial failed, back off further
+        endpoint->cooldown =
+            std::min(endpoint->cooldown * 2, kMaxCooldownSeconds);
+        Open(endpoint, "trial request failed");
+      } else if (
+          (endpoint->state == State::kClosed) &&
+          (endpoint->failures >= kFailureThreshold)) {
+        Open(
+            endpoint,
+            std::to_string(endpoint->failures) + " failed requests in a row");
+      }
+      break;
+    case ProxyOutcome::kNone:
+      break;
+  }
+}
+
+void
+ProxyPool::Stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stopping_ = true;
+    cv_.notify_all();
+  }
+  if (prober_.joinable()) {
+    prober_.join();
+  }
+}
+
+ProxyPool::Endpoint*
+ProxyPool::Find(const std::string& name)
+{
+  for (auto& endpoint : endpoints_) {
+    if (endpoint.name == name) {
+      return &endpoint;
+    }
+  }
+  return nullptr;
+}
+
+void
+ProxyPool::RecordLatency(Endpoint* endpoint, double seconds)
+{
+  endpoint->latency =
+      (endpoint->latency == 0)
+          ? seconds
+          : (kLatencyWeight * seconds +
+             (1 - kLatencyWeight) * endpoint->latency);
+}
+
+void
+ProxyPool::Open(Endpoint* endpoint, const std::string& reason)
+{
+  endpoint->state = State::kOpen;
+  endpoint->open_until =
+      std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(
+          static_cast<int64_t>(endpoint->cooldown * 1000));
+  LOG_MESSAGE(
+      TRITONSERVER_LOG_WARN,
+      ("dragonfly: proxy " + endpoint->name + " marked down for " +
+       std::to_string(static_cast<uint64_t>(endpoint->cooldown)) + "s (" +
+       reason + ")")
+          .c_str());
+}
+
+void
+ProxyPool::Close(Endpoint* endpoint)
+{
+  endpoint->state = State::kClosed;
+  endpoint->failures = 0;
+  endpoint->cooldown = kMinCooldownSeconds;
+  LOG_MESSAGE(
+      TRITONSERVER_LOG_INFO,
+      ("dragonfly: proxy " + endpoint->name + " is back up").c_str());
+}
+
+void
+ProxyPool::ProbeLoop()
+{
+  std::unique_lock<std::mutex> lock(mu_);
+  while (!stopping_) {
+    if (endpoints_.empty() || (health_interval_ms_ == 0)) {
+      // Turned off by a later config, wait for one that turns it back on
+      cv_.wait(lock, [this] {
+        return stopping_ || (!endpoints_.empty() && (health_interval_ms_ > 0));
+      });
+      continue;
+    }
+    std::vector<std::string> names;
+    for (const auto& endpoint : endpoints_) {
+      names.push_back(endpoint.name);
+    }
+    lock.unlock();
+    std::vector<double> results;
+    for (const auto& name : names) {
+      results.push_back(Probe(name));
+    }
+    lock.lock();
+
+    for (size_t i = 0; i < names.size(); ++i) {
+      Endpoint* endpoint = Find(names[i]);
+      if (endpoint == nullptr) {
+        continue;
+      }
+      if (results[i] < 0) {
+        if (endpoint->state == State::kClosed) {
+          Open(endpoint, "health probe failed");
+        }
+        continue;
+      }
+      RecordLatency(endpoint, results[i]);
+      if (endpoint->state == State::kOpen) {
+        // Reachable again, let the next request find out if it works
+        endpoint->state = State::kHalfOpen;
+      }
+    }
+    cv_.wait_for(
+        lock, std::chrono::milliseconds(health_interval_ms_),
+        [this] { return stopping_; });
+  }
+}
+
+double
+ProxyPool::Probe(const std::string& endpoint)
+{
+  std::string proxy, unix_socket;
+  SplitProxyEndpoint(endpoint, &proxy, &unix_socket);
+  CURL* curl = curl_easy_init();
+  if (curl == nullptr) {
+    return -1;
+  }
+  // Just connect, to the proxy itself rather than through it
+  curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, 2000L);
+  if (!unix_socket.empty()) {
+    curl_easy_setopt(curl, CURLOPT_URL, "http://localhost/");
+    curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, unix_socket.c_str());
+  } else {
+    curl_easy_setopt(curl, CURLOPT_URL, proxy.c_str());
+  }
+  const CURLcode res = curl_easy_perform(curl);
+  curl_off_t connect_us = 0;
+  curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect_us);
+  curl_easy_cleanup(curl);
+  return (res == CURLE_OK) ? (connect_us / 1e6) : -1;
+}
+
+ProxyPool&
+GetProxyPool()
+{
+  static ProxyPool pool;
+  return pool;
+}
+
+}  // namespace triton::repoagent::dragonfly
@@ -0,0 +1,172 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#include "scheduler.h"
+
+namespace triton::repoagent::dragonfly {
+
+// Token bucket shared by every in-flight transfer. Callers are charged after
+// the fact and block while the bucket is in debt, which keeps the average
+// rate at the configured limit without per-transfer bookkeeping. A rate of 0
+// disables the limit. While callers wait, the bucket goes to them in the
+// order of a FairShare between their flows.
+class TokenBucket {
+ public:
+  void SetRate(uint64_t bytes_per_second);
+  void Acquire(uint64_t bytes, FlowId flow = 0, double weight = 1);
+
+  // Acquire() for a caller that holds its transfer instead of blocking:
+  // charge 'bytes' and return true if 'flow' may go on now, or else queue
+  // it and return false with the time to hold it in 'wait' before trying
+  // again. A flow that stops trying must Cancel().
+  bool TryAcquire(
+      uint64_t bytes, FlowId flow, double weight,
+      std::chrono::steady_clock::duration* wait);
+  void Cancel(FlowId flow);
+
+ private:
+  void Refill();
+
+  // Bounds of the hold TryAcquire() asks for, short enough to keep up with
+  // the rate since the bucket refills meanwhile
+  static constexpr double kMinHoldSeconds = 0.005;
+  static constexpr double kMaxHoldSeconds = 0.1;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  uint64_t rate_ = 0;
+  double tokens_ = 0;
+  std::chrono::steady_clock::time_point last_refill_;
+  FairShare fair_;
+};
+
+void
+TokenBucket::SetRate(uint64_t bytes_per_second)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  if (rate_ == bytes_per_second) {
+    return;
+  }
+  Refill();
+  rate_ = bytes_per_second;
+  last_refill_ = std::chrono::steady_clock::now();
+  // Waiters recompute their delay against the new rate
+  cv_.notify_all();
+}
+
+void
+TokenBucket::Refill()
+{
+  const auto now = std::chrono::steady_clock::now();
+  if (rate_ != 0) {
+    // Allow bursts of up to 100ms worth of traffic
+    const double burst = std::max<double>(rate_ / 10.0, 64 * 1024);
+    const double elapsed =
+        std::chrono::duration<double>(now - last_refill_).count();
+    tokens_ = std::min(burst, tokens_ + elapsed * rate_);
+  }
+  last_refill_ = now;
+}
+
+void
+TokenBucket::Acquire(uint64_t bytes, FlowId flow, double weight)
+{
+  std::unique_lock<std::mutex> lock(mu_);
+  if (rate_ == 0) {
+    return;
+  }
+
+  Refill();
+  if ((tokens_ < 0) || !fair_.Empty()) {
+    // Contended: wait until the debt is paid and this flow is next
+    fair_.Wait(flow, weight);
+    while ((rate_ != 0) && ((tokens_ < 0) || !fair_.IsNext(flow))) {
+      const auto delay =
+          std::chrono::duration<double>(std::max(-tokens_, 0.0) / rate_);
+      cv_.wait_for(
+          lock, std::min<std::chrono::duration<double>>(
+                    std::max<std::chrono::duration<double>>(
+                        delay, std::chrono::milliseconds(1)),
+                    std::chrono::milliseconds(100)));
+      Refill();
+    }
+  }
+  fair_.Serve(flow, weight, bytes);
+  if (rate_ == 0) {
+    tokens_ = 0;
+  } else {
+    tokens_ -= bytes;
+  }
+  // The next flow waits for the debt of this one
+  cv_.notify_all();
+}
+
+bool
+TokenBucket::TryAcquire(
+    uint64_t bytes, FlowId flow, double weight,
+    std::chrono::steady_clock::duration* wait)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  if (rate_ == 0) {
+    return true;
+  }
+
+  Refill();
+  if ((tokens_ < 0) || !fair_.IsNext(flow)) {
+    fair_.Wait(flow, weight);
+    const double seconds = std::min(
+        std::max(-tokens_ / rate_, kMinHoldSeconds), kMaxHoldSeconds);
+    *wait = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(seconds));
+    return false;
+  }
+  fair_.Serve(flow, weight, bytes);
+  tokens_ -= bytes;
+  cv_.notify_all();
+  return true;
+}
+
+void
+TokenBucket::Cancel(FlowId flow)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  fair_.Cancel(flow);
+  cv_.notify_all();
+}
+
+// Process-wide network and disk write budgets, set from the Dragonfly config
+// at server start, whenever the config file changes and on every model
+// load, so they can be tuned without a restart.
+struct BandwidthLimiter {
+  TokenBucket network;
+  TokenBucket disk;
+};
+
+BandwidthLimiter&
+GetBandwidthLimiter()
+{
+  static BandwidthLimiter limiter;
+  return limiter;
+}
+
+}  // namespace triton::repoagent::dragonfly
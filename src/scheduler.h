@@ -0,0 +1,167 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <vector>
+
+namespace triton::repoagent::dragonfly {
+
+// Model loads competing for a process-wide resource, such as the network
+// budget or the adaptive concurrency slots, are flows with a weight.
+using FlowId = uint64_t;
+
+// Id of a new flow. 0 is the shared flow of callers without one.
+FlowId
+NewFlowId()
+{
+  static std::atomic<FlowId> next{1};
+  return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Start-time fair queuing of one resource. A flow's virtual time advances
+// by what it was served divided by its weight, and a flow that was idle
+// starts at the virtual clock, so it cannot save up a share. While the
+// resource is contended, the waiting flow with the lowest start time is
+// served next, which gives every backlogged flow a share in proportion to
+// its weight. Not thread-safe, the owner of the resource locks it.
+class FairShare {
+ public:
+  // 'flow' waits for the resource, 'wake' (if any) is called once it is
+  // the next to be served. Waiting again updates the weight.
+  void Wait(FlowId flow, double weight, std::function<void()> wake = nullptr);
+  // 'flow' no longer waits without having been served
+  void Cancel(FlowId flow);
+
+  bool Empty() const { return waiting_.empty(); }
+  // Whether 'flow' is served next, true for any flow when none waits
+  bool IsNext(FlowId flow) const;
+
+  // Serve 'amount' to 'flow', which stops waiting, and wake the next
+  // waiting flow
+  void Serve(FlowId flow, double weight, double amount);
+  // Wake the next waiting flow, e.g. once the resource is free again
+  void WakeNext() const;
+
+ private:
+  // Virtual finish times are forgotten once the clock passes them, since
+  // the flow would start at the clock anyway
+  static constexpr size_t kMaxFinishTimes = 1024;
+
+  struct Waiter {
+    FlowId flow;
+    double start;
+    double weight;
+    std::function<void()> wake;
+  };
+
+  const Waiter* Next() const;
+  double StartTime(FlowId flow) const;
+
+  std::vector<Waiter> waiting_;
+  std::map<FlowId, double> finish_;
+  double clock_ = 0;
+};
+
+void
+FairShare::Wait(FlowId flow, double weight, std::function<void()> wake)
+{
+  for (auto& waiter : waiting_) {
+    if (waiter.flow == flow) {
+      waiter.weight = weight;
+      waiter.wake = std::move(wake);
+      return;
+    }
+  }
+  waiting_.push_back(Waiter{flow, StartTime(flow), weight, std::move(wake)});
+}
+
+void
+FairShare::Cancel(FlowId flow)
+{
+  const bool was_next = (Next() != nullptr) && (Next()->flow == flow);
+  waiting_.erase(
+      std::remove_if(
+          waiting_.begin(), waiting_.end(),
+          [flow](const Waiter& waiter) { return waiter.flow == flow; }),
+      waiting_.end());
+  if (was_next) {
+    WakeNext();
+  }
+}
+
+bool
+FairShare::IsNext(FlowId flow) const
+{
+  const Waiter* next = Next();
+  return (next == nullptr) || (next->flow == flow);
+}
+
+void
+FairShare::Serve(FlowId flow, double weight, double amount)
+{
+  double start = StartTime(flow);
+  for (auto itr = waiting_.begin(); itr != waiting_.end(); ++itr) {
+    if (itr->flow == flow) {
+      start = itr->start;
+      waiting_.erase(itr);
+      break;
+    }
+  }
+  clock_ = std::max(clock_, start);
+  finish_[flow] = start + amount / std::max(weight, 1e-6);
+  if (finish_.size() > kMaxFinishTimes) {
+    for (auto itr = finish_.begin(); itr != finish_.end();) {
+      itr = (itr->second <= clock_) ? finish_.erase(itr) : std::next(itr);
+    }
+  }
+  WakeNext();
+}
+
+void
+FairShare::WakeNext() const
+{
+  const Waiter* next = Next();
+  if ((next != nullptr) && next->wake) {
+    next->wake();
+  }
+}
+
+const FairShare::Waiter*
+FairShare::Next() const
+{
+  // Ties go to the flow that waited first
+  const Waiter* next = nullptr;
+  for (const auto& waiter : waiting_) {
+    if ((next == nullptr) || (waiter.start < next->start)) {
+      next = &waiter;
+    }
+  }
+  return next;
+}
+
+double
+FairShare::StartTime(FlowId flow) const
+{
+  auto itr = finish_.find(flow);
+  return (itr == finish_.end()) ? clock_ : std::max(clock_, itr->second);
+}
+
+}  // namespace triton::repoagent::dragonfly
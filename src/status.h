@@ -15,4 +15,16 @@ struct ErrorException {
       return rie_err__;                  \
     }                                    \
   } while (false)
+
+// Write MSG to the server log, dropping the error if logging fails
+#define LOG_MESSAGE(LEVEL, MSG)                                      \
+  do {                                                               \
+    if (TRITONSERVER_LogIsEnabled(LEVEL)) {                          \
+      TRITONSERVER_Error* lm_err__ =                                 \
+          TRITONSERVER_LogMessage(LEVEL, __FILE__, __LINE__, (MSG)); \
+      if (lm_err__ != nullptr) {                                     \
+        TRITONSERVER_ErrorDelete(lm_err__);                          \
+      }                                                              \
+    }                                                                \
+  } while (false)
 #endif  // STATUS_H
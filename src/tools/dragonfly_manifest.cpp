@@ -0,0 +1,200 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Writes the manifest of a local model directory, see
+// src/filesystem/manifest.h, so that uploaded next to the model files it
+// lets the agent skip listing the location:
+//
+//   dragonfly-manifest <model_dir> [<output>]
+//
+// The manifest goes to <model_dir>/.dragonfly-manifest.json unless
+// <output> is given, '-' for stdout.
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "openssl/evp.h"
+
+namespace {
+
+const char* const kManifestName = ".dragonfly-manifest.json";
+
+struct Entry {
+  // Relative to the model directory, with a trailing '/' for empty
+  // directories
+  std::string path;
+  uint64_t size = 0;
+  std::string sha256;
+};
+
+bool
+HashFile(const std::string& path, std::string* sha256)
+{
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (fp == nullptr) {
+    return false;
+  }
+  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+  bool ok = (ctx != nullptr) &&
+            (EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) == 1);
+  std::vector<char> buffer(1 << 20);
+  size_t n;
+  while (ok && ((n = fread(buffer.data(), 1, buffer.size(), fp)) > 0)) {
+    ok = (EVP_DigestUpdate(ctx, buffer.data(), n) == 1);
+  }
+  ok = ok && !ferror(fp);
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int size = 0;
+  ok = ok && (EVP_DigestFinal_ex(ctx, digest, &size) == 1);
+  EVP_MD_CTX_free(ctx);
+  fclose(fp);
+
+  static const char kHex[] = "0123456789abcdef";
+  sha256->clear();
+  for (unsigned int i = 0; ok && (i < size); ++i) {
+    *sha256 += kHex[digest[i] >> 4];
+    *sha256 += kHex[digest[i] & 0xf];
+  }
+  return ok;
+}
+
+// Add the files below 'dir' to 'entries', 'prefix' is the path of 'dir'
+// in the manifest
+bool
+Walk(
+    const std::string& dir, const std::string& prefix,
+    std::vector<Entry>* entries)
+{
+  DIR* d = opendir(dir.c_str());
+  if (d == nullptr) {
+    fprintf(stderr, "Failed to open %s: %s\n", dir.c_str(), strerror(errno));
+    return false;
+  }
+  std::vector<std::string> names;
+  while (struct dirent* entry = readdir(d)) {
+    const std::string name = entry->d_name;
+    if ((name != ".") && (name != "..") &&
+        !(prefix.empty() && (name == kManifestName))) {
+      names.push_back(name);
+    }
+  }
+  closedir(d);
+  std::sort(names.begin(), names.end());
+
+  if (names.empty() && !prefix.empty()) {
+    // Kept so the agent recreates it
+    entries->push_back(Entry{prefix, 0, ""});
+    return true;
+  }
+  for (const auto& name : names) {
+    const std::string path = dir + "/" + name;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+      fprintf(
+          stderr, "Failed to stat %s: %s\n", path.c_str(), strerror(errno));
+      return false;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      if (!Walk(path, prefix + name + "/", entries)) {
+        return false;
+      }
+    } else if (S_ISREG(st.st_mode)) {
+      Entry entry{prefix + name, static_cast<uint64_t>(st.st_size), ""};
+      if (!HashFile(path, &entry.sha256)) {
+        fprintf(stderr, "Failed to read %s\n", path.c_str());
+        return false;
+      }
+      entries->push_back(entry);
+    }
+  }
+  return true;
+}
+
+std::string
+JsonString(const std::string& value)
+{
+  std::string quoted = "\"";
+  for (const char c : value) {
+    if ((c == '"') || (c == '\\')) {
+      quoted += '\\';
+      quoted += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char code[8];
+      snprintf(code, sizeof(code), "\\u%04x", c);
+      quoted += code;
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "\"";
+}
+
+}  // namespace
+
+int
+main(int argc, char** argv)
+{
+  if ((argc < 2) || (argc > 3)) {
+    fprintf(stderr, "Usage: %s <model_dir> [<output>|-]\n", argv[0]);
+    return 2;
+  }
+  std::string dir = argv[1];
+  while ((dir.size() > 1) && (dir.back() == '/')) {
+    dir.pop_back();
+  }
+  const std::string output =
+      (argc == 3) ? argv[2] : (dir + "/" + kManifestName);
+
+  std::vector<Entry> entries;
+  if (!Walk(dir, "", &entries)) {
+    return 1;
+  }
+
+  std::string manifest = "{\"files\": [";
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const Entry& entry = entries[i];
+    manifest += (i == 0) ? "\n" : ",\n";
+    manifest += "  {\"path\": " + JsonString(entry.path) +
+                ", \"size\": " + std::to_string(entry.size);
+    if (!entry.sha256.empty()) {
+      manifest += ", \"sha256\": \"" + entry.sha256 + "\"";
+    }
+    manifest += "}";
+  }
+  manifest += "\n]}\n";
+
+  FILE* fp = (output == "-") ? stdout : fopen(output.c_str(), "w");
+  if (fp == nullptr) {
+    fprintf(
+        stderr, "Failed to open %s: %s\n", output.c_str(), strerror(errno));
+    return 1;
+  }
+  const bool written =
+      (fwrite(manifest.data(), 1, manifest.size(), fp) == manifest.size());
+  if (((fp == stdout) ? fflush(fp) : fclose(fp)) != 0 || !written) {
+    fprintf(stderr, "Failed to write %s\n", output.c_str());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,334 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common_utils.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly {
+
+// Spans of one model load, written as Chrome trace JSON that chrome://tracing
+// and Perfetto open. A load runs on the thread that called
+// TRITONREPOAGENT_ModelAction, transfers included, so the trace is reached
+// through a thread local. Only a listing that pages while transfers run adds
+// spans from a second thread, see ScopedTrace, so the lock around the events
+// is uncontended. With tracing off every span costs one thread local read.
+class Trace {
+ public:
+  explicit Trace(const std::string& name);
+
+  // Trace of the load running on this thread, nullptr when not tracing
+  static Trace*& Current();
+
+  // Backend modules have thread locals of their own, so they look up the
+  // agent's Current() through this hook, see backend.h
+  using CurrentFn = Trace*& (*)();
+  static CurrentFn& CurrentHook();
+
+  // Microseconds since the trace started
+  uint64_t Now() const;
+
+  // 'args' are JSON encoded members, see TraceSpan::Arg()
+  void AddSpan(
+      const char* name, const char* category, uint64_t start, uint64_t end,
+      const std::string& args);
+  // Span that overlaps others on the same thread, e.g. a transfer, shown on
+  // a track of its own
+  void AddAsyncSpan(
+      const char* name, const char* category, uint64_t start, uint64_t end,
+      const std::string& args);
+
+  // Write the trace to a new file in 'dir'
+  TRITONSERVER_Error* Write(const std::string& dir) const;
+
+ private:
+  struct Event {
+    const char* name;
+    const char* category;
+    // Async spans have an id, 0 for spans on the thread
+    uint64_t id;
+    uint64_t start;
+    uint64_t end;
+    std::string args;
+    long tid;
+  };
+
+  static long ThreadId();
+
+  std::string name_;
+  std::chrono::steady_clock::time_point start_;
+  std::chrono::system_clock::time_point wall_start_;
+  long tid_;
+  mutable std::mutex mu_;
+  std::vector<Event> events_;
+  uint64_t next_id_ = 1;
+};
+
+// Append a member to the JSON encoded 'args' of a span
+void AppendTraceArg(
+    std::string* args, const char* key, const std::string& value);
+void AppendTraceArg(std::string* args, const char* key, uint64_t value);
+
+// Make 'trace' the trace of the calling thread for the scope
+class ScopedTrace {
+ public:
+  explicit ScopedTrace(Trace* trace) : previous_(Trace::Current())
+  {
+    Trace::Current() = trace;
+  }
+  ~ScopedTrace() { Trace::Current() = previous_; }
+
+  ScopedTrace(const ScopedTrace&) = delete;
+  ScopedTrace& operator=(const ScopedTrace&) = delete;
+
+ private:
+  Trace* previous_;
+};
+
+// Span from construction to End() or destruction. 'name' and 'category'
+// must be string literals, they are kept without copying.
+class TraceSpan {
+ public:
+  TraceSpan(const char* name, const char* category)
+      : trace_(Trace::Current()), name_(name), category_(category)
+  {
+    if (trace_ != nullptr) {
+      start_ = trace_->Now();
+    }
+  }
+  ~TraceSpan() { End(); }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  bool Active() const { return trace_ != nullptr; }
+
+  template <typename T>
+  void Arg(const char* key, const T& value)
+  {
+    if (trace_ != nullptr) {
+      AppendTraceArg(&args_, key, value);
+    }
+  }
+
+  void End()
+  {
+    if (trace_ != nullptr) {
+      trace_->AddSpan(name_, category_, start_, trace_->Now(), args_);
+      trace_ = nullptr;
+    }
+  }
+
+ private:
+  Trace* trace_;
+  const char* name_;
+  const char* category_;
+  uint64_t start_ = 0;
+  std::string args_;
+};
+
+std::string
+JsonEscape(const std::string& value)
+{
+  std::string escaped;
+  escaped.reserve(value.size() + 2);
+  for (const char c : value) {
+    switch (c) {
+      case '"':
+        escaped += "\\\"";
+        break;
+      case '\\':
+        escaped += "\\\\";
+        break;
+      case '\n':
+        escaped += "\\n";
+        break;
+      case '\t':
+        escaped += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          char code[8];
+          snprintf(code, sizeof(code), "\\u%04x", c);
+          escaped += code;
+        } else {
+          escaped += c;
+        }
+    }
+  }
+  return escaped;
+}
+
+Trace::Trace(const std::string& name)
+    : name_(name), start_(std::chrono::steady_clock::now()),
+      wall_start_(std::chrono::system_clock::now()),
+      tid_(ThreadId())
+{
+  events_.reserve(256);
+}
+
+Trace*&
+Trace::Current()
+{
+  const CurrentFn hook = CurrentHook();
+  if (hook != nullptr) {
+    return hook();
+  }
+  static thread_local Trace* current = nullptr;
+  return current;
+}
+
+Trace::CurrentFn&
+Trace::CurrentHook()
+{
+  static CurrentFn hook = nullptr;
+  return hook;
+}
+
+long
+Trace::ThreadId()
+{
+  static thread_local const long tid = syscall(SYS_gettid);
+  return tid;
+}
+
+uint64_t
+Trace::Now() const
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start_)
+      .count();
+}
+
+void
+Trace::AddSpan(
+    const char* name, const char* category, uint64_t start, uint64_t end,
+    const std::string& args)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  events_.push_back(Event{name, category, 0, start, end, args, ThreadId()});
+}
+
+void
+Trace::AddAsyncSpan(
+    const char* name, const char* category, uint64_t start, uint64_t end,
+    const std::string& args)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  events_.push_back(
+      Event{name, category, next_id_++, start, end, args, ThreadId()});
+}
+
+TRITONSERVER_Error*
+Trace::Write(const std::string& dir) const
+{
+  // <dir>/<location>-<unix ms>-<pid>.json, safe for any location
+  std::string file_name;
+  for (const char c : name_) {
+    file_name += std::isalnum(static_cast<unsigned char>(c)) ? c : '_';
+  }
+  file_name += "-" +
+               std::to_string(
+                   std::chrono::duration_cast<std::chrono::milliseconds>(
+                       wall_start_.time_since_epoch())
+                       .count()) +
+               "-" + std::to_string(getpid()) + ".json";
+  RETURN_IF_ERROR(MakeDirectory(dir));
+  const std::string path = JoinPath({dir, file_name});
+
+  FILE* fp = fopen(path.c_str(), "w");
+  if (fp == nullptr) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to open trace file " + path + ", errno:" + strerror(errno))
+            .c_str());
+  }
+
+  auto common = [](long tid) {
+    return "\"pid\":" + std::to_string(getpid()) +
+           ",\"tid\":" + std::to_string(tid);
+  };
+  fprintf(
+      fp, "{\"traceEvents\":[\n{\"name\":\"thread_name\",\"ph\":\"M\",%s,"
+          "\"args\":{\"name\":\"%s\"}}",
+      common(tid_).c_str(), JsonEscape(name_).c_str());
+  std::lock_guard<std::mutex> lock(mu_);
+  for (const auto& event : events_) {
+    const std::string args = "{" + event.args + "}";
+    const std::string event_common = common(event.tid);
+    if (event.id == 0) {
+      fprintf(
+          fp,
+          ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,"
+          "\"dur\":%llu,%s,\"args\":%s}",
+          event.name, event.category,
+          static_cast<unsigned long long>(event.start),
+          static_cast<unsigned long long>(event.end - event.start),
+          event_common.c_str(), args.c_str());
+    } else {
+      // Nestable async begin and end with a shared id
+      fprintf(
+          fp,
+          ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"b\",\"id\":%llu,"
+          "\"ts\":%llu,%s,\"args\":%s}"
+          ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"e\",\"id\":%llu,"
+          "\"ts\":%llu,%s}",
+          event.name, event.category,
+          static_cast<unsigned long long>(event.id),
+          static_cast<unsigned long long>(event.start), event_common.c_str(),
+          args.c_str(), event.name, event.category,
+          static_cast<unsigned long long>(event.id),
+          static_cast<unsigned long long>(event.end), event_common.c_str());
+    }
+  }
+  fprintf(fp, "\n]}\n");
+
+  if (fclose(fp) != 0) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to write trace file " + path).c_str());
+  }
+  return nullptr;
+}
+
+void
+AppendTraceArg(std::string* args, const char* key, const std::string& value)
+{
+  *args += (args->empty() ? "\"" : ",\"") + std::string(key) + "\":\"" +
+           JsonEscape(value) + "\"";
+}
+
+void
+AppendTraceArg(std::string* args, const char* key, uint64_t value)
+{
+  *args += (args->empty() ? "\"" : ",\"") + std::string(key) +
+           "\":" + std::to_string(value);
+}
+
+}  // namespace triton::repoagent::dragonfly
@@ -0,0 +1,1712 @@
+/*
+ *     Copyright 2023 The Dragonfly Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "archive.h"
+#include "concurrency.h"
+#include "config.h"
+#include "curl/curl.h"
+#include "openssl/evp.h"
+#include "proxy_pool.h"
+#include "rate_limiter.h"
+#include "status.h"
+#include "trace.h"
+#include "triton/core/tritonserver.h"
+
+namespace triton::repoagent::dragonfly {
+
+// Connection cache, DNS cache and TLS sessions shared by every transfer of
+// the agent, so connections opened for one model load (or by the pre-warm at
+// server start) are reused by the next one instead of being torn down with
+// the handle that opened them.
+class ConnectionPool {
+ public:
+  ConnectionPool();
+  ~ConnectionPool();
+
+  CURLSH* Share() { return share_; }
+
+ private:
+  static void Lock(
+      CURL* handle, curl_lock_data data, curl_lock_access access,
+      void* userptr);
+  static void Unlock(CURL* handle, curl_lock_data data, void* userptr);
+
+  CURLSH* share_;
+  std::mutex mu_[CURL_LOCK_DATA_LAST];
+};
+
+ConnectionPool::ConnectionPool() : share_(curl_share_init())
+{
+  curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, Lock);
+  curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, Unlock);
+  curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+  curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+  curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+ConnectionPool::~ConnectionPool()
+{
+  curl_share_cleanup(share_);
+}
+
+void
+ConnectionPool::Lock(
+    CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr)
+{
+  static_cast<ConnectionPool*>(userptr)->mu_[data].lock();
+}
+
+void
+ConnectionPool::Unlock(CURL* handle, curl_lock_data data, void* userptr)
+{
+  static_cast<ConnectionPool*>(userptr)->mu_[data].unlock();
+}
+
+// Created by InitializeConnectionPool() when the agent is initialized and
+// released by FinalizeConnectionPool() once no transfer is left.
+std::unique_ptr<ConnectionPool>&
+GetConnectionPool()
+{
+  static std::unique_ptr<ConnectionPool> pool;
+  return pool;
+}
+
+void
+InitializeConnectionPool()
+{
+  if (!GetConnectionPool()) {
+    GetConnectionPool() = std::make_unique<ConnectionPool>();
+  }
+}
+
+void
+FinalizeConnectionPool()
+{
+  GetConnectionPool().reset();
+}
+
+// Apply the proxy, headers and filters in 'config' to a GET of 'url'. The
+// header list is returned through 'headers' and must be freed by the caller
+// once the transfer is done.
+TRITONSERVER_Error*
+SetupDragonflyRequest(
+    CURL* curl, const std::string& url, DragonflyConfig& config,
+    struct curl_slist** headers)
+{
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  // Registries redirect blob requests to their storage. curl does not send
+  // the authorization header to the other host. Through a unix socket the
+  // request target is pinned to 'url', so the caller follows redirects
+  // there, see RedirectTarget().
+  curl_easy_setopt(
+      curl, CURLOPT_FOLLOWLOCATION, config.proxy_unix_socket.empty() ? 1L : 0L);
+
+  if (config.http_version == "1.1") {
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+  } else if (config.http_version == "2") {
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_0);
+  } else if (config.http_version == "2-prior-knowledge") {
+    curl_easy_setopt(
+        curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+  } else if (!config.http_version.empty()) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INVALID_ARG,
+        ("Unsupported http_version: " + config.http_version).c_str());
+  }
+  if (config.http_version.compare(0, 1, "2") == 0) {
+    // Wait for a connection that can multiplex rather than opening another
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+  }
+
+  if (config.connect_timeout_ms > 0) {
+    curl_easy_setopt(
+        curl, CURLOPT_CONNECTTIMEOUT_MS,
+        static_cast<long>(config.connect_timeout_ms));
+  }
+  // Abort transfers, including ones still waiting for the first byte, that
+  // stay below 'low_speed_limit' for 'low_speed_time' seconds
+  if ((config.low_speed_limit > 0) && (config.low_speed_time > 0)) {
+    curl_easy_setopt(
+        curl, CURLOPT_LOW_SPEED_LIMIT,
+        static_cast<long>(config.low_speed_limit));
+    curl_easy_setopt(
+        curl, CURLOPT_LOW_SPEED_TIME, static_cast<long>(config.low_speed_time));
+  }
+
+  for (const auto* header_map : {&config.headers, &config.origin_headers}) {
+    for (const auto& header : *header_map) {
+      std::string header_str = header.first + ": " + header.second;
+      struct curl_slist* appended =
+          curl_slist_append(*headers, header_str.c_str());
+      if (!appended) {
+        return TRITONSERVER_ErrorNew(
+            TRITONSERVER_ERROR_INTERNAL, "Failed to append headers.");
+      }
+      *headers = appended;
+    }
+  }
+
+  if (!config.filter.empty()) {
+    std::ostringstream oss;
+    for (size_t i = 0; i < config.filter.size(); ++i) {
+      if (i != 0)
+        oss << "&";
+      oss << config.filter[i];
+    }
+    struct curl_slist* appended = curl_slist_append(
+        *headers, ("X-Dragonfly-Filter: " + oss.str()).c_str());
+    if (!appended) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INTERNAL, "Failed to append filters.");
+    }
+    *headers = appended;
+  }
+
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, *headers);
+
+  if (!config.proxy_unix_socket.empty()) {
+    // curl never combines a proxy with a unix socket, so talk to the local
+    // dfdaemon as a proxy ourselves: plain HTTP over the socket with the
+    // origin URL in absolute form as the request target.
+    const std::string::size_type scheme_end = url.find("://");
+    const std::string socket_url =
+        "http://" +
+        ((scheme_end == std::string::npos) ? url : url.substr(scheme_end + 3));
+    curl_easy_setopt(curl, CURLOPT_URL, socket_url.c_str());
+    curl_easy_setopt(curl, CURLOPT_REQUEST_TARGET, url.c_str());
+    curl_easy_setopt(
+        curl, CURLOPT_UNIX_SOCKET_PATH, config.proxy_unix_socket.c_str());
+  } else if (!config.proxy.empty()) {
+    curl_easy_setopt(curl, CURLOPT_PROXY, config.proxy.c_str());
+  }
+
+  if (GetConnectionPool()) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, GetConnectionPool()->Share());
+  }
+
+  return nullptr;
+}
+
+// Redirects followed by reissuing a request through a unix socket
+constexpr size_t kMaxSocketRedirects = 10;
+
+// Whether the request of 'url' on 'curl' got a redirect that curl did not
+// follow, with the absolute URL it points to in 'target', empty when the
+// response has no usable Location
+bool
+RedirectTarget(CURL* curl, const std::string& url, std::string* target)
+{
+  target->clear();
+  long status = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+  if ((status < 300) || (status >= 400)) {
+    return false;
+  }
+  // Resolved against 'url' rather than the socket URL curl requested, which
+  // has lost the scheme of the origin
+  struct curl_header* location = nullptr;
+  if (curl_easy_header(curl, "Location", 0, CURLH_HEADER, -1, &location) !=
+      CURLHE_OK) {
+    return true;
+  }
+  CURLU* resolved = curl_url();
+  char* resolved_url = nullptr;
+  if ((resolved != nullptr) &&
+      (curl_url_set(resolved, CURLUPART_URL, url.c_str(), 0) == CURLUE_OK) &&
+      (curl_url_set(resolved, CURLUPART_URL, location->value, 0) ==
+       CURLUE_OK) &&
+      (curl_url_get(resolved, CURLUPART_URL, &resolved_url, 0) == CURLUE_OK)) {
+    *target = resolved_url;
+    curl_free(resolved_url);
+  }
+  curl_url_cleanup(resolved);
+  return true;
+}
+
+// Whether a request that ended with 'result' failed because of the proxy
+// rather than the origin, see ProxyOutcome
+bool
+ProxyFailed(CURL* curl, CURLcode result)
+{
+  switch (result) {
+    case CURLE_COULDNT_RESOLVE_PROXY:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+      return true;
+    case CURLE_HTTP_RETURNED_ERROR: {
+      long status = 0;
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+      return (status == 502) || (status == 503) || (status == 504);
+    }
+    default:
+      return false;
+  }
+}
+
+// Charges the body of one transfer to the process-wide bandwidth limits
+// without blocking the thread that drives it. While a budget is in debt the
+// write callback returns CURL_WRITEFUNC_PAUSE, curl keeps the chunk, and the
+// loop driving the transfer resumes it once the hold is over. The other
+// transfers of the loop go on meanwhile, and curl's low speed check, the
+// hedge checks and TransferStats leave the held time out.
+struct Throttle {
+  // Pass the chunk of 'bytes' the write callback got, charging the network
+  // budget and with 'disk' the disk budget too. False when the callback is
+  // to pause the transfer.
+  bool Pass(uint64_t bytes, bool disk);
+  // Resume 'curl' if its hold is over at 'now'
+  void Resume(CURL* curl, std::chrono::steady_clock::time_point now);
+  // 'timeout_ms', or less to wake up when the hold is over
+  int PollTimeoutMs(
+      std::chrono::steady_clock::time_point now, int timeout_ms) const;
+  // Time held so far, the current hold included
+  std::chrono::steady_clock::duration Held(
+      std::chrono::steady_clock::time_point now) const;
+
+  FlowId flow = 0;
+  double weight = 1;
+  bool paused = false;
+  std::chrono::steady_clock::time_point paused_at;
+  std::chrono::steady_clock::time_point resume_at;
+  std::chrono::steady_clock::duration held{};
+  // Whether the network budget was charged for the chunk that curl passes
+  // again after the pause
+  bool charged = false;
+};
+
+bool
+Throttle::Pass(uint64_t bytes, bool disk)
+{
+  std::chrono::steady_clock::duration wait{};
+  BandwidthLimiter& limiter = GetBandwidthLimiter();
+  if (charged || limiter.network.TryAcquire(bytes, flow, weight, &wait)) {
+    charged = true;
+    if (!disk || limiter.disk.TryAcquire(bytes, flow, weight, &wait)) {
+      charged = false;
+      return true;
+    }
+  }
+  const auto now = std::chrono::steady_clock::now();
+  if (!paused) {
+    paused = true;
+    paused_at = now;
+  }
+  resume_at = now + wait;
+  return false;
+}
+
+void
+Throttle::Resume(CURL* curl, std::chrono::steady_clock::time_point now)
+{
+  if (!paused || (now < resume_at)) {
+    return;
+  }
+  held += now - paused_at;
+  paused = false;
+  // May pass the chunk to the write callback, which can pause it again
+  curl_easy_pause(curl, CURLPAUSE_CONT);
+}
+
+int
+Throttle::PollTimeoutMs(
+    std::chrono::steady_clock::time_point now, int timeout_ms) const
+{
+  if (!paused) {
+    return timeout_ms;
+  }
+  const auto left =
+      std::chrono::ceil<std::chrono::milliseconds>(resume_at - now).count();
+  return static_cast<int>(std::max<int64_t>(
+      1, std::min<int64_t>(left, timeout_ms)));
+}
+
+std::chrono::steady_clock::duration
+Throttle::Held(std::chrono::steady_clock::time_point now) const
+{
+  return paused ? held + (now - paused_at) : held;
+}
+
+// curl_easy_perform() of 'curl', whose write callback may hold it with
+// 'throttle', through a multi handle of its own so that it can be resumed
+CURLcode
+PerformThrottled(CURL* curl, Throttle* throttle)
+{
+  CURLM* multi = curl_multi_init();
+  if (!multi) {
+    return CURLE_OUT_OF_MEMORY;
+  }
+  if (curl_multi_add_handle(multi, curl) != CURLM_OK) {
+    curl_multi_cleanup(multi);
+    return CURLE_FAILED_INIT;
+  }
+  CURLcode result = CURLE_OK;
+  bool done = false;
+  while (!done) {
+    int running = 0;
+    if (curl_multi_perform(multi, &running) != CURLM_OK) {
+      result = CURLE_FAILED_INIT;
+      break;
+    }
+    CURLMsg* msg;
+    int msgs_left;
+    while ((msg = curl_multi_info_read(multi, &msgs_left)) != nullptr) {
+      if (msg->msg == CURLMSG_DONE) {
+        result = msg->data.result;
+        done = true;
+      }
+    }
+    if (!done) {
+      const auto now = std::chrono::steady_clock::now();
+      throttle->Resume(curl, now);
+      curl_multi_poll(
+          multi, nullptr, 0, throttle->PollTimeoutMs(now, 1000), nullptr);
+    }
+  }
+  curl_multi_remove_handle(multi, curl);
+  curl_multi_cleanup(multi);
+  return result;
+}
+
+// One GET of DownloadStream(), with the URL of a redirect it got through a
+// unix socket in 'redirect'
+TRITONSERVER_Error*
+DownloadStreamOnce(
+    const std::string& url, DragonflyConfig& config,
+    curl_write_callback write_data, void* userdata, std::string* redirect)
+{
+  CURL* curl;
+
+  curl = curl_easy_init();
+  if (!curl) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL, "Failed to initialize CURL.");
+  }
+
+  struct curl_slist* headers = NULL;
+
+  // One of 'proxies', or the origin while they are all down
+  ProxyLease lease;
+  std::unique_ptr<DragonflyConfig> proxy_config;
+  if (!config.proxies.empty() && GetProxyPool().Enabled()) {
+    lease = GetProxyPool().Acquire();
+    proxy_config.reset(new DragonflyConfig(
+        lease.endpoint.empty() ? config.OriginConfig()
+                               : config.ThroughProxy(lease.endpoint)));
+  }
+
+  auto cleanup = [&]() {
+    GetProxyPool().Release(&lease, ProxyOutcome::kNone);
+    if (headers)
+      curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
+  };
+
+  TRITONSERVER_Error* err = SetupDragonflyRequest(
+      curl, url, proxy_config ? *proxy_config : config, &headers);
+  if (err != nullptr) {
+    cleanup();
+    return err;
+  }
+
+  // Charge the shared network budget before handing data to 'write_data'
+  struct StreamSink {
+    CURL* curl;
+    curl_write_callback write_data;
+    void* userdata;
+    Throttle throttle;
+  } sink{curl, write_data, userdata, {}};
+  sink.throttle.flow = NewFlowId();
+  sink.throttle.weight = std::max<uint64_t>(config.weight, 1);
+
+  auto limited_write_data = [](char* ptr, size_t size, size_t nmemb,
+                               void* userdata) -> size_t {
+    StreamSink* sink = static_cast<StreamSink*>(userdata);
+    // The body of a redirect that is followed by reissuing the request
+    long status = 0;
+    curl_easy_getinfo(sink->curl, CURLINFO_RESPONSE_CODE, &status);
+    if ((status >= 300) && (status < 400)) {
+      return size * nmemb;
+    }
+    if (!sink->throttle.Pass(size * nmemb, false /* disk */)) {
+      return CURL_WRITEFUNC_PAUSE;
+    }
+    return sink->write_data(ptr, size, nmemb, sink->userdata);
+  };
+
+  curl_easy_setopt(
+      curl, CURLOPT_WRITEFUNCTION,
+      static_cast<curl_write_callback>(limited_write_data));
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sink);
+
+  CURLcode res = PerformThrottled(curl, &sink.throttle);
+  GetBandwidthLimiter().network.Cancel(sink.throttle.flow);
+  if (res == CURLE_OK) {
+    curl_off_t ttfb_us = 0;
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb_us);
+    GetProxyPool().Release(&lease, ProxyOutcome::kSuccess, ttfb_us / 1e6);
+  } else if (ProxyFailed(curl, res)) {
+    GetProxyPool().Release(&lease, ProxyOutcome::kFailure);
+  }
+
+  if (res != CURLE_OK) {
+    cleanup();
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL, curl_easy_strerror(res));
+  }
+  if (RedirectTarget(curl, url, redirect) && redirect->empty()) {
+    cleanup();
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Redirect without a Location for " + url).c_str());
+  }
+
+  cleanup();
+  return nullptr;
+}
+
+// GET 'url' through Dragonfly, passing the body to 'write_data' as it
+// arrives.
+TRITONSERVER_Error*
+DownloadStream(
+    const std::string& url, DragonflyConfig& config,
+    curl_write_callback write_data, void* userdata)
+{
+  std::string target = url;
+  for (size_t redirects = 0;; ++redirects) {
+    std::string redirect;
+    RETURN_IF_ERROR(
+        DownloadStreamOnce(target, config, write_data, userdata, &redirect));
+    if (redirect.empty()) {
+      return nullptr;
+    }
+    if (redirects == kMaxSocketRedirects) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INTERNAL,
+          ("Too many redirects for " + url).c_str());
+    }
+    target = redirect;
+  }
+}
+
+// Download the tar archive at 'url' and extract it into 'dir' while it
+// streams in, so that a model is fetched as one Dragonfly task instead of
+// one task per file.
+TRITONSERVER_Error*
+DownloadArchive(
+    const std::string& url, const std::string& dir,
+    ArchiveCompression compression, DragonflyConfig& config)
+{
+  struct ArchiveSink {
+    ArchiveExtractor extractor;
+    TRITONSERVER_Error* err;
+  } sink{{dir, compression}, nullptr};
+
+  auto write_data = [](char* ptr, size_t size, size_t nmemb,
+                       void* userdata) -> size_t {
+    ArchiveSink* sink = static_cast<ArchiveSink*>(userdata);
+    sink->err = sink->extractor.Write(ptr, size * nmemb);
+    // Returning short aborts the transfer with CURLE_WRITE_ERROR
+    return (sink->err == nullptr) ? (size * nmemb) : 0;
+  };
+
+  TRITONSERVER_Error* err = DownloadStream(url, config, write_data, &sink);
+  if (sink.err != nullptr) {
+    if (err != nullptr) {
+      TRITONSERVER_ErrorDelete(err);
+    }
+    return sink.err;
+  }
+  RETURN_IF_ERROR(err);
+  return sink.extractor.Finish();
+}
+
+// Time to first byte and throughput of the most recent transfers of the
+// process. Hedging compares in-flight transfers against them to tell a slow
+// peer from a large file.
+class TransferStats {
+ public:
+  void Record(double ttfb, double throughput);
+
+  // Return false until enough transfers have completed to be meaningful.
+  bool Percentiles(double* ttfb_p95, double* throughput_p5);
+
+ private:
+  static constexpr size_t kWindow = 256;
+  static constexpr size_t kMinSamples = 8;
+
+  std::mutex mu_;
+  std::vector<double> ttfb_;
+  std::vector<double> throughput_;
+  size_t next_ = 0;
+};
+
+void
+TransferStats::Record(double ttfb, double throughput)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  if (ttfb_.size() < kWindow) {
+    ttfb_.push_back(ttfb);
+    throughput_.push_back(throughput);
+  } else {
+    ttfb_[next_] = ttfb;
+    throughput_[next_] = throughput;
+    next_ = (next_ + 1) % kWindow;
+  }
+}
+
+bool
+TransferStats::Percentiles(double* ttfb_p95, double* throughput_p5)
+{
+  std::vector<double> ttfb, throughput;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (ttfb_.size() < kMinSamples) {
+      return false;
+    }
+    ttfb = ttfb_;
+    throughput = throughput_;
+  }
+
+  const size_t high = (ttfb.size() * 95) / 100;
+  std::nth_element(ttfb.begin(), ttfb.begin() + high, ttfb.end());
+  *ttfb_p95 = ttfb[high];
+
+  const size_t low = (throughput.size() * 5) / 100;
+  std::nth_element(
+      throughput.begin(), throughput.begin() + low, throughput.end());
+  *throughput_p5 = throughput[low];
+  return true;
+}
+
+TransferStats&
+GetTransferStats()
+{
+  static TransferStats stats;
+  return stats;
+}
+
+// A file for the TransferEngine to download
+struct TransferRequest {
+  std::string url;
+  std::string path;
+  // Expected size, preallocated when known
+  uint64_t size = 0;
+  // Lower case hex SHA-256 the file must have, checked as it is written
+  std::string sha256;
+  // Skip the proxy, see DragonflyConfig::FetchDirect()
+  bool direct = false;
+  // Called once the file is complete at 'path'
+  std::function<void()> on_complete;
+};
+
+// Transfers handed to a running TransferEngine by another thread, such as a
+// listing that is still paging. It is bounded, so URLs are signed shortly
+// before they are needed instead of expiring in a long backlog, and a
+// producer that is ahead of the transfers waits.
+class TransferFeed {
+ public:
+  explicit TransferFeed(size_t capacity)
+      : capacity_(std::max<size_t>(capacity, 1))
+  {
+  }
+
+  // Wait for room and queue a transfer. Returns false once the engine has
+  // stopped taking transfers, the producer should then give up.
+  bool Push(TransferRequest request);
+
+  // No more transfers will be pushed
+  void Close();
+
+  // Stop taking transfers and release a waiting producer
+  void Stop();
+
+ private:
+  friend class TransferEngine;
+
+  // Move the queued transfers to 'requests', waiting for one if 'wait' is
+  // set. Returns false once the feed is closed and empty.
+  bool Take(bool wait, std::vector<TransferRequest>* requests);
+
+  const size_t capacity_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<TransferRequest> items_;
+  bool closed_ = false;
+  bool stopped_ = false;
+  // Multi handle of the engine taking transfers, woken from its poll by a
+  // push
+  CURLM* multi_ = nullptr;
+};
+
+bool
+TransferFeed::Push(TransferRequest request)
+{
+  std::unique_lock<std::mutex> lock(mu_);
+  cv_.wait(lock, [this] { return stopped_ || (items_.size() < capacity_); });
+  if (stopped_) {
+    return false;
+  }
+  items_.push_back(std::move(request));
+  if (multi_ != nullptr) {
+    curl_multi_wakeup(multi_);
+  }
+  cv_.notify_all();
+  return true;
+}
+
+void
+TransferFeed::Close()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  closed_ = true;
+  if (multi_ != nullptr) {
+    curl_multi_wakeup(multi_);
+  }
+  cv_.notify_all();
+}
+
+void
+TransferFeed::Stop()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  stopped_ = true;
+  multi_ = nullptr;
+  items_.clear();
+  cv_.notify_all();
+}
+
+bool
+TransferFeed::Take(bool wait, std::vector<TransferRequest>* requests)
+{
+  std::unique_lock<std::mutex> lock(mu_);
+  if (wait) {
+    cv_.wait(lock, [this] { return closed_ || !items_.empty(); });
+  }
+  for (auto& request : items_) {
+    requests->push_back(std::move(request));
+  }
+  items_.clear();
+  cv_.notify_all();
+  return !closed_ || !requests->empty();
+}
+
+// Flag that abandons the transfers of every TransferEngine created on the
+// current thread while it is set, see ScopedCancel
+const std::atomic<bool>*&
+CurrentCancel()
+{
+  static thread_local const std::atomic<bool>* cancel = nullptr;
+  return cancel;
+}
+
+// Makes 'cancel' the current thread's CurrentCancel() for the lifetime of
+// the object
+class ScopedCancel {
+ public:
+  explicit ScopedCancel(const std::atomic<bool>* cancel)
+      : previous_(CurrentCancel())
+  {
+    CurrentCancel() = cancel;
+  }
+  ~ScopedCancel() { CurrentCancel() = previous_; }
+
+  ScopedCancel(const ScopedCancel&) = delete;
+  ScopedCancel& operator=(const ScopedCancel&) = delete;
+
+ private:
+  const std::atomic<bool>* previous_;
+};
+
+// Downloads files with a curl multi handle, running up to 'concurrency'
+// transfers at once (or as many as the ConcurrencyController allows when
+// 'max_concurrency' is set) over a shared connection pool in which HTTP/2
+// connections are multiplexed. When 'hedge_delay_ms' is set, a
+// transfer whose first byte is later than the recent p95, or whose
+// throughput is below the recent p5, gets a second request through
+// 'hedge_proxy' (or straight to the origin) and the first to finish wins. A
+// transfer that fails or stalls before being hedged fails over the same way.
+// With 'proxies', every request takes an endpoint from the ProxyPool; a
+// hedge goes to another endpoint than its primary when one is up, and a
+// transfer the proxy failed is restarted through another endpoint.
+//
+// Every engine is a flow of its own, weighted by 'weight', in the
+// FairShare of the concurrency slots and of the bandwidth limits. A
+// transfer the bandwidth limits hold is paused, see Throttle, while the
+// others go on. Run()
+// gives up, within one poll, once the CurrentCancel() flag of the thread
+// that created the engine is set.
+class TransferEngine {
+ public:
+  explicit TransferEngine(DragonflyConfig& config);
+  ~TransferEngine();
+
+  TransferEngine(const TransferEngine&) = delete;
+  TransferEngine& operator=(const TransferEngine&) = delete;
+
+  void Add(TransferRequest request);
+
+  // Run until every added transfer has completed or one has failed. With a
+  // 'feed', transfers pushed to it are run as well until it is closed; the
+  // caller stops the feed once Run() returns.
+  TRITONSERVER_Error* Run(TransferFeed* feed = nullptr);
+
+ private:
+  struct Transfer;
+
+  struct Attempt {
+    Transfer* transfer = nullptr;
+    bool hedge = false;
+    CURL* curl = nullptr;
+    struct curl_slist* headers = nullptr;
+    FILE* fp = nullptr;
+    std::string path;
+    // Digest of the bytes written so far, with a declared sha256
+    EVP_MD_CTX* digest = nullptr;
+    // Endpoint of 'proxies' the request went through
+    ProxyLease lease;
+    // Charges the bandwidth limits to the flow of the engine
+    Throttle throttle;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point first_byte;
+    uint64_t bytes = 0;
+    // Reports to the ConcurrencyController
+    bool adaptive = false;
+    // Trace of the load, and the time it started and spent writing, in
+    // microseconds
+    Trace* trace = nullptr;
+    uint64_t trace_start = 0;
+    uint64_t write_us = 0;
+  };
+
+  struct Transfer {
+    TransferRequest request;
+    // Primary and hedged request
+    std::unique_ptr<Attempt> attempts[2];
+    bool hedged = false;
+    bool done = false;
+    // Restarts after the origin turned the transfer away, and when the next
+    // one is due
+    size_t retries = 0;
+    std::chrono::steady_clock::time_point retry_at;
+    // Restarts through another endpoint, and the last one that failed
+    size_t failovers = 0;
+    std::string failed_proxy;
+    // Redirects followed through a unix socket, see RedirectTarget()
+    size_t redirects = 0;
+  };
+
+  // Restarts of a transfer that got 429 or 503 with an adaptive limit
+  static constexpr size_t kMaxCongestionRetries = 3;
+  // Restarts of a transfer that an endpoint of 'proxies' failed
+  static constexpr size_t kMaxProxyFailovers = 2;
+
+  // Add the transfers of 'feed' once the added ones have all started.
+  // Returns false once the feed is closed and drained.
+  bool TakeFeed(TransferFeed* feed);
+  TRITONSERVER_Error* StartQueued();
+  TRITONSERVER_Error* Start(Transfer* transfer, bool hedge);
+  // Config of the request 'attempt' is about to make, taking an endpoint of
+  // 'proxies' if they are used
+  DragonflyConfig& RequestConfig(Attempt* attempt);
+  void Stop(std::unique_ptr<Attempt>& attempt, bool remove_file);
+  static void TraceAttempt(const Attempt* attempt, const char* result);
+  // Whether the file written by 'attempt' has the declared sha256, if any
+  static bool DigestMatches(Attempt* attempt);
+  TRITONSERVER_Error* Complete(Attempt* attempt, CURLcode result);
+  // Recent percentiles of TransferStats, read at most once a wakeup and only
+  // when a transfer is past the hedge delay
+  struct HedgeStats {
+    bool read = false;
+    bool valid = false;
+    double ttfb_p95 = 0;
+    double throughput_p5 = 0;
+  };
+  TRITONSERVER_Error* MaybeHedge(Transfer* transfer, HedgeStats* stats);
+  static size_t WriteData(
+      char* ptr, size_t size, size_t nmemb, void* userdata);
+
+  DragonflyConfig& config_;
+  DragonflyConfig hedge_config_;
+  DragonflyConfig direct_config_;
+  // Whether requests are balanced across 'proxies', and the config through
+  // each endpoint used so far
+  bool pooled_;
+  std::map<std::string, DragonflyConfig> proxy_configs_;
+  CURLM* multi_;
+  std::vector<std::unique_ptr<Transfer>> transfers_;
+  // Index of the next transfer to start and number of running transfers
+  size_t next_ = 0;
+  // Index of the oldest started transfer that is not done, hedging only
+  // looks at the transfers from it up to 'next_'
+  size_t oldest_ = 0;
+  size_t pending_ = 0;
+  // Whether the ConcurrencyController sets the limit, and the slots taken
+  // from it
+  bool adaptive_;
+  size_t slots_ = 0;
+  FlowId flow_;
+  double weight_;
+  // Transfers waiting to be restarted
+  std::vector<Transfer*> retry_;
+  // Checked every time the engine wakes up, see CurrentCancel()
+  const std::atomic<bool>* cancel_;
+};
+
+TransferEngine::TransferEngine(DragonflyConfig& config)
+    : config_(config), hedge_config_(config),
+      direct_config_(config.OriginConfig()),
+      pooled_(!config.proxies.empty() && GetProxyPool().Enabled()),
+      multi_(curl_multi_init()),
+      adaptive_(GetConcurrencyController().Enabled()), flow_(NewFlowId()),
+      weight_(std::max<uint64_t>(config.weight, 1)), cancel_(CurrentCancel())
+{
+  if (multi_) {
+    curl_multi_setopt(multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    // Keep an idle connection for every transfer and hedge that may run at
+    // once. Recent curl versions otherwise keep only a few, so on HTTP/1.1
+    // the connection of a finished transfer is closed and the next transfer
+    // opens a new one.
+    curl_multi_setopt(
+        multi_, CURLMOPT_MAXCONNECTS,
+        static_cast<long>(
+            2 * std::max(config.concurrency, config.max_concurrency)));
+    if (config.max_concurrent_streams > 0) {
+      curl_multi_setopt(
+          multi_, CURLMOPT_MAX_CONCURRENT_STREAMS,
+          static_cast<long>(config.max_concurrent_streams));
+    }
+    if (config.max_host_connections > 0) {
+      curl_multi_setopt(
+          multi_, CURLMOPT_MAX_HOST_CONNECTIONS,
+          static_cast<long>(config.max_host_connections));
+    }
+  }
+
+  if (config.hedge_proxy.empty()) {
+    hedge_config_ = direct_config_;
+  } else {
+    hedge_config_.proxy = config.hedge_proxy;
+    hedge_config_.proxy_unix_socket.clear();
+  }
+}
+
+TransferEngine::~TransferEngine()
+{
+  for (auto& transfer : transfers_) {
+    for (auto& attempt : transfer->attempts) {
+      Stop(attempt, true /* remove_file */);
+    }
+  }
+  // Its wake-up must not outlive the multi handle
+  GetConcurrencyController().Cancel(flow_);
+  GetBandwidthLimiter().network.Cancel(flow_);
+  GetBandwidthLimiter().disk.Cancel(flow_);
+  curl_multi_cleanup(multi_);
+  GetConcurrencyController().Release(slots_);
+}
+
+void
+TransferEngine::Add(TransferRequest request)
+{
+  std::unique_ptr<Transfer> transfer(new Transfer());
+  transfer->request = std::move(request);
+  transfers_.push_back(std::move(transfer));
+}
+
+bool
+TransferEngine::TakeFeed(TransferFeed* feed)
+{
+  if (next_ < transfers_.size()) {
+    return true;
+  }
+  // Nothing else to do, wait for the feed
+  const bool idle = (pending_ == 0) && retry_.empty();
+  std::vector<TransferRequest> requests;
+  const bool open = feed->Take(idle, &requests);
+  for (auto& request : requests) {
+    Add(std::move(request));
+  }
+  return open;
+}
+
+TRITONSERVER_Error*
+TransferEngine::Run(TransferFeed* feed)
+{
+  if (!multi_) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL, "Failed to initialize CURL.");
+  }
+
+  if (feed != nullptr) {
+    std::lock_guard<std::mutex> lock(feed->mu_);
+    if (!feed->stopped_) {
+      feed->multi_ = multi_;
+    }
+  }
+  auto take_feed = [this, &feed]() {
+    if ((feed != nullptr) && !TakeFeed(feed)) {
+      feed = nullptr;
+    }
+  };
+
+  take_feed();
+  RETURN_IF_ERROR(StartQueued());
+  while ((pending_ > 0) || !retry_.empty() || (feed != nullptr)) {
+    if ((cancel_ != nullptr) && cancel_->load()) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_UNAVAILABLE, "Transfers cancelled");
+    }
+    int running;
+    CURLMcode mc = curl_multi_perform(multi_, &running);
+    if (mc != CURLM_OK) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INTERNAL, curl_multi_strerror(mc));
+    }
+
+    CURLMsg* msg;
+    int msgs_left;
+    while ((msg = curl_multi_info_read(multi_, &msgs_left)) != nullptr) {
+      if (msg->msg == CURLMSG_DONE) {
+        Attempt* attempt;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &attempt);
+        RETURN_IF_ERROR(Complete(attempt, msg->data.result));
+      }
+    }
+    if (adaptive_) {
+      GetConcurrencyController().Update();
+    }
+    take_feed();
+    RETURN_IF_ERROR(StartQueued());
+
+    while ((oldest_ < next_) && transfers_[oldest_]->done) {
+      ++oldest_;
+    }
+    if (config_.hedge_delay_ms > 0) {
+      HedgeStats stats;
+      for (size_t i = oldest_; i < next_; ++i) {
+        RETURN_IF_ERROR(MaybeHedge(transfers_[i].get(), &stats));
+      }
+    }
+
+    // Transfers held by the bandwidth limits go on once the hold is over
+    int timeout_ms = 100;
+    const auto now = std::chrono::steady_clock::now();
+    for (size_t i = oldest_; i < next_; ++i) {
+      for (auto& attempt : transfers_[i]->attempts) {
+        if (attempt && (attempt->curl != nullptr)) {
+          attempt->throttle.Resume(attempt->curl, now);
+          timeout_ms = attempt->throttle.PollTimeoutMs(now, timeout_ms);
+        }
+      }
+    }
+
+    // A feed wakes the poll up when it has transfers
+    if ((pending_ > 0) || !retry_.empty()) {
+      mc = curl_multi_poll(multi_, nullptr, 0, timeout_ms, nullptr);
+      if (mc != CURLM_OK) {
+        return TRITONSERVER_ErrorNew(
+            TRITONSERVER_ERROR_INTERNAL, curl_multi_strerror(mc));
+      }
+    }
+  }
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+TransferEngine::StartQueued()
+{
+  if (adaptive_) {
+    // A poll is woken up when it is this engine's turn for a slot
+    CURLM* multi = multi_;
+    auto wake = [multi]() { curl_multi_wakeup(multi); };
+    auto try_acquire = [&](const Transfer* transfer) {
+      return GetConcurrencyController().TryAcquire(
+          pending_ == 0 /* force */, flow_, weight_,
+          std::max<double>(transfer->request.size, 1), wake);
+    };
+    // A load with a 'concurrency' of its own stops short of it without
+    // waiting for a slot
+    auto capped = [this]() {
+      return (config_.concurrency_cap > 0) &&
+             (slots_ >= config_.concurrency_cap);
+    };
+    bool waiting = false;
+    const auto now = std::chrono::steady_clock::now();
+    size_t i = 0;
+    while ((i < retry_.size()) && !capped()) {
+      Transfer* transfer = retry_[i];
+      if (transfer->retry_at > now) {
+        ++i;
+        continue;
+      }
+      if (!try_acquire(transfer)) {
+        waiting = true;
+        ++i;
+        continue;
+      }
+      retry_.erase(retry_.begin() + i);
+      ++slots_;
+      RETURN_IF_ERROR(Start(transfer, false /* hedge */));
+    }
+    while ((next_ < transfers_.size()) && !capped()) {
+      if (!try_acquire(transfers_[next_].get())) {
+        waiting = true;
+        break;
+      }
+      ++slots_;
+      RETURN_IF_ERROR(Start(transfers_[next_++].get(), false /* hedge */));
+    }
+    if (!waiting) {
+      // Nothing to start, let the other loads have the free slots
+      GetConcurrencyController().Cancel(flow_);
+    }
+    return nullptr;
+  }
+
+  const size_t concurrency = std::max<uint64_t>(config_.concurrency, 1);
+  while ((pending_ < concurrency) && (next_ < transfers_.size())) {
+    RETURN_IF_ERROR(Start(transfers_[next_++].get(), false /* hedge */));
+  }
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+TransferEngine::Start(Transfer* transfer, bool hedge)
+{
+  std::unique_ptr<Attempt>& attempt = transfer->attempts[hedge ? 1 : 0];
+  attempt.reset(new Attempt());
+  attempt->transfer = transfer;
+  attempt->hedge = hedge;
+  // The hedge writes next to the destination and replaces it if it wins
+  const TransferRequest& request = transfer->request;
+  attempt->path = hedge ? (request.path + ".hedge") : request.path;
+  attempt->adaptive = adaptive_;
+  attempt->throttle.flow = flow_;
+  attempt->throttle.weight = weight_;
+  if (hedge) {
+    transfer->hedged = true;
+  } else {
+    ++pending_;
+  }
+
+  attempt->curl = curl_easy_init();
+  if (!attempt->curl) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL, "Failed to initialize CURL.");
+  }
+
+  // Replaced rather than truncated, it may be a link to the shared cache
+  remove(attempt->path.c_str());
+  attempt->fp = fopen(attempt->path.c_str(), "wb");
+  if (!attempt->fp) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to open file at path: " + attempt->path).c_str());
+  }
+  // Reserve the blocks up front so a large file is laid out contiguously.
+  // The size is kept, a short download is still caught by the size check,
+  // and filesystems without support just allocate as the file is written.
+  if (request.size > 0) {
+    fallocate(
+        fileno(attempt->fp), FALLOC_FL_KEEP_SIZE, 0,
+        static_cast<off_t>(request.size));
+  }
+  if (!request.sha256.empty()) {
+    attempt->digest = EVP_MD_CTX_new();
+    if ((attempt->digest == nullptr) ||
+        (EVP_DigestInit_ex(attempt->digest, EVP_sha256(), nullptr) != 1)) {
+      return TRITONSERVER_ErrorNew(
+          TRITONSERVER_ERROR_INTERNAL, "Failed to initialize SHA-256.");
+    }
+  }
+
+  RETURN_IF_ERROR(SetupDragonflyRequest(
+      attempt->curl, request.url, RequestConfig(attempt.get()),
+      &attempt->headers));
+  curl_easy_setopt(attempt->curl, CURLOPT_WRITEFUNCTION, WriteData);
+  curl_easy_setopt(attempt->curl, CURLOPT_WRITEDATA, attempt.get());
+  curl_easy_setopt(attempt->curl, CURLOPT_PRIVATE, attempt.get());
+
+  attempt->start = std::chrono::steady_clock::now();
+  attempt->trace = Trace::Current();
+  if (attempt->trace != nullptr) {
+    attempt->trace_start = attempt->trace->Now();
+  }
+  CURLMcode mc = curl_multi_add_handle(multi_, attempt->curl);
+  if (mc != CURLM_OK) {
+    curl_easy_cleanup(attempt->curl);
+    attempt->curl = nullptr;
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL, curl_multi_strerror(mc));
+  }
+  return nullptr;
+}
+
+DragonflyConfig&
+TransferEngine::RequestConfig(Attempt* attempt)
+{
+  Transfer* transfer = attempt->transfer;
+  if (transfer->request.direct) {
+    return direct_config_;
+  }
+  if (!pooled_ || (attempt->hedge && !config_.hedge_proxy.empty())) {
+    return attempt->hedge ? hedge_config_ : config_;
+  }
+
+  if (attempt->hedge) {
+    // Another endpoint than the primary's, or the origin
+    const Attempt* primary = transfer->attempts[0].get();
+    attempt->lease = GetProxyPool().Acquire(
+        (primary != nullptr) ? primary->lease.endpoint : "",
+        true /* origin */);
+  } else {
+    attempt->lease = GetProxyPool().Acquire(transfer->failed_proxy);
+  }
+  if (attempt->lease.endpoint.empty()) {
+    return direct_config_;
+  }
+  auto itr = proxy_configs_.find(attempt->lease.endpoint);
+  if (itr == proxy_configs_.end()) {
+    itr = proxy_configs_
+              .emplace(
+                  attempt->lease.endpoint,
+                  config_.ThroughProxy(attempt->lease.endpoint))
+              .first;
+  }
+  return itr->second;
+}
+
+void
+TransferEngine::Stop(std::unique_ptr<Attempt>& attempt, bool remove_file)
+{
+  if (!attempt) {
+    return;
+  }
+  if (attempt->fp) {
+    // Still running, it failed or lost against the other request
+    TraceAttempt(attempt.get(), "cancelled");
+  }
+  if (attempt->curl) {
+    curl_multi_remove_handle(multi_, attempt->curl);
+    curl_easy_cleanup(attempt->curl);
+  }
+  if (attempt->headers) {
+    curl_slist_free_all(attempt->headers);
+  }
+  GetProxyPool().Release(&attempt->lease, ProxyOutcome::kNone);
+  EVP_MD_CTX_free(attempt->digest);
+  if (attempt->fp) {
+    fclose(attempt->fp);
+    if (remove_file) {
+      remove(attempt->path.c_str());
+    }
+  }
+  attempt.reset();
+}
+
+TRITONSERVER_Error*
+TransferEngine::Complete(Attempt* attempt, CURLcode result)
+{
+  Transfer* transfer = attempt->transfer;
+  std::unique_ptr<Attempt>& self = transfer->attempts[attempt->hedge ? 1 : 0];
+  std::unique_ptr<Attempt>& other = transfer->attempts[attempt->hedge ? 0 : 1];
+
+  // A body that is not the declared one fails the attempt like a transfer
+  // error, so a corrupt copy from the proxy fails over to the origin
+  std::string reason;
+  std::string redirect;
+  if (result != CURLE_OK) {
+    reason = curl_easy_strerror(result);
+  } else if (RedirectTarget(
+                 attempt->curl, transfer->request.url, &redirect)) {
+    if (redirect.empty()) {
+      reason = "redirect without a Location";
+    } else if (transfer->redirects == kMaxSocketRedirects) {
+      reason = "too many redirects";
+    } else {
+      // Issued again for the target, which hedges and restarts use as well
+      TraceAttempt(attempt, "redirect");
+      const bool hedge = attempt->hedge;
+      fclose(attempt->fp);
+      attempt->fp = nullptr;
+      remove(attempt->path.c_str());
+      Stop(self, false /* remove_file */);
+      ++transfer->redirects;
+      transfer->request.url = redirect;
+      if (!hedge) {
+        --pending_;
+      }
+      return Start(transfer, hedge);
+    }
+  } else if (!DigestMatches(attempt)) {
+    reason = "SHA-256 mismatch";
+  }
+
+  if (!reason.empty()) {
+    bool overloaded = false;
+    if (adaptive_ && (result != CURLE_OK)) {
+      long status = 0;
+      curl_easy_getinfo(attempt->curl, CURLINFO_RESPONSE_CODE, &status);
+      overloaded = (status == 429) || (status == 503);
+      if (overloaded) {
+        GetConcurrencyController().RecordCongestion(
+            "HTTP " + std::to_string(status));
+      } else if (result == CURLE_OPERATION_TIMEDOUT) {
+        GetConcurrencyController().RecordCongestion(reason);
+      }
+    }
+    TraceAttempt(attempt, reason.c_str());
+    // A digest mismatch is left to the failover below: it may as well be a
+    // stale manifest
+    const bool proxy_failed = !attempt->lease.endpoint.empty() &&
+                              (result != CURLE_OK) &&
+                              ProxyFailed(attempt->curl, result);
+    if (proxy_failed) {
+      transfer->failed_proxy = attempt->lease.endpoint;
+      GetProxyPool().Release(&attempt->lease, ProxyOutcome::kFailure);
+    }
+    fclose(attempt->fp);
+    attempt->fp = nullptr;
+    remove(attempt->path.c_str());
+    Stop(self, false /* remove_file */);
+    if (other) {
+      // The other request may still succeed
+      return nullptr;
+    }
+    if (overloaded && (transfer->retries < kMaxCongestionRetries)) {
+      // Give the slot back and start over once the limit has come down
+      ++transfer->retries;
+      transfer->retry_at = std::chrono::steady_clock::now() +
+                           std::chrono::seconds(1 << transfer->retries);
+      retry_.push_back(transfer);
+      --pending_;
+      --slots_;
+      GetConcurrencyController().Release();
+      return nullptr;
+    }
+    if (proxy_failed && (transfer->failovers < kMaxProxyFailovers)) {
+      // Start over through another endpoint, keeping the slot
+      ++transfer->failovers;
+      --pending_;
+      return Start(transfer, false /* hedge */);
+    }
+    if ((config_.hedge_delay_ms > 0) && !transfer->hedged) {
+      return Start(transfer, true /* hedge */);
+    }
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to download " + transfer->request.path + ": " + reason)
+            .c_str());
+  }
+
+  curl_off_t ttfb_us = 0, total_us = 0, bytes = 0;
+  curl_easy_getinfo(attempt->curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb_us);
+  curl_easy_getinfo(attempt->curl, CURLINFO_TOTAL_TIME_T, &total_us);
+  curl_easy_getinfo(attempt->curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+  // Without the time the bandwidth limits held the transfer
+  const curl_off_t receiving_us =
+      total_us - ttfb_us -
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          attempt->throttle.held)
+          .count();
+  if (receiving_us > 0) {
+    GetTransferStats().Record(
+        ttfb_us / 1e6, static_cast<double>(bytes) * 1e6 / receiving_us);
+  }
+
+  Stop(other, true /* remove_file */);
+  TraceAttempt(attempt, "ok");
+  GetProxyPool().Release(
+      &attempt->lease, ProxyOutcome::kSuccess, ttfb_us / 1e6);
+  int status = fclose(attempt->fp);
+  attempt->fp = nullptr;
+  if (status != 0) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to write file at path: " + attempt->path).c_str());
+  }
+  if (attempt->hedge &&
+      (rename(attempt->path.c_str(), transfer->request.path.c_str()) != 0)) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to rename " + attempt->path + " to " + transfer->request.path)
+            .c_str());
+  }
+  Stop(self, false /* remove_file */);
+  transfer->done = true;
+  if (transfer->request.on_complete) {
+    transfer->request.on_complete();
+  }
+  --pending_;
+  if (adaptive_) {
+    --slots_;
+    GetConcurrencyController().Release();
+  }
+  return nullptr;
+}
+
+TRITONSERVER_Error*
+TransferEngine::MaybeHedge(Transfer* transfer, HedgeStats* stats)
+{
+  const Attempt* primary = transfer->attempts[0].get();
+  // A transfer held by the bandwidth limits is not slow
+  if (transfer->done || transfer->hedged || !primary ||
+      primary->throttle.paused) {
+    return nullptr;
+  }
+
+  const auto now = std::chrono::steady_clock::now();
+  const double delay = config_.hedge_delay_ms / 1000.0;
+  const double elapsed =
+      std::chrono::duration<double>(now - primary->start).count();
+  if (elapsed < delay) {
+    return nullptr;
+  }
+
+  if (!stats->read) {
+    stats->valid =
+        GetTransferStats().Percentiles(&stats->ttfb_p95, &stats->throughput_p5);
+    stats->read = true;
+  }
+  const bool has_stats = stats->valid;
+  const double ttfb_p95 = stats->ttfb_p95;
+  const double throughput_p5 = stats->throughput_p5;
+
+  bool slow;
+  if (primary->first_byte == std::chrono::steady_clock::time_point()) {
+    slow = !has_stats || (elapsed > ttfb_p95);
+  } else {
+    const auto receiving_time =
+        now - primary->first_byte - primary->throttle.Held(now);
+    const double receiving =
+        std::chrono::duration<double>(receiving_time).count();
+    slow = has_stats && (receiving >= delay) &&
+           ((primary->bytes / receiving) < throughput_p5);
+  }
+
+  if (slow) {
+    return Start(transfer, true /* hedge */);
+  }
+  return nullptr;
+}
+
+size_t
+TransferEngine::WriteData(char* ptr, size_t size, size_t nmemb, void* userdata)
+{
+  Attempt* attempt = static_cast<Attempt*>(userdata);
+  const size_t len = size * nmemb;
+  if (attempt->first_byte == std::chrono::steady_clock::time_point()) {
+    attempt->first_byte = std::chrono::steady_clock::now();
+    if (attempt->adaptive) {
+      GetConcurrencyController().RecordTtfb(
+          std::chrono::duration<double>(attempt->first_byte - attempt->start)
+              .count());
+    }
+  }
+  if (!attempt->throttle.Pass(len, true /* disk */)) {
+    return CURL_WRITEFUNC_PAUSE;
+  }
+  attempt->bytes += len;
+  if (attempt->adaptive) {
+    GetConcurrencyController().AddBytes(len);
+  }
+  if ((attempt->digest != nullptr) &&
+      (EVP_DigestUpdate(attempt->digest, ptr, len) != 1)) {
+    return 0;
+  }
+
+  if (attempt->trace == nullptr) {
+    return fwrite(ptr, 1, len, attempt->fp);
+  }
+  const uint64_t write_start = attempt->trace->Now();
+  const size_t written = fwrite(ptr, 1, len, attempt->fp);
+  attempt->write_us += attempt->trace->Now() - write_start;
+  return written;
+}
+
+bool
+TransferEngine::DigestMatches(Attempt* attempt)
+{
+  const std::string& expected = attempt->transfer->request.sha256;
+  if (expected.empty()) {
+    return true;
+  }
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int size = 0;
+  if (EVP_DigestFinal_ex(attempt->digest, digest, &size) != 1) {
+    return false;
+  }
+  static const char kHex[] = "0123456789abcdef";
+  std::string hex;
+  for (unsigned int i = 0; i < size; ++i) {
+    hex += kHex[digest[i] >> 4];
+    hex += kHex[digest[i] & 0xf];
+  }
+  return hex == expected;
+}
+
+void
+TransferEngine::TraceAttempt(const Attempt* attempt, const char* result)
+{
+  if (attempt->trace == nullptr) {
+    return;
+  }
+  std::string args;
+  AppendTraceArg(&args, "url", attempt->transfer->request.url);
+  AppendTraceArg(&args, "path", attempt->path);
+  AppendTraceArg(&args, "result", result);
+  AppendTraceArg(&args, "hedge", attempt->hedge);
+  AppendTraceArg(&args, "direct", attempt->transfer->request.direct);
+  if (!attempt->lease.endpoint.empty()) {
+    AppendTraceArg(&args, "proxy", attempt->lease.endpoint);
+  }
+  AppendTraceArg(&args, "bytes", attempt->bytes);
+  if (attempt->curl != nullptr) {
+    // Proxy time to first byte as seen by curl
+    curl_off_t ttfb_us = 0;
+    curl_easy_getinfo(attempt->curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb_us);
+    AppendTraceArg(&args, "ttfb_us", ttfb_us);
+  }
+  AppendTraceArg(
+      &args, "throttle_us",
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          attempt->throttle.Held(std::chrono::steady_clock::now()))
+          .count());
+  AppendTraceArg(&args, "write_us", attempt->write_us);
+  attempt->trace->AddAsyncSpan(
+      attempt->hedge ? "Hedge" : "Transfer", "transfer", attempt->trace_start,
+      attempt->trace->Now(), args);
+}
+
+TRITONSERVER_Error*
+DownloadFile(
+    const std::string& url, const std::string& path, DragonflyConfig& config)
+{
+  TransferEngine engine(config);
+  TransferRequest request;
+  request.url = url;
+  request.path = path;
+  engine.Add(std::move(request));
+  return engine.Run();
+}
+
+// Response of a small request made straight to the origin, e.g. a listing
+// or a manifest
+struct HttpResponse {
+  long status = 0;
+  std::string body;
+  // Header names are lower-cased, only the final response after redirects
+  // is kept
+  std::map<std::string, std::string> headers;
+  std::string content_type;
+  curl_off_t content_length = -1;
+};
+
+size_t
+HttpResponseBody(char* ptr, size_t size, size_t nmemb, void* userdata)
+{
+  static_cast<HttpResponse*>(userdata)->body.append(ptr, size * nmemb);
+  return size * nmemb;
+}
+
+size_t
+HttpResponseHeader(char* ptr, size_t size, size_t nmemb, void* userdata)
+{
+  HttpResponse* response = static_cast<HttpResponse*>(userdata);
+  const std::string line(ptr, size * nmemb);
+  if (line.compare(0, 5, "HTTP/") == 0) {
+    // Status line of the next response in a redirect chain
+    response->headers.clear();
+    return size * nmemb;
+  }
+  const size_t colon = line.find(':');
+  if (colon != std::string::npos) {
+    std::string name = line.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    const size_t value_start = line.find_first_not_of(" \t", colon + 1);
+    const size_t value_end = line.find_last_not_of(" \t\r\n");
+    response->headers[name] =
+        ((value_start == std::string::npos) || (value_end < value_start))
+            ? ""
+            : line.substr(value_start, value_end - value_start + 1);
+  }
+  return size * nmemb;
+}
+
+// GET, or HEAD if 'head' is set, 'url' without the proxy. Any HTTP status is
+// returned in 'response', only transport failures are errors.
+TRITONSERVER_Error*
+FetchUrl(
+    const std::string& url, const std::vector<std::string>& headers, bool head,
+    HttpResponse* response)
+{
+  TraceSpan span("FetchUrl", "http");
+  span.Arg("url", url);
+  CURL* curl = curl_easy_init();
+  if (!curl) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL, "Failed to initialize curl.");
+  }
+  struct curl_slist* header_list = nullptr;
+  for (const auto& header : headers) {
+    header_list = curl_slist_append(header_list, header.c_str());
+  }
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, header_list);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 30L);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HttpResponseHeader);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, response);
+  if (head) {
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+  } else {
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, HttpResponseBody);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
+  }
+  if (GetConnectionPool()) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, GetConnectionPool()->Share());
+  }
+
+  CURLcode res = curl_easy_perform(curl);
+  if (res == CURLE_OK) {
+    char* content_type = nullptr;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response->status);
+    curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type);
+    curl_easy_getinfo(
+        curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &response->content_length);
+    if (content_type != nullptr) {
+      response->content_type = content_type;
+    }
+    span.Arg("status", response->status);
+  }
+  curl_slist_free_all(header_list);
+  curl_easy_cleanup(curl);
+  if (res != CURLE_OK) {
+    return TRITONSERVER_ErrorNew(
+        TRITONSERVER_ERROR_INTERNAL,
+        ("Failed to fetch " + url + ": " + curl_easy_strerror(res)).c_str());
+  }
+  return nullptr;
+}
+
+// Open connections to the proxy and to the storage endpoints in 'urls' ahead
+// of the first model load. Every URL is requested with HEAD through the
+// configured proxy, or every one of 'proxies', which leaves the proxy
+// connection (and for https, the tunnel and TLS session to the endpoint) in
+// the shared connection pool. The
+// response status does not matter and failures are ignored: this is only an
+// optimization.
+void
+PrewarmConnections(
+    const std::vector<std::string>& urls, DragonflyConfig& config)
+{
+  if (urls.empty()) {
+    return;
+  }
+
+  std::vector<DragonflyConfig> configs;
+  for (const auto& endpoint : config.proxies) {
+    configs.push_back(config.ThroughProxy(endpoint));
+  }
+  if (configs.empty()) {
+    configs.push_back(config);
+  }
+
+  CURLM* multi = curl_multi_init();
+  if (!multi) {
+    LOG_MESSAGE(
+        TRITONSERVER_LOG_WARN,
+        "dragonfly: failed to initialize CURL, connections are not prewarmed");
+    return;
+  }
+  std::vector<std::pair<CURL*, struct curl_slist*>> requests;
+  for (size_t i = 0; i < urls.size() * configs.size(); ++i) {
+    const std::string& url = urls[i % urls.size()];
+    DragonflyConfig& request_config = configs[i / urls.size()];
+    CURL* curl = curl_easy_init();
+    if (!curl) {
+      LOG_MESSAGE(
+          TRITONSERVER_LOG_WARN,
+          ("dragonfly: failed to initialize CURL, " + url + " is not prewarmed")
+              .c_str());
+      continue;
+    }
+    struct curl_slist* headers = nullptr;
+    TRITONSERVER_Error* err =
+        SetupDragonflyRequest(curl, url, request_config, &headers);
+    if (err != nullptr) {
+      TRITONSERVER_ErrorDelete(err);
+      curl_slist_free_all(headers);
+      curl_easy_cleanup(curl);
+      continue;
+    }
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 0L);
+    // Do not hold up server start on an unreachable endpoint
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 10000L);
+    curl_multi_add_handle(multi, curl);
+    requests.emplace_back(curl, headers);
+  }
+
+  int running = 0;
+  do {
+    if (curl_multi_perform(multi, &running) != CURLM_OK) {
+      break;
+    }
+    if (running > 0) {
+      curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+    }
+  } while (running > 0);
+
+  for (auto& request : requests) {
+    curl_multi_remove_handle(multi, request.first);
+    curl_easy_cleanup(request.first);
+    curl_slist_free_all(request.second);
+  }
+  curl_multi_cleanup(multi);
+}
+
+}  // namespace triton::repoagent::dragonfly